@@ -1,19 +1,41 @@
 /*
 
-  USAGE: cat <LINE-DELIMITED GEOJSON> add_geometry <INDEX DIR>
+  USAGE: cat <LINE-DELIMITED GEOJSON> add_geometry <INDEX DIR> [OPTIONS]
 
   Reads a stream of GeoJSON objects (line-delimited) and looks up the previous
   versions of each object in the rocksdb locations INDEX.
 
+  With --minor-versions, the full node histories are not attached. Instead each
+  @history entry gets the geometry of that major version ("g") and the feature
+  gets a compact `minorVersions` list of the node moves in between.
+
+  With --batch N, features are written in batches of N per output shard, and
+  each node history is written once per batch instead of once per feature
+  (see node_batch.hpp).
+
+  OPTIONS:
+    --minor-versions  see above
+    --batch N         see above, not with --minor-versions
+    --input FILE      read FILE instead of stdin; gzip input is detected
+    --output FILE     write FILE instead of stdout; gzip if FILE ends in .gz
+    --gzip            write gzip to stdout
+    --threads N       number of compression threads (default: all cores)
+    --shards N        split the output into N files OUTPUT.0 ... (needs --output)
+    --shard-key KEY   `id` (default) or `tile`, see shards.hpp
+
+  Output is written in large blocks, not flushed per feature, and every
+  feature is processed in a reused FeatureArena (see feature_arena.hpp).
+
 */
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <sstream>
 #include <map>
 #include <iterator>
-#include <set>
+#include <vector>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
@@ -27,146 +49,68 @@
 #include "rocksdb/db.h"
 
 #include "db.hpp"
-#include "pbf_encoding.hpp"
-#include "json_encoding.hpp"
+#include "enrich.hpp"
+#include "feature_arena.hpp"
+#include "node_batch.hpp"
+#include "shards.hpp"
+
+osmwayback::EnrichStats stats;
 
-int node_lookup_failures = 0;
+osmwayback::NodeBatchStats batch_stats;
 
-void fetchNodeGeometries(ObjectStore* store, const std::string line) {
-    rapidjson::Document geojson_doc;
+bool MINOR_VERSIONS = false;
+
+//Open batches, one per output shard; empty without --batch
+std::vector<osmwayback::NodeBatch> batches;
+size_t BATCH_SIZE = 0;
+
+void fetchNodeGeometries(ObjectStore* store, const std::string& line, osmwayback::ShardedWriter* output) {
+    osmwayback::FeatureArena& arena = osmwayback::thread_arena();
+    arena.reset();
+    rapidjson::Document& geojson_doc = arena.document();
 
     if(geojson_doc.Parse<0>(line.c_str()).HasParseError()) {
         std::cerr << "ERROR" << std::endl;
         return;
     }
 
-    const std::string obj_type = geojson_doc["properties"]["@type"].GetString();
+    const rapidjson::Value& obj_type = geojson_doc["properties"]["@type"];
 
     //If object is not a node, there is a @history property with nodeRefs.
-    if (obj_type != "node"){
-
+    if (obj_type != "node" && MINOR_VERSIONS){
         try{
-            //Start a set of unique node IDs ever associated with any version of this object
-            std::set<std::string> nodeRefs;
-
-            //Iterate through the history object, looking for node references
-            for (auto& histObj : geojson_doc["properties"]["@history"].GetArray()){
-
-                //If there are node references
-                if (histObj.HasMember("n") ){
-                    //Add them to the nodeRefs set.
-                    for (auto& nodeRef : histObj["n"].GetArray()){
-                        nodeRefs.insert(std::to_string(nodeRef.GetInt64()));
-                    }
-                }
-            }
-
-            rapidjson::Value nodeLocations(rapidjson::kObjectType);
-            /* nodeLocations will become the following object.
-             * {
-                  nodeID : {
-                    changesetID : {
-                      p: [lon, lat]
-                      i: <version>
-                      u: <uid>
-                      h: <handle>
-                    },
-                    changesetID : ...
-                  },
-                  nodeID : ...
-                }
-             */
-
-            //Iterate through the set of unique node IDs associated with this object
-            for (std::set<std::string>::iterator it=nodeRefs.begin(); it!=nodeRefs.end(); ++it){
-
-                std::string rocksEntry;
-                rocksdb::Status status = store->get_node_locations(*it, &rocksEntry);
-
-                //rocksEntry is now the string from rocksDB, parse it into JSON
-                if(status.ok()){
-                    rapidjson::Value nodeIDStr;
-                    nodeIDStr.SetString(*it, geojson_doc.GetAllocator()); //Set the ID of the node
-
-                    rapidjson::Document thisNodeHistory;
-                    thisNodeHistory.Parse<rapidjson::kParseFullPrecisionFlag>( rocksEntry.c_str() );
-
-                    //DEBUGGING: Print out the string from rocksDB
-                    // std::cerr << rocksEntry.c_str() << std::endl;
-
-                    //A new object we'll deepcopy values into?
-                    rapidjson::Value thisNodeHistoryNew(rapidjson::kObjectType);
-
-                    //Iterate through the history of this individual node
-                    for ( rapidjson::Value::ConstMemberIterator itr = thisNodeHistory.MemberBegin();
-                          itr != thisNodeHistory.MemberEnd();
-                          ++itr) {   //iterate through object
-
-                        //Debugging: Print the ID of the changeset
-                        // std::cerr << itr->name.GetString() << " "; //key name
-
-                        rapidjson::Value changesetID;
-                        changesetID.SetString(itr->name.GetString(), geojson_doc.GetAllocator());
-
-                        rapidjson::Value nodeVersion(rapidjson::kObjectType);
-                        nodeVersion.SetObject();
-
-                        rapidjson::Value handle;
-                        handle.SetString(itr->value["h"].GetString(), geojson_doc.GetAllocator());
-                        nodeVersion.AddMember("h",handle,geojson_doc.GetAllocator());
-
-                        rapidjson::Value uid;
-                        uid.SetInt(itr->value["u"].GetInt());
-                        nodeVersion.AddMember("u",uid,geojson_doc.GetAllocator());
-
-                        rapidjson::Value version;
-                        version.SetInt(itr->value["i"].GetInt());
-                        nodeVersion.AddMember("i",version,geojson_doc.GetAllocator());
-
-                        rapidjson::Value timestamp;
-                        timestamp.SetInt64(itr->value["t"].GetInt64());
-                        nodeVersion.AddMember("t",timestamp,geojson_doc.GetAllocator());
-
-                        rapidjson::Value changeset;
-                        changeset.SetInt64(itr->value["c"].GetInt64());
-                        nodeVersion.AddMember("c",changeset,geojson_doc.GetAllocator());
-
-                        if(itr->value["p"].IsArray()){
-                            rapidjson::Value coordinates(rapidjson::kArrayType);
-                            coordinates.PushBack(itr->value["p"][0].GetDouble(), geojson_doc.GetAllocator());
-                            coordinates.PushBack(itr->value["p"][1].GetDouble(), geojson_doc.GetAllocator());
-                            nodeVersion.AddMember("p",coordinates,geojson_doc.GetAllocator());
-                        }
-
-                        thisNodeHistoryNew.AddMember(changesetID,nodeVersion,geojson_doc.GetAllocator());
-                    }
-
-                    nodeLocations.AddMember(nodeIDStr,thisNodeHistoryNew,geojson_doc.GetAllocator());
-
-                }else{
-                    node_lookup_failures++;
-                }
-            }
-            if (!nodeLocations.Empty()){
-                geojson_doc.AddMember("nodeLocations",nodeLocations,geojson_doc.GetAllocator());
-            }else{
-              //Node locations is empty
-            }
+            osmwayback::add_minor_versions(store, geojson_doc, &stats);
+        } catch (const std::exception& ex) {
+            std::cerr<< ex.what() << std::endl;
+        }
+    } else if (obj_type != "node" && BATCH_SIZE == 0){
 
+        try{
+            osmwayback::add_node_locations(store, geojson_doc, &stats);
         } catch (const std::exception& ex) {
             std::cerr<< ex.what() << std::endl;
         }
     }
 
     //Now write the object back out
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    const rapidjson::StringBuffer& buffer = arena.write(geojson_doc);
+    const size_t shard = output->shard(geojson_doc);
 
-    geojson_doc.Accept(writer);
-    std::string s(buffer.GetString(), buffer.GetSize());
+    if (BATCH_SIZE > 0) {
+        osmwayback::NodeBatch& batch = batches[shard];
+        try{
+            batch.add(geojson_doc, buffer.GetString(), buffer.GetSize(), &batch_stats);
+        } catch (const std::exception& ex) {
+            std::cerr<< ex.what() << std::endl;
+        }
+        if (batch.size() >= BATCH_SIZE) {
+            batch.write(store, output, shard, &stats, &batch_stats);
+        }
+        return;
+    }
 
-    //Write new geojson_doc with nodeLocations to stdout
-    std::cout << s << std::endl;
+    //Write new geojson_doc with nodeLocations to the output
+    output->write_line(shard, buffer.GetString(), buffer.GetSize());
 }
 
 //https://stackoverflow.com/questions/216823/whats-the-best-way-to-trim-stdstring
@@ -180,29 +124,93 @@ static inline void ltrim(std::string &s) {
 
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " INDEX_DIR" << std::endl;
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [--minor-versions] [--batch N] [--input FILE] [--output FILE] [--gzip] [--threads N] [--shards N] [--shard-key id|tile]" << std::endl;
         std::exit(1);
     }
 
     int feature_count = 0;
 
     std::string index_dir = argv[1];
+    std::string input_filename = "-";
+    std::string output_filename = "-";
+    bool compress = false;
+    int threads = 0;
+    int shards = 1;
+    osmwayback::ShardKey shard_key = osmwayback::ShardKey::id;
+
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--minor-versions") {
+            MINOR_VERSIONS = true;
+        } else if (i + 1 < argc && option == "--batch") {
+            BATCH_SIZE = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+        } else if (option == "--gzip") {
+            compress = true;
+        } else if (i + 1 < argc && option == "--input") {
+            input_filename = argv[++i];
+        } else if (i + 1 < argc && option == "--output") {
+            output_filename = argv[++i];
+            compress = compress || osmwayback::has_gzip_suffix(output_filename);
+        } else if (i + 1 < argc && option == "--threads") {
+            threads = std::atoi(argv[++i]);
+        } else if (i + 1 < argc && option == "--shards") {
+            shards = std::atoi(argv[++i]);
+        } else if (i + 1 < argc && option == "--shard-key") {
+            if (!osmwayback::parse_shard_key(argv[++i], &shard_key)) {
+                std::cerr << "Unknown shard key " << argv[i] << std::endl;
+                std::exit(1);
+            }
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            std::exit(1);
+        }
+    }
+    if (shards < 1 || (shards > 1 && output_filename == "-")) {
+        std::cerr << "--shards needs a positive number and an --output file" << std::endl;
+        std::exit(1);
+    }
+    if (BATCH_SIZE > 0 && MINOR_VERSIONS) {
+        std::cerr << "--batch shares node histories, there are none with --minor-versions" << std::endl;
+        std::exit(1);
+    }
 
     //TODO: Read the file in chunks, parallelize the activity
     //  - This requires opening multiple ObjectStores as follows: (readonly)
     ObjectStore store(index_dir, false);
 
-    for (std::string line; std::getline(std::cin, line);) {
-        ltrim(line);
-        fetchNodeGeometries(&store, line);
-        feature_count++;
-        if(feature_count%100==0){
-          std::cerr << "\rProcessed: " << (feature_count/1000) << " K features";
+    try {
+        osmwayback::LineReader input(input_filename);
+        osmwayback::ShardedWriter output(output_filename, static_cast<size_t>(shards), shard_key, compress, threads);
+        if (BATCH_SIZE > 0) {
+            batches.resize(output.size());
         }
+
+        for (std::string line; input.getline(line);) {
+            ltrim(line);
+            fetchNodeGeometries(&store, line, &output);
+            feature_count++;
+            if(feature_count%100==0){
+              std::cerr << "\rProcessed: " << (feature_count/1000) << " K features";
+            }
+        }
+        for (size_t shard = 0; shard < batches.size(); shard++) {
+            batches[shard].write(&store, &output, shard, &stats, &batch_stats);
+        }
+        output.close();
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        std::exit(2);
     }
 
-    std::cerr << std::endl << "Node Lookup Failures: " << std::to_string( node_lookup_failures ) << std::endl;
+    std::cerr << std::endl << "Node Lookup Failures: " << std::to_string( stats.node_lookup_failures.load() ) << std::endl;
+    if (MINOR_VERSIONS) {
+        std::cerr << "Minor Versions: " << std::to_string( stats.minor_version_count.load() ) << std::endl;
+    }
+    if (BATCH_SIZE > 0) {
+        std::cerr << "Batches: " << batch_stats.batch_count << ", node histories written: " << batch_stats.batch_node_count
+                  << " (" << batch_stats.feature_node_count << " without --batch)" << std::endl;
+    }
 
     if(feature_count == 0) {
         std::cerr << "No features processed" << std::endl;
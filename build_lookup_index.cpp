@@ -1,14 +1,56 @@
 /*
-  Builds a RocksDB index from an OSM file using osmium to read the file.
+  Builds a RocksDB index from OSM files using osmium to read the files.
 
   INPUT: Location to store index on disk
-         An OSM history file (any osmium readable format should work, built for .osh.pbf)
+         One or more OSM history files (any osmium readable format should work,
+         built for .osh.pbf), e.g. overlapping regional extracts. They are merged
+         into one stream in type, id and version order, and versions that are in
+         more than one file are stored once; see history_merge.hpp
+
+  OPTIONS: --users      Also index every version by its author (uid), for query_user
+           --tag-diffs  Store the tag diff against the previous version with every
+                        version, so add_history does not have to compute it
+           --way-deltas [K]
+                        Store the node lists of ways as a snapshot every K
+                        versions (default 16) and edit scripts in between,
+                        see way_delta.hpp
+           --zstd       Compress nodes, ways, relations and locations with zstd
+                        and a 64KB dictionary
+           --compression FAMILY=TYPE[:LEVEL[:DICT_BYTES]]
+                        Compression of one column family (none, snappy, zlib,
+                        lz4, lz4hc or zstd), e.g. ways=zstd:9:65536; can be
+                        repeated. See "Compression" in db.hpp
+           --tag-config FILE
+                        Only store the tags selected by the include_tags and
+                        exclude_tags of an osmium export style JSON config,
+                        see tag_filter.hpp
+           --exclude-tag PATTERN
+                        Do not store tags matching PATTERN (key, key prefix
+                        ending in * or key=value); can be repeated
+           --collapse-versions
+                        Do not store versions that change nothing but
+                        filtered tags
+           --node-location-store
+                        Keep node location histories in a memory mapped
+                        array indexed by node id instead of the locations
+                        column family, see node_location_store.hpp
+           --sorted     Stream every input without sorting it first. By
+                        default, only inputs that declare Sort.Type_then_ID
+                        are streamed; the others are sorted externally
+           --sort-memory MB
+                        Memory for sorting unsorted inputs before spilling a
+                        sorted run to disk (default 1024)
+           --tmp-dir DIR
+                        Directory for the sorted runs (default
+                        INDEX_DIR/sort_runs, removed after the build)
 
   OUTPUT: Nothing, builds index at location specified
 */
 
+#include <cctype>   // for std::isdigit
 #include <cstdlib>  // for std::exit
 #include <cstring>  // for std::strncmp
+#include <fstream>
 #include <iostream> // for std::cout, std::cerr
 #include <sstream>
 #include <chrono>
@@ -19,8 +61,15 @@
 #include <osmium/visitor.hpp>
 
 #include "db.hpp"
+#include "history_merge.hpp"
 
 bool LOC = true;
+bool SPATIAL = true; //Index every historical node location by position (for query_bbox)
+bool CHANGESETS = true; //Index object versions by changeset (for query_changesets)
+bool PARENTS = true; //Index the ways and relations every object was a member of (for query_parents)
+bool USERS = false; //Index object versions by uid (for query_user), set with --users
+bool TAG_DIFFS = false; //Precompute aA/aM/aD for add_history, set with --tag-diffs
+uint32_t WAY_SNAPSHOT_INTERVAL = 0; //Snapshot/edit script way node lists, set with --way-deltas
 
 class ObjectStoreHandler : public osmium::handler::Handler {
     ObjectStore* m_store;
@@ -32,6 +81,9 @@ public:
     int rel_count = 0;
 
     void node(const osmium::Node& node) {
+        if (m_store->collapses(node)) {
+            return;
+        }
         node_count += 1;
         m_store->store_pbf_node(node);
 
@@ -39,18 +91,67 @@ public:
         if(LOC){
           m_store->upsert_node_location(node);
         }
+        if(SPATIAL){
+          m_store->store_spatial_location(node);
+        }
+        if(CHANGESETS){
+          m_store->store_changeset_entry(node);
+        }
+        if(USERS){
+          m_store->store_user_entry(node);
+        }
     }
     void way(const osmium::Way& way) {
+        if (m_store->collapses(way)) {
+            return;
+        }
         m_store->store_pbf_way(way);
+        if(PARENTS){
+          m_store->store_parent_entries(way);
+        }
+        if(CHANGESETS){
+          m_store->store_changeset_entry(way);
+        }
+        if(USERS){
+          m_store->store_user_entry(way);
+        }
         way_count++;
     }
-    //Stores relation in the index, but isn't used (yet)
+    //Stores relations with their members for build_relation_geometries
     void relation(const osmium::Relation& relation) {
-        m_store->store_json_relation(relation);
+        if (m_store->collapses(relation)) {
+            return;
+        }
+        m_store->store_pbf_relation(relation);
+        if(PARENTS){
+          m_store->store_parent_entries(relation);
+        }
+        if(CHANGESETS){
+          m_store->store_changeset_entry(relation);
+        }
+        if(USERS){
+          m_store->store_user_entry(relation);
+        }
         rel_count++;
     }
 };
 
+void store_object(ObjectStoreHandler& handler, const osmium::OSMObject& object) {
+    switch (object.type()) {
+        case osmium::item_type::node:
+            handler.node(static_cast<const osmium::Node&>(object));
+            break;
+        case osmium::item_type::way:
+            handler.way(static_cast<const osmium::Way&>(object));
+            break;
+        case osmium::item_type::relation:
+            handler.relation(static_cast<const osmium::Relation&>(object));
+            break;
+        default:
+            break;
+    }
+}
+
 std::atomic_bool stop_progress{false};
 
 void report_progress(const ObjectStore* store) {
@@ -84,25 +185,136 @@ void report_progress(const ObjectStore* store) {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " INDEX_DIR OSMFILE" << std::endl;
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR OSMFILE [OSMFILE ...] [--users] [--tag-diffs] [--way-deltas [K]] [--zstd] [--compression FAMILY=TYPE[:LEVEL[:DICT_BYTES]]]... [--tag-config FILE] [--exclude-tag PATTERN]... [--collapse-versions] [--node-location-store] [--sorted] [--sort-memory MB] [--tmp-dir DIR]" << std::endl;
         std::exit(1);
     }
 
     std::string index_dir = argv[1];
-    std::string osm_filename = argv[2];
+    std::vector<std::string> osm_filenames;
 
-    ObjectStore store(index_dir, true);
+    CompressionProfile compression;
+    osmwayback::TagFilter tag_filter;
+    bool collapse_versions = false;
+    bool node_location_store = false;
+    bool trust_sorted = false;
+    size_t sort_memory_mb = osmwayback::DEFAULT_SORT_MEMORY_MB;
+    std::string sort_dir = index_dir + "/sort_runs";
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option.compare(0, 2, "--") != 0) {
+            osm_filenames.push_back(option);
+        } else if (option == "--users") {
+            USERS = true;
+        } else if (option == "--tag-diffs") {
+            TAG_DIFFS = true;
+        } else if (option == "--way-deltas") {
+            WAY_SNAPSHOT_INTERVAL = osmwayback::DEFAULT_WAY_SNAPSHOT_INTERVAL;
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                WAY_SNAPSHOT_INTERVAL = static_cast<uint32_t>(std::stoul(argv[++i]));
+            }
+        } else if (option == "--zstd") {
+            for (const auto& family : zstd_compression_profile()) {
+                compression[family.first] = family.second;
+            }
+        } else if (option == "--compression" && i + 1 < argc) {
+            if (!parse_family_compression(argv[++i], &compression)) {
+                std::cerr << "Invalid compression: " << argv[i] << std::endl;
+                std::exit(1);
+            }
+        } else if (option == "--tag-config" && i + 1 < argc) {
+            std::ifstream config{argv[++i]};
+            std::stringstream json;
+            json << config.rdbuf();
+            if (!config || !osmwayback::parse_tag_filter(json.str(), &tag_filter)) {
+                std::cerr << "Invalid tag config: " << argv[i] << std::endl;
+                std::exit(1);
+            }
+        } else if (option == "--exclude-tag" && i + 1 < argc) {
+            tag_filter.exclude(argv[++i]);
+        } else if (option == "--collapse-versions") {
+            collapse_versions = true;
+        } else if (option == "--node-location-store") {
+            node_location_store = true;
+        } else if (option == "--sorted") {
+            trust_sorted = true;
+        } else if (option == "--sort-memory" && i + 1 < argc) {
+            sort_memory_mb = static_cast<size_t>(std::stoul(argv[++i]));
+        } else if (option == "--tmp-dir" && i + 1 < argc) {
+            sort_dir = argv[++i];
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            std::exit(1);
+        }
+    }
+
+    if (osm_filenames.empty()) {
+        std::cerr << "No OSM history file given" << std::endl;
+        std::exit(1);
+    }
+
+    ObjectStore store(index_dir, OpenMode::create, 0, compression);
+    if (USERS) {
+        store.enable_user_index();
+    }
+    if (TAG_DIFFS) {
+        store.enable_tag_diffs();
+    }
+    if (WAY_SNAPSHOT_INTERVAL) {
+        store.enable_way_deltas(WAY_SNAPSHOT_INTERVAL);
+    }
+    if (!tag_filter.empty()) {
+        store.set_tag_filter(tag_filter);
+    }
+    if (collapse_versions) {
+        store.enable_version_collapsing();
+    }
+    if (node_location_store) {
+        store.enable_node_location_store();
+    }
 
     ObjectStoreHandler osm_object_handler(&store);
 
     std::thread t_progress(report_progress, &store);
 
-    osmium::io::Reader reader{osm_filename, osmium::osm_entity_bits::node | osmium::osm_entity_bits::way | osmium::osm_entity_bits::relation};
+    //Declared first so that the sources reading its runs are destroyed before it removes them
+    osmwayback::ExternalSorter sorter{sort_dir, sort_memory_mb};
+    std::vector<std::unique_ptr<osmwayback::HistorySource>> sources;
+    unsigned long duplicates = 0;
+    try {
+        for (const auto& filename : osm_filenames) {
+            if (trust_sorted || osmwayback::declares_sorted(filename)) {
+                sources.emplace_back(new osmwayback::FileSource(filename));
+            } else {
+                std::cerr << "Sorting " << filename << std::endl;
+                sorter.add(filename);
+            }
+        }
+        sorter.finish(&sources);
 
-    osmium::apply(reader, osm_object_handler);
+        osmwayback::HistoryMerge merge{std::move(sources)};
+        while (const osmium::OSMObject* object = merge.next()) {
+            store_object(osm_object_handler, *object);
+        }
+        duplicates = sorter.duplicate_count() + merge.duplicate_count;
+    } catch (const std::exception& ex) {
+        //Unsorted input or a read error, the index is incomplete. Return rather
+        //than exit, so that the sorter removes its runs.
+        std::cerr << "\nError: " << ex.what() << std::endl;
+        stop_progress = true;
+        t_progress.join();
+        return 1;
+    }
 
     stop_progress = true;
     t_progress.join();
     store.flush();
+
+    if (osm_filenames.size() > 1 || sorter.run_count() > 0) {
+        std::cerr << "Merged " << osm_filenames.size() << " inputs (" << sorter.run_count() << " sorted runs spilled), skipped " << duplicates << " duplicate versions" << std::endl;
+    }
+
+    if (collapse_versions) {
+        std::cerr << "Collapsed " << store.collapsed_versions_count << " versions without changes to kept tags or geometry" << std::endl;
+    }
 }
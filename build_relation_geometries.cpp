@@ -0,0 +1,97 @@
+/*
+
+  USAGE: build_relation_geometries <INDEX DIR> [THREADS] > <OUTPUT GEOJSONSEQ>
+
+  Scans the relations in the rocksdb INDEX and rebuilds the geometry of every
+  version of each multipolygon and boundary relation, using the member way and
+  node versions that were valid when that relation version was created.
+
+  It outputs one GeoJSON feature per relation version, with @validSince and
+  @validUntil, in the same shape as the "every geometry" output of
+  geometry-reconstruction. Relations are assembled in parallel, output order
+  follows the index.
+
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <deque>
+#include <future>
+#include <memory>
+#include <thread>
+
+#include <osmium/thread/pool.hpp>
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+#include "relation_history.hpp"
+
+osmwayback::RelationHistoryStats stats;
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [THREADS]" << std::endl;
+        std::exit(1);
+    }
+
+    std::string index_dir = argv[1];
+    const int num_threads = (argc == 3) ? std::atoi(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+
+    ObjectStore store(index_dir, false);
+
+    osmium::thread::Pool pool{num_threads};
+    std::deque<std::future<std::string>> pending;
+    const size_t max_pending = static_cast<size_t>(num_threads) * 64;
+
+    long relation_count = 0;
+
+    auto submit = [&](const int64_t relation_id, const std::vector<std::string>& versions) {
+        relation_count++;
+        if (relation_count % 10000 == 0) {
+            std::cerr << "\rProcessed: " << (relation_count / 1000) << " K relations";
+        }
+
+        pending.push_back(pool.submit([&store, relation_id, versions] {
+            osmwayback::RelationHistoryBuilder builder{&store, &stats};
+            return builder.build(relation_id, versions);
+        }));
+
+        //Write finished relations in index order
+        while (pending.size() > max_pending) {
+            std::cout << pending.front().get();
+            pending.pop_front();
+        }
+    };
+
+    //Versions of a relation are stored next to each other ("id!version")
+    std::string current_id;
+    std::vector<std::string> versions;
+
+    std::unique_ptr<rocksdb::Iterator> it{store.new_iterator(3)};
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        const std::string key = it->key().ToString();
+        const std::string id = key.substr(0, key.find('!'));
+
+        if (id != current_id && !versions.empty()) {
+            submit(std::stoll(current_id), versions);
+            versions.clear();
+        }
+        current_id = id;
+        versions.push_back(it->value().ToString());
+    }
+    if (!versions.empty()) {
+        submit(std::stoll(current_id), versions);
+    }
+
+    while (!pending.empty()) {
+        std::cout << pending.front().get();
+        pending.pop_front();
+    }
+
+    std::cerr << "\n" << stats.relations << " relations processed, " << stats.geometries << " geometries built" << std::endl;
+    std::cerr << "\t" << stats.skipped_relations << "\tRelations without multipolygon geometries" << std::endl;
+    std::cerr << "\t" << stats.versions << "\tMultipolygon versions" << std::endl;
+    std::cerr << "\t" << stats.assembly_failures << "\tAssembly failures" << std::endl;
+    std::cerr << "\t" << stats.missing_ways << "\tMember ways not found at version time" << std::endl;
+    std::cerr << "\t" << stats.missing_nodes << "\tWay nodes without a location at version time" << std::endl;
+}
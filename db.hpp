@@ -6,6 +6,7 @@
 #include <rapidjson/writer.h>
 #include <rapidjson/stringbuffer.h>
 #include "rapidjson/document.h"
+#include "rapidjson/internal/itoa.h"
 #pragma GCC diagnostic pop
 
 #include "rocksdb/db.h"
@@ -21,29 +22,569 @@
 #include <osmium/osm/types.hpp>
 #include <osmium/visitor.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string.h>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "pbf_encoding.hpp"
 #include "json_encoding.hpp"
-
-const std::string make_lookup(int64_t osm_id, const int version){
+#include "keys.hpp"
+#include "location_merge.hpp"
+#include "node_location_store.hpp"
+#include "spatial.hpp"
+#include "tag_diff.hpp"
+#include "tag_filter.hpp"
+#include "way_delta.hpp"
+
+inline const std::string make_lookup(int64_t osm_id, const int version){
   return std::to_string(osm_id) +"!"+  std::to_string(version);
 }
 
+/*  The key of an object version ("id!version", as make_lookup) or of a node's
+ *  locations ("id"), built on the stack for lookups on hot paths
+ */
+class DecimalKey {
+    char m_data[20 + 1 + 10];
+    size_t m_size;
+
+public:
+    explicit DecimalKey(const int64_t osm_id) :
+        m_size(static_cast<size_t>(rapidjson::internal::i64toa(osm_id, m_data) - m_data)) {
+    }
+
+    DecimalKey(const int64_t osm_id, const uint32_t version) {
+        char* end = rapidjson::internal::i64toa(osm_id, m_data);
+        *end++ = '!';
+        m_size = static_cast<size_t>(rapidjson::internal::u32toa(version, end) - m_data);
+    }
+
+    const char* data() const {
+        return m_data;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    rocksdb::Slice slice() const {
+        return rocksdb::Slice(m_data, m_size);
+    }
+};
+
 const bool STORE_GEOMETRIES = true;
 
+/*
+    Read Profile
+    ============
+
+    The index never changes after it is built, so readers open it with mmap
+    reads, a shared LRU block cache and every table file kept open
+    (max_open_files = -1), which keeps all index and filter blocks in memory.
+
+    finalize_index rewrites the tables with the same per column family options:
+    full-key bloom filters everywhere, small blocks for the point-lookup
+    families and larger, uncompressed blocks for the key-only families that
+    are range scanned.
+*/
+
+const size_t DEFAULT_BLOCK_CACHE_MB = 512;
+
+// Key-only column families that are read with range scans
+inline bool is_scan_family(const std::string& family) {
+    return family == "spatial" || family == "changesets" || family == "users" || family == "parents";
+}
+
+/*
+    Compression
+    ===========
+
+    By default the point-lookup families use rocksdb's default block compression
+    (snappy) and the key-only scan families none. `build_lookup_index
+    --compression FAMILY=TYPE[:LEVEL[:DICT_BYTES]]` sets the compression of a
+    family instead, e.g. zstd at a higher level with a dictionary for the small,
+    repetitive PBF and JSON records:
+
+        --compression ways=zstd:9:65536
+
+    With DICT_BYTES, every compaction into the bottommost level samples that
+    much of its records into a dictionary that primes the compressor, so even
+    4KB blocks compress like a long stream. The settings are recorded under
+    `wayback:compression:FAMILY` and applied again by update_index and
+    finalize_index. Readers need nothing: every table file names its
+    compression and carries its own dictionary.
+*/
+
+struct FamilyCompression {
+    rocksdb::CompressionType type{rocksdb::kSnappyCompression};
+    int level{-1}; // -1 for the library default
+    uint32_t dict_bytes{0};
+};
+
+// Compression per column family name, families not in it keep the defaults
+using CompressionProfile = std::map<std::string, FamilyCompression>;
+
+const std::string COMPRESSION_KEY_PREFIX = "wayback:compression:";
+
+//zstd for every family with values, with a 64KB dictionary
+inline CompressionProfile zstd_compression_profile() {
+    FamilyCompression zstd;
+    zstd.type = rocksdb::kZSTD;
+    zstd.level = 6;
+    zstd.dict_bytes = 64 * 1024;
+    return CompressionProfile{{"nodes", zstd}, {"ways", zstd}, {"relations", zstd}, {"locations", zstd}};
+}
+
+inline const std::vector<std::pair<std::string, rocksdb::CompressionType>>& compression_names() {
+    static const std::vector<std::pair<std::string, rocksdb::CompressionType>> names{
+        {"none",   rocksdb::kNoCompression},
+        {"snappy", rocksdb::kSnappyCompression},
+        {"zlib",   rocksdb::kZlibCompression},
+        {"lz4",    rocksdb::kLZ4Compression},
+        {"lz4hc",  rocksdb::kLZ4HCCompression},
+        {"zstd",   rocksdb::kZSTD}
+    };
+    return names;
+}
+
+// TYPE[:LEVEL[:DICT_BYTES]], e.g. "zstd:9:65536"
+inline bool parse_compression(const std::string& spec, FamilyCompression* compression) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (true) {
+        const size_t colon = spec.find(':', start);
+        parts.push_back(spec.substr(start, colon - start));
+        if (colon == std::string::npos) {
+            break;
+        }
+        start = colon + 1;
+    }
+    if (parts.size() > 3) {
+        return false;
+    }
+
+    const auto& names = compression_names();
+    const auto name = std::find_if(names.begin(), names.end(), [&parts](const std::pair<std::string, rocksdb::CompressionType>& n) {
+        return n.first == parts[0];
+    });
+    if (name == names.end()) {
+        return false;
+    }
+
+    *compression = FamilyCompression{};
+    compression->type = name->second;
+    //zstd reads -1 as its fastest level, not its default
+    compression->level = (compression->type == rocksdb::kZSTD) ? 3 : -1;
+    try {
+        if (parts.size() > 1 && !parts[1].empty()) {
+            compression->level = std::stoi(parts[1]);
+        }
+        if (parts.size() > 2 && !parts[2].empty()) {
+            compression->dict_bytes = static_cast<uint32_t>(std::stoul(parts[2]));
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+inline std::string format_compression(const FamilyCompression& compression) {
+    std::string name = "none";
+    for (const auto& n : compression_names()) {
+        if (n.second == compression.type) {
+            name = n.first;
+        }
+    }
+    return name + ":" + std::to_string(compression.level) + ":" + std::to_string(compression.dict_bytes);
+}
+
+// FAMILY=TYPE[:LEVEL[:DICT_BYTES]], as given to build_lookup_index --compression
+inline bool parse_family_compression(const std::string& arg, CompressionProfile* profile) {
+    static const std::vector<std::string> families{"nodes", "ways", "relations", "locations", "spatial", "changesets", "users", "parents"};
+    const size_t equals = arg.find('=');
+    if (equals == std::string::npos || std::find(families.begin(), families.end(), arg.substr(0, equals)) == families.end()) {
+        return false;
+    }
+    FamilyCompression compression;
+    if (!parse_compression(arg.substr(equals + 1), &compression)) {
+        return false;
+    }
+    (*profile)[arg.substr(0, equals)] = compression;
+    return true;
+}
+
+inline void apply_compression(const FamilyCompression& compression, rocksdb::ColumnFamilyOptions* options) {
+    options->compression = compression.type;
+    options->compression_opts.level = compression.level;
+    options->compression_opts.max_dict_bytes = compression.dict_bytes;
+}
+
+/*  The compression recorded in an index by build_lookup_index, for the tools
+ *  that write to it again. Reads the default column family only.
+ */
+inline CompressionProfile read_compression_profile(const std::string& index_dir) {
+    CompressionProfile profile;
+    rocksdb::DB* db;
+    if (!rocksdb::DB::OpenForReadOnly(rocksdb::Options(), index_dir, &db).ok()) {
+        return profile;
+    }
+    std::unique_ptr<rocksdb::Iterator> it{db->NewIterator(rocksdb::ReadOptions())};
+    for (it->Seek(COMPRESSION_KEY_PREFIX); it->Valid() && it->key().starts_with(COMPRESSION_KEY_PREFIX); it->Next()) {
+        FamilyCompression compression;
+        if (parse_compression(it->value().ToString(), &compression)) {
+            profile[it->key().ToString().substr(COMPRESSION_KEY_PREFIX.size())] = compression;
+        }
+    }
+    it.reset();
+    delete db;
+    return profile;
+}
+
+// compression: the family's entry of the index's CompressionProfile, nullptr for the defaults
+inline rocksdb::ColumnFamilyOptions read_family_options(const std::string& family, const std::shared_ptr<rocksdb::Cache>& block_cache,
+                                                        const FamilyCompression* compression = nullptr) {
+    rocksdb::BlockBasedTableOptions table_options;
+    table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+    table_options.whole_key_filtering = true;
+    table_options.block_cache = block_cache;
+    table_options.block_size = is_scan_family(family) ? 32 * 1024 : 4 * 1024;
+
+    rocksdb::ColumnFamilyOptions options;
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    if (is_scan_family(family)) {
+        options.compression = rocksdb::kNoCompression;
+    }
+    if (compression) {
+        apply_compression(*compression, &options);
+    }
+    if (family == "locations") {
+        options.merge_operator = osmwayback::location_merge_operator();
+    }
+    return options;
+}
+
+/*
+    Index Metadata
+    ==============
+
+    Small values in the default column family that describe the index as a whole.
+*/
+
+const std::string FINALIZED_KEY = "wayback:finalized"; //Unix time finalize_index ran
+const std::string TAG_DIFFS_KEY = "wayback:tag_diffs"; //Present if built with --tag-diffs
+const std::string REPLICATION_SEQUENCE_KEY = "wayback:replication_sequence"; //Last change file applied by update_index
+const std::string REPLICATION_TIMESTAMP_KEY = "wayback:replication_timestamp";
+const std::string WAY_SNAPSHOT_INTERVAL_KEY = "wayback:way_snapshot_interval"; //Present if built with --way-deltas
+const std::string TAG_FILTER_KEY = "wayback:tag_filter"; //Include and exclude lists if built with --tag-config, see tag_filter.hpp
+const std::string COLLAPSE_VERSIONS_KEY = "wayback:collapse_versions"; //Present if built with --collapse-versions
+const std::string NODE_LOCATION_STORE_KEY = "wayback:node_location_store"; //Present if built with --node-location-store
+
+enum class OpenMode {
+    read_only,
+    create, // Destroys any existing index
+    update  // Read-write access to an existing index, for update_index
+};
+
 class ObjectStore {
-    rocksdb::DB* m_db;
-    rocksdb::ColumnFamilyHandle* m_cf_ways;
-    rocksdb::ColumnFamilyHandle* m_cf_nodes;
-    rocksdb::ColumnFamilyHandle* m_cf_relations;
-    rocksdb::ColumnFamilyHandle* m_cf_locations; //The location CF
-    //rocksdb::ColumnFamilyHandle* m_cf_changesets; //Not used (yet)
+    rocksdb::DB* m_db{nullptr};
+    rocksdb::ColumnFamilyHandle* m_cf_ways{nullptr};
+    rocksdb::ColumnFamilyHandle* m_cf_nodes{nullptr};
+    rocksdb::ColumnFamilyHandle* m_cf_relations{nullptr};
+    rocksdb::ColumnFamilyHandle* m_cf_locations{nullptr}; //The location CF
+    rocksdb::ColumnFamilyHandle* m_cf_spatial{nullptr}; //Every historical node location, see spatial.hpp
+    rocksdb::ColumnFamilyHandle* m_cf_changesets{nullptr}; //changeset -> (type, id, version), see keys.hpp
+    rocksdb::ColumnFamilyHandle* m_cf_users{nullptr}; //Optional: uid -> (timestamp, type, id, version)
+    rocksdb::ColumnFamilyHandle* m_cf_parents{nullptr}; //child -> (parent type, id, version range), see keys.hpp
+    rocksdb::ColumnFamilyHandle* m_cf_default{nullptr}; //Index metadata, only opened explicitly when reading or updating
 
     rocksdb::WriteOptions m_write_options;
     rocksdb::WriteBatch m_buffer_batch;
 
+    OpenMode m_mode{OpenMode::read_only};
+    std::string m_index_dir;
+    CompressionProfile m_compression{};
+    int m_compaction_threads{1};
+
+    //Tags of the last stored version of the current object, per type, for --tag-diffs
+    struct PreviousTags {
+        osmium::object_id_type id{0};
+        osmwayback::VersionTags tags{};
+    };
+
+    bool m_tag_diffs{false};
+    PreviousTags m_previous_tags[3];
+
+    //Node list of the last stored way version, the base of the next edit script (--way-deltas)
+    struct PreviousWay {
+        osmium::object_id_type id{0};
+        uint32_t version{0}; // 0 if there is no stored version to diff against
+        uint32_t depth{0};
+        std::vector<int64_t> nodes{};
+    };
+
+    uint32_t m_way_snapshot_interval{0};
+    PreviousWay m_previous_way;
+
+    //Content of the last stored version of the current object, per type, for --collapse-versions
+    struct StoredContent {
+        osmium::object_id_type id{0};
+        bool valid{false}; // false if no version of the object is stored yet
+        osmwayback::ObjectVersion content{};
+    };
+
+    osmwayback::TagFilter m_tag_filter{};
+    bool m_collapse_versions{false};
+    StoredContent m_stored_content[3];
+
+    //Children of the way or relation being stored, with the version their current range started with
+    struct OpenParentRanges {
+        osmium::object_id_type id{0};
+        int type{0}; // 0 before the first parent
+        uint32_t version{0}; // last stored version of the parent
+        std::map<std::pair<int, int64_t>, uint32_t> children{};
+    };
+
+    OpenParentRanges m_parent_ranges[2]; // ways, relations
+
+    //Replace the locations family if built with --node-location-store, see node_location_store.hpp
+    std::unique_ptr<osmwayback::NodeLocationStore> m_node_location_store{};
+    std::unique_ptr<osmwayback::NodeLocationWriter> m_node_location_writer{};
+
+    //Tells the resolve_way cache of different stores apart
+    uint64_t m_instance{next_instance()};
+
+    static uint64_t next_instance() {
+        static std::atomic<uint64_t> instances{0};
+        return ++instances;
+    }
+
+    /*  The tags to diff `object` against: those of the version stored just before
+     *  it if that was the same object (history files are sorted by id and version),
+     *  none if it is the first. When updating, the first version of an object in
+     *  the changes is diffed against the latest older version in the index.
+     *  nullptr unless tag diffs are enabled.
+     */
+    const osmwayback::VersionTags* previous_tags(const osmium::OSMObject& object) {
+        if (!m_tag_diffs) {
+            return nullptr;
+        }
+        PreviousTags& previous = m_previous_tags[static_cast<int>(object.type()) - 1];
+        if (previous.id != object.id()) {
+            previous.id = object.id();
+            previous.tags.clear();
+            if (m_mode == OpenMode::update) {
+                load_stored_tags(object, &previous.tags);
+            }
+        }
+        return &previous.tags;
+    }
+
+    void load_stored_tags(const osmium::OSMObject& object, osmwayback::VersionTags* tags) {
+        std::string value;
+        for (int v = static_cast<int>(object.version()) - 1; v >= 1; v--) {
+            if (get_tags(object.id(), static_cast<int>(object.type()), v, &value).ok()) {
+                osmwayback::ObjectVersion stored;
+                osmwayback::decode_object(value, &stored);
+                tags->insert(stored.tags.begin(), stored.tags.end());
+                return;
+            }
+        }
+    }
+
+    const osmwayback::TagFilter* tag_filter() const {
+        return m_tag_filter.empty() ? nullptr : &m_tag_filter;
+    }
+
+    bool load_stored_content(const osmium::OSMObject& object, osmwayback::ObjectVersion* content) {
+        std::string value;
+        for (int v = static_cast<int>(object.version()) - 1; v >= 1; v--) {
+            if (get_tags(object.id(), static_cast<int>(object.type()), v, &value).ok()) {
+                osmwayback::decode_object(value, content);
+                std::sort(content->tags.begin(), content->tags.end());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //The (type, id) of every node or member of a version, sorted
+    static void version_children(const osmwayback::ObjectVersion& version, std::vector<std::pair<int, int64_t>>* children) {
+        children->clear();
+        for (const int64_t ref : version.nodes) {
+            children->emplace_back(static_cast<int>(osmium::item_type::node), ref);
+        }
+        for (const auto& member : version.members) {
+            children->emplace_back(static_cast<int>(member.type), member.ref);
+        }
+        std::sort(children->begin(), children->end());
+        children->erase(std::unique(children->begin(), children->end()), children->end());
+    }
+
+    void write_parent_range(const OpenParentRanges& ranges, const std::pair<int, int64_t>& child, const uint32_t first_version) {
+        if ( store_pbf_object( "", osmwayback::make_parent_key(child.first, child.second, ranges.type, ranges.id, first_version, ranges.version), m_cf_parents) ){
+            stored_parent_count++;
+        }
+        if (stored_parent_count != 0 && (stored_parent_count % 5000000) == 0) {
+            flush_family("parents", m_cf_parents);
+        }
+    }
+
+    void close_parent_ranges(OpenParentRanges* ranges) {
+        for (const auto& child : ranges->children) {
+            write_parent_range(*ranges, child.first, child.second);
+        }
+        ranges->children.clear();
+    }
+
+    /*  When updating, the ranges that end with the last stored version of a
+     *  parent are still open: they are deleted and extended (or written again
+     *  unchanged) by the new versions.
+     */
+    void reopen_parent_ranges(const osmium::OSMObject& parent, OpenParentRanges* ranges) {
+        std::string value;
+        for (int v = static_cast<int>(parent.version()) - 1; v >= 1; v--) {
+            if (!get_tags(parent.id(), static_cast<int>(parent.type()), v, &value).ok()) {
+                continue;
+            }
+            osmwayback::ObjectVersion previous;
+            osmwayback::decode_object(value, &previous);
+            std::vector<std::pair<int, int64_t>> children;
+            version_children(previous, &children);
+
+            std::unique_ptr<rocksdb::Iterator> it{m_db->NewIterator(rocksdb::ReadOptions(), m_cf_parents)};
+            int parent_type;
+            int64_t parent_id;
+            uint32_t first_version;
+            uint32_t last_version;
+            for (const auto& child : children) {
+                const std::string prefix = osmwayback::make_parent_bound(child.first, child.second, ranges->type, ranges->id);
+                for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+                    osmwayback::parse_parent_key(it->key().data(), &parent_type, &parent_id, &first_version, &last_version);
+                    if (last_version == static_cast<uint32_t>(v)) {
+                        m_buffer_batch.Delete(m_cf_parents, it->key());
+                        ranges->children[child] = first_version;
+                        break;
+                    }
+                }
+            }
+            ranges->version = static_cast<uint32_t>(v);
+            return;
+        }
+    }
+
+    /*  Encodes a way with its node list as a snapshot or as an edit script
+     *  against the previous stored version, see way_delta.hpp. Every
+     *  m_way_snapshot_interval-th version since the last snapshot is a snapshot.
+     */
+    std::string encode_way_record(const osmium::Way& way) {
+        const osmwayback::VersionTags* tags = previous_tags(way);
+        if (!m_way_snapshot_interval) {
+            return osmwayback::encode_way(way, tags, nullptr, tag_filter());
+        }
+
+        if (m_previous_way.id != way.id()) {
+            m_previous_way.id = way.id();
+            m_previous_way.version = 0;
+            m_previous_way.depth = 0;
+            m_previous_way.nodes.clear();
+            if (m_mode == OpenMode::update) {
+                load_stored_way(way, &m_previous_way);
+            }
+        }
+
+        osmwayback::WayNodeEncoding encoding;
+        if (m_previous_way.version != 0 && m_previous_way.depth + 1 < m_way_snapshot_interval) {
+            encoding.base_nodes = &m_previous_way.nodes;
+            encoding.base_version = m_previous_way.version;
+            encoding.depth = m_previous_way.depth + 1;
+        }
+        const std::string record = osmwayback::encode_way(way, tags, &encoding, tag_filter());
+
+        m_previous_way.version = way.version();
+        m_previous_way.depth = encoding.depth;
+        m_previous_way.nodes.clear();
+        for (const osmium::NodeRef& nr : way.nodes()) {
+            m_previous_way.nodes.push_back(nr.ref());
+        }
+        return record;
+    }
+
+    //Loads the latest stored version before `way` into `previous`, which is left empty without one
+    void load_stored_way(const osmium::Way& way, PreviousWay* previous) {
+        previous->version = 0;
+        previous->depth = 0;
+        previous->nodes.clear();
+
+        std::string value;
+        for (uint32_t v = way.version() - 1; v >= 1; v--) {
+            if (!m_db->Get(rocksdb::ReadOptions(), m_cf_ways, make_lookup(way.id(), static_cast<int>(v)), &value).ok()) {
+                continue;
+            }
+            osmwayback::WayDelta delta;
+            const uint32_t depth = osmwayback::read_way_delta(value, &delta) ? delta.depth : 0;
+            if (resolve_way(way.id(), v, &value).ok()) {
+                osmwayback::read_way_nodes(value, &previous->nodes);
+                previous->version = v;
+                previous->depth = depth;
+            }
+            return;
+        }
+    }
+
+    void remember_tags(const osmium::OSMObject& object) {
+        if (!m_tag_diffs) {
+            return;
+        }
+        PreviousTags& previous = m_previous_tags[static_cast<int>(object.type()) - 1];
+        previous.tags.clear();
+        for (const osmium::Tag& tag : object.tags()) {
+            if (osmwayback::keep_tag(tag_filter(), tag)) {
+                previous.tags.insert(std::make_pair(tag.key(), tag.value()));
+            }
+        }
+    }
+
+    const FamilyCompression* family_compression(const std::string& family) const {
+        const auto search = m_compression.find(family);
+        return search == m_compression.end() ? nullptr : &search->second;
+    }
+
+    //Location keys are decimal node ids, see DecimalKey
+    static int64_t parse_node_id(const rocksdb::Slice& key) {
+        int64_t id = 0;
+        for (size_t i = 0; i < key.size(); i++) {
+            if (key[i] < '0' || key[i] > '9') {
+                return -1;
+            }
+            id = id * 10 + (key[i] - '0');
+        }
+        return key.empty() ? -1 : id;
+    }
+
+    //Creates a column family with the compression of the profile; a build without it is useless, so exit on failure
+    void create_family(const std::string& family, rocksdb::ColumnFamilyOptions options, rocksdb::ColumnFamilyHandle** handle) {
+        //The same default as read_family_options, so the data is written the way it is read back
+        if (is_scan_family(family)) {
+            options.compression = rocksdb::kNoCompression;
+        }
+        if (const FamilyCompression* compression = family_compression(family)) {
+            apply_compression(*compression, &options);
+        }
+        const rocksdb::Status s = m_db->CreateColumnFamily(options, family, handle);
+        if (!s.ok()) {
+            std::cerr << "Could not create column family " << family << ": " << s.ToString() << std::endl;
+            std::exit(2);
+        }
+    }
+
     void flush_family(const std::string type, rocksdb::ColumnFamilyHandle* cf) {
         const auto start = std::chrono::steady_clock::now();
         std::cerr << std::endl << "Flushing " << type << "..." ;
@@ -53,13 +594,47 @@ class ObjectStore {
         std::cerr << "done in " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
     }
 
-    void compact_family(const std::string type, rocksdb::ColumnFamilyHandle* cf) {
+    /*  Compacts all families at the same time. Each CompactRange call blocks, so
+     *  every family gets its own thread; rocksdb splits each compaction further
+     *  into max_subcompactions pieces on its background threads.
+     */
+    void compact_families(const std::vector<std::pair<std::string, rocksdb::ColumnFamilyHandle*>>& families) {
         const auto start = std::chrono::steady_clock::now();
-        std::cerr << "Compacting " << type << "...";
-        m_db->CompactRange(rocksdb::CompactRangeOptions{}, cf, nullptr, nullptr);
-        const auto end = std::chrono::steady_clock::now();
-        const auto diff = end - start;
-        std::cerr << "done in " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+        std::mutex output_mutex;
+        std::atomic<size_t> remaining{families.size()};
+
+        std::cerr << "Compacting " << families.size() << " column families with " << m_compaction_threads << " threads" << std::endl;
+
+        std::vector<std::thread> threads;
+        for (const auto& family : families) {
+            threads.emplace_back([this, &family, &output_mutex, &remaining, start]() {
+                rocksdb::CompactRangeOptions options;
+                options.exclusive_manual_compaction = false; // Let the families run side by side
+                m_db->CompactRange(options, family.second, nullptr, nullptr);
+
+                const auto end = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> lock{output_mutex};
+                remaining--;
+                std::cerr << "\rCompacted " << family.first << " in " << std::chrono::duration <double, std::milli> (end - start).count() << " ms" << std::endl;
+            });
+        }
+
+        while (remaining > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            std::lock_guard<std::mutex> lock{output_mutex};
+            if (remaining > 0) {
+                std::cerr << "\rCompacting: " << remaining << "/" << families.size() << " column families left after "
+                          << std::chrono::duration_cast<std::chrono::seconds>(elapsed).count() << " s   ";
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        const auto diff = std::chrono::steady_clock::now() - start;
+        std::cerr << "Compaction done in " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
     }
 
     void report_count_stats() {
@@ -75,9 +650,37 @@ class ObjectStore {
         m_db->GetIntProperty(m_cf_relations, "rocksdb.estimate-num-keys", &relation_keys);
         std::cerr << "~" << relation_keys  << "/" << stored_relations_count << " relations" << std::endl;
 
-        uint64_t loc_keys{0};
-        m_db->GetIntProperty(m_cf_locations, "rocksdb.estimate-num-keys", &loc_keys);
-        std::cerr << "Stored ~" << loc_keys << " node keys for location " << std::endl;
+        if (m_cf_locations) {
+            uint64_t loc_keys{0};
+            m_db->GetIntProperty(m_cf_locations, "rocksdb.estimate-num-keys", &loc_keys);
+            std::cerr << "Stored ~" << loc_keys << " node keys for location " << std::endl;
+        } else if (m_node_location_writer) {
+            std::cerr << "Stored " << stored_locations_count << " node versions for location" << std::endl;
+        }
+
+        if (m_cf_spatial) {
+            uint64_t spatial_keys{0};
+            m_db->GetIntProperty(m_cf_spatial, "rocksdb.estimate-num-keys", &spatial_keys);
+            std::cerr << "Stored ~" << spatial_keys << "/" << stored_spatial_count << " spatial keys" << std::endl;
+        }
+
+        if (m_cf_changesets) {
+            uint64_t changeset_keys{0};
+            m_db->GetIntProperty(m_cf_changesets, "rocksdb.estimate-num-keys", &changeset_keys);
+            std::cerr << "Stored ~" << changeset_keys << "/" << stored_changeset_count << " changeset keys" << std::endl;
+        }
+
+        if (m_cf_users) {
+            uint64_t user_keys{0};
+            m_db->GetIntProperty(m_cf_users, "rocksdb.estimate-num-keys", &user_keys);
+            std::cerr << "Stored ~" << user_keys << "/" << stored_user_count << " user edit keys" << std::endl;
+        }
+
+        if (m_cf_parents) {
+            uint64_t parent_keys{0};
+            m_db->GetIntProperty(m_cf_parents, "rocksdb.estimate-num-keys", &parent_keys);
+            std::cerr << "Stored ~" << parent_keys << "/" << stored_parent_count << " parent ranges" << std::endl;
+        }
     }
 
 public:
@@ -86,14 +689,35 @@ public:
 
     unsigned long stored_nodes_count{0};
     unsigned long stored_locations_count{0};
+    unsigned long stored_spatial_count{0};
+    unsigned long stored_changeset_count{0};
+    unsigned long stored_user_count{0};
+    unsigned long stored_parent_count{0};
     unsigned long stored_ways_count{0};
     unsigned long stored_relations_count{0};
+    unsigned long collapsed_versions_count{0};
 
     unsigned long stored_objects_count() {
         return stored_nodes_count + stored_ways_count + stored_relations_count;
     }
 
-    ObjectStore(const std::string index_dir, const bool create) {
+    /*  block_cache_mb sets the size of the shared LRU block cache used by a
+     *  read-only store, 0 for DEFAULT_BLOCK_CACHE_MB. Long-running readers like
+     *  wayback_server want it larger.
+     *
+     *  compression is used when creating an index and recorded in it (see
+     *  "Compression" above); updates use the recorded one.
+     */
+    ObjectStore(const std::string index_dir, const bool create, const size_t block_cache_mb = 0) :
+        ObjectStore(index_dir, create ? OpenMode::create : OpenMode::read_only, block_cache_mb) {
+    }
+
+    ObjectStore(const std::string index_dir, const OpenMode mode, const size_t block_cache_mb = 0,
+                const CompressionProfile& compression = CompressionProfile{}) :
+        m_mode(mode),
+        m_index_dir(index_dir),
+        m_compression(mode == OpenMode::update ? read_compression_profile(index_dir) : compression) {
+        const bool create = (mode == OpenMode::create);
         rocksdb::Options db_options;
         db_options.allow_mmap_writes = false;
         db_options.max_background_flushes = 4;
@@ -119,51 +743,119 @@ public:
             // 2. Push back all column families
             //
             std::cerr << "Opening Database For Writing" << std::endl;;
+
+            //The final compaction in flush() is the long tail of a build, size it to the machine
+            m_compaction_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+            db_options.max_background_compactions = m_compaction_threads;
+            db_options.max_subcompactions = static_cast<uint32_t>(m_compaction_threads);
+            db_options.env->SetBackgroundThreads(m_compaction_threads, rocksdb::Env::LOW);
+
             rocksdb::DestroyDB(index_dir, db_options);
             db_options.create_if_missing = true;
             s = rocksdb::DB::Open(db_options, index_dir, &m_db);
 
-            s = m_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "nodes", &m_cf_nodes);
             assert(s.ok());
 
-            s = m_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "locations", &m_cf_locations);
-            assert(s.ok());
+            create_family("nodes", rocksdb::ColumnFamilyOptions(), &m_cf_nodes);
 
-            s = m_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "ways", &m_cf_ways);
-            assert(s.ok());
+            //Node versions are merged into their locations entry, see location_merge.hpp
+            rocksdb::ColumnFamilyOptions location_options;
+            location_options.merge_operator = osmwayback::location_merge_operator();
+            create_family("locations", location_options, &m_cf_locations);
 
-            s = m_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "relations", &m_cf_relations);
-            assert(s.ok());
+            create_family("ways", rocksdb::ColumnFamilyOptions(), &m_cf_ways);
+            create_family("relations", rocksdb::ColumnFamilyOptions(), &m_cf_relations);
+            create_family("spatial", rocksdb::ColumnFamilyOptions(), &m_cf_spatial);
+            create_family("changesets", rocksdb::ColumnFamilyOptions(), &m_cf_changesets);
+            create_family("parents", rocksdb::ColumnFamilyOptions(), &m_cf_parents);
+
+            for (const auto& family : m_compression) {
+                put_metadata(COMPRESSION_KEY_PREFIX + family.first, format_compression(family.second));
+            }
 
-        // Open the database for read-only
+        // Open the database for read-only, or read-write to update it
         } else {
+            const bool update = (mode == OpenMode::update);
             db_options.error_if_exists = false;
             db_options.create_if_missing = false;
-            std::cerr << "Opening Database READONLY" << std::endl;;
+            db_options.allow_mmap_reads = !update;
+            db_options.max_open_files = -1;
+            std::cerr << (update ? "Opening Database For Updating" : "Opening Database READONLY") << std::endl;;
 
-            //Open column families
-            std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+            //Open every column family in the index; optional ones may be missing from older indexes
+            std::vector<std::string> family_names;
+            s = rocksdb::DB::ListColumnFamilies(db_options, index_dir, &family_names);
+            assert(s.ok());
 
-            // Open default column family?
-            column_families.push_back(rocksdb::ColumnFamilyDescriptor(
-            rocksdb::kDefaultColumnFamilyName, rocksdb::ColumnFamilyOptions()));
+            //Every column family shares one block cache, see "Read Profile" above
+            const auto block_cache = rocksdb::NewLRUCache((block_cache_mb ? block_cache_mb : DEFAULT_BLOCK_CACHE_MB) * 1024 * 1024);
 
-            // Specifiy the existing column families
-            column_families.push_back(rocksdb::ColumnFamilyDescriptor( "nodes", rocksdb::ColumnFamilyOptions()));
-            column_families.push_back(rocksdb::ColumnFamilyDescriptor( "locations", rocksdb::ColumnFamilyOptions()));
-            column_families.push_back(rocksdb::ColumnFamilyDescriptor( "ways", rocksdb::ColumnFamilyOptions()));
-            column_families.push_back(rocksdb::ColumnFamilyDescriptor( "relations", rocksdb::ColumnFamilyOptions()));
+            std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+            for (const auto& name : family_names) {
+                column_families.push_back(rocksdb::ColumnFamilyDescriptor(name, read_family_options(name, block_cache, family_compression(name))));
+            }
 
             std::vector<rocksdb::ColumnFamilyHandle*> handles;
 
-            s = rocksdb::DB::OpenForReadOnly(db_options, index_dir, column_families, &handles, &m_db);
+            if (update) {
+                s = rocksdb::DB::Open(db_options, index_dir, column_families, &handles, &m_db);
+            } else {
+                s = rocksdb::DB::OpenForReadOnly(db_options, index_dir, column_families, &handles, &m_db);
+            }
             assert(s.ok());
 
-            m_cf_nodes     = handles[1];
-            m_cf_locations = handles[2];
-            m_cf_ways      = handles[3];
-            m_cf_relations = handles[4];
+            for (size_t i = 0; i < family_names.size(); i++) {
+                if (family_names[i] == "nodes")     m_cf_nodes     = handles[i];
+                if (family_names[i] == "locations") m_cf_locations = handles[i];
+                if (family_names[i] == "ways")      m_cf_ways      = handles[i];
+                if (family_names[i] == "relations") m_cf_relations = handles[i];
+                if (family_names[i] == "spatial")   m_cf_spatial   = handles[i];
+                if (family_names[i] == "changesets") m_cf_changesets = handles[i];
+                if (family_names[i] == "users")     m_cf_users     = handles[i];
+                if (family_names[i] == "parents")   m_cf_parents   = handles[i];
+                if (family_names[i] == rocksdb::kDefaultColumnFamilyName) m_cf_default = handles[i];
+            }
+
+            //New versions get the same kind of records as the rest of the index
+            std::string value;
+            if (update && get_metadata(TAG_DIFFS_KEY, &value)) {
+                m_tag_diffs = true;
+            }
+            if (update && get_metadata(WAY_SNAPSHOT_INTERVAL_KEY, &value)) {
+                m_way_snapshot_interval = static_cast<uint32_t>(std::stoul(value));
+            }
+            if (update && get_metadata(TAG_FILTER_KEY, &value)) {
+                osmwayback::parse_tag_filter(value, &m_tag_filter);
+            }
+            if (update && get_metadata(COLLAPSE_VERSIONS_KEY, &value)) {
+                m_collapse_versions = true;
+            }
+            if (get_metadata(NODE_LOCATION_STORE_KEY, &value)) {
+                if (update) {
+                    m_node_location_writer.reset(new osmwayback::NodeLocationWriter(index_dir, true));
+                } else {
+                    m_node_location_store.reset(new osmwayback::NodeLocationStore(index_dir));
+                }
+            }
+        }
+    }
+
+    ObjectStore(const ObjectStore&) = delete;
+    ObjectStore& operator=(const ObjectStore&) = delete;
+
+    // Writers must call flush() first, the WAL is disabled
+    ~ObjectStore() {
+        if (!m_db) {
+            return;
+        }
+        //A read-only store also holds a handle for the default column family
+        std::vector<rocksdb::ColumnFamilyHandle*> families{m_cf_nodes, m_cf_locations, m_cf_ways, m_cf_relations, m_cf_spatial, m_cf_changesets, m_cf_users, m_cf_parents, m_cf_default};
+        for (auto cf : families) {
+            if (cf) {
+                m_db->DestroyColumnFamilyHandle(cf);
+            }
         }
+        delete m_db;
     }
 
     rocksdb::Status get_tags(const int64_t osm_id, const int osm_type, const int version, std::string* value) {
@@ -171,21 +863,391 @@ public:
         // Lookup a specific version of an object in the DB
         //
 
-        const auto lookup = make_lookup(osm_id, version);
+        const DecimalKey key(osm_id, static_cast<uint32_t>(version));
+        const rocksdb::Slice lookup = key.slice();
         // Node
         if(osm_type== 1) {
             return m_db->Get(rocksdb::ReadOptions(), m_cf_nodes, lookup, value);
         // Way
         } else if (osm_type == 2) {
-            return m_db->Get(rocksdb::ReadOptions(), m_cf_ways, lookup, value);
+            const rocksdb::Status s = m_db->Get(rocksdb::ReadOptions(), m_cf_ways, lookup, value);
+            return s.ok() ? resolve_way(osm_id, static_cast<uint32_t>(version), value) : s;
         // Relation
         } else {
             return m_db->Get(rocksdb::ReadOptions(), m_cf_relations, lookup, value);
         }
     }
 
-    rocksdb::Status get_node_locations(const std::string nodeID, std::string* value) {
-        return m_db->Get(rocksdb::ReadOptions(), m_cf_locations, nodeID, value);
+    // Lookup a specific version of an object and decode it into the @history JSON form
+    bool get_version_json(const int64_t osm_id, const int osm_type, const int version, rapidjson::Document* doc) {
+        std::string rocksEntry;
+        if (!get_tags(osm_id, osm_type, version, &rocksEntry).ok()) {
+            return false;
+        }
+        if (osm_type == 1) {
+            osmwayback::decode_node(rocksEntry, doc);
+        } else if (osm_type == 2) {
+            osmwayback::decode_way(rocksEntry, doc);
+        } else {
+            osmwayback::decode_relation(rocksEntry, doc);
+        }
+        return true;
+    }
+
+    // Versions may not be contiguous, walk back to the closest stored version before `version`
+    bool get_previous_version_json(const int64_t osm_id, const int osm_type, const int version, rapidjson::Document* doc) {
+        for (int v = version - 1; v >= 1; v--) {
+            if (get_version_json(osm_id, osm_type, v, doc)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    rocksdb::ColumnFamilyHandle* family(const int osm_type) {
+        if (osm_type == 1) return m_cf_nodes;
+        if (osm_type == 2) return m_cf_ways;
+        return m_cf_relations;
+    }
+
+    // Iterate over every stored version of one object type; caller owns the iterator
+    rocksdb::Iterator* new_iterator(const int osm_type) {
+        return m_db->NewIterator(rocksdb::ReadOptions(), family(osm_type));
+    }
+
+    rocksdb::ColumnFamilyHandle* family(const std::string& name) {
+        if (name == "nodes")      return m_cf_nodes;
+        if (name == "ways")       return m_cf_ways;
+        if (name == "relations")  return m_cf_relations;
+        if (name == "locations")  return m_cf_locations;
+        if (name == "spatial")    return m_cf_spatial;
+        if (name == "changesets") return m_cf_changesets;
+        if (name == "users")      return m_cf_users;
+        if (name == "parents")    return m_cf_parents;
+        return nullptr;
+    }
+
+    // Iterate over a column family by name, nullptr if the index does not have it; caller owns the iterator
+    rocksdb::Iterator* new_iterator(const std::string& name) {
+        rocksdb::ColumnFamilyHandle* cf = family(name);
+        return cf ? m_db->NewIterator(rocksdb::ReadOptions(), cf) : nullptr;
+    }
+
+    /*  The smallest key of every table file of a column family, in key order.
+     *  Splitting a scan at these gives ranges of similar size.
+     */
+    std::vector<std::string> table_file_boundaries(const std::string& name) {
+        std::vector<rocksdb::LiveFileMetaData> files;
+        m_db->GetLiveFilesMetaData(&files);
+
+        std::vector<std::string> boundaries;
+        for (const auto& file : files) {
+            if (file.column_family_name == name) {
+                boundaries.push_back(file.smallestkey);
+            }
+        }
+        std::sort(boundaries.begin(), boundaries.end());
+        boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+        return boundaries;
+    }
+
+    /*  Split points for scanning a column family in about `ranges` key ranges
+     *  of similar size, taken from its table file boundaries. With whole_objects,
+     *  "id!version" keys are cut back to their "id!" so all versions of an
+     *  object stay in one range.
+     */
+    std::vector<std::string> range_boundaries(const std::string& name, const size_t ranges, const bool whole_objects) {
+        const std::vector<std::string> files = table_file_boundaries(name);
+
+        std::vector<std::string> boundaries;
+        for (size_t i = 1; i < ranges; i++) {
+            const size_t file = i * files.size() / ranges;
+            if (file == 0 || file >= files.size()) {
+                continue;
+            }
+            std::string boundary = files[file];
+            if (whole_objects) {
+                const size_t bang = boundary.find('!');
+                if (bang != std::string::npos) {
+                    boundary.resize(bang + 1);
+                }
+            }
+            if (boundaries.empty() || boundary > boundaries.back()) {
+                boundaries.push_back(boundary);
+            }
+        }
+        return boundaries;
+    }
+
+    // Highest stored version of an object, or 0 if it is not in the index
+    int latest_version(const int64_t osm_id, const int osm_type) {
+        const std::string prefix = std::to_string(osm_id) + "!";
+
+        int latest{0};
+        std::unique_ptr<rocksdb::Iterator> it{new_iterator(osm_type)};
+        for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+            //Keys sort as strings ("id!10" < "id!9"), so check them all
+            const int v = std::stoi(it->key().ToString().substr(prefix.size()));
+            if (v > latest) {
+                latest = v;
+            }
+        }
+        return latest;
+    }
+
+    /*  Finds the version of an object that was valid at `timestamp`: the latest
+     *  version created at or before it. A version from the same changeset always
+     *  qualifies, because members are often uploaded a moment after their parent.
+     */
+    rocksdb::Status get_version_at(const int64_t osm_id, const int osm_type, const uint64_t timestamp, const uint32_t changeset, std::string* value) {
+        const std::string prefix = std::to_string(osm_id) + "!";
+
+        uint64_t best_timestamp{0};
+        uint32_t best_version{0};
+        bool found = false;
+
+        std::unique_ptr<rocksdb::Iterator> it{new_iterator(osm_type)};
+        for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+            uint64_t t{0};
+            uint32_t c{0};
+            uint32_t v{0};
+            osmwayback::decode_meta(it->value().ToString(), &t, &c, &v);
+
+            if (t > timestamp && c != changeset) {
+                continue;
+            }
+            if (!found || t > best_timestamp || (t == best_timestamp && v > best_version)) {
+                best_timestamp = t;
+                best_version = v;
+                value->assign(it->value().data(), it->value().size());
+                found = true;
+            }
+        }
+        if (found && osm_type == 2) {
+            return resolve_way(osm_id, best_version, value);
+        }
+        return found ? rocksdb::Status::OK() : rocksdb::Status::NotFound();
+    }
+
+    /*  Rebuilds a way version stored as an edit script (see way_delta.hpp) into
+     *  a full record, walking back to the last snapshot. Other records are left
+     *  alone. get_tags and get_version_at do this already; code that reads the
+     *  ways family with its own iterator must call it for every value.
+     *
+     *  The nodes of the last rebuilt version are kept per thread, so reading a
+     *  way's versions in order rebuilds each from the one before.
+     */
+    rocksdb::Status resolve_way(const int64_t osm_id, const uint32_t version, std::string* value) {
+        if (!osmwayback::is_way_delta(*value)) {
+            return rocksdb::Status::OK();
+        }
+
+        struct ResolvedWay {
+            uint64_t instance{0};
+            int64_t id{0};
+            uint32_t version{0};
+            std::vector<int64_t> nodes{};
+        };
+        static thread_local ResolvedWay last;
+
+        //Collect edit scripts back to a snapshot or the cached version, newest first
+        std::vector<osmwayback::WayDelta> deltas(1);
+        if (!osmwayback::read_way_delta(*value, &deltas.back())) {
+            return rocksdb::Status::Corruption("invalid way edit script");
+        }
+        std::vector<int64_t> nodes;
+        std::string base;
+        while (true) {
+            const uint32_t base_version = deltas.back().base_version;
+            if (last.instance == m_instance && last.id == osm_id && last.version == base_version) {
+                nodes = last.nodes;
+                break;
+            }
+            const rocksdb::Status s = m_db->Get(rocksdb::ReadOptions(), m_cf_ways, make_lookup(osm_id, static_cast<int>(base_version)), &base);
+            if (!s.ok()) {
+                return rocksdb::Status::Corruption("missing base version of a way edit script");
+            }
+            if (!osmwayback::is_way_delta(base)) {
+                osmwayback::read_way_nodes(base, &nodes);
+                break;
+            }
+            deltas.emplace_back();
+            if (!osmwayback::read_way_delta(base, &deltas.back()) || deltas.size() > deltas.front().depth) {
+                return rocksdb::Status::Corruption("invalid way edit script");
+            }
+        }
+
+        for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+            if (!osmwayback::apply_node_edit_script(it->script, &nodes)) {
+                return rocksdb::Status::Corruption("way edit script does not fit its base version");
+            }
+        }
+
+        *value = osmwayback::rebuild_way_record(*value, deltas.front(), nodes);
+        last.instance = m_instance;
+        last.id = osm_id;
+        last.version = version;
+        last.nodes.swap(nodes);
+        return rocksdb::Status::OK();
+    }
+
+    // Index metadata in the default column family, see "Index Metadata" above
+    bool get_metadata(const std::string& key, std::string* value) {
+        return m_db->Get(rocksdb::ReadOptions(), key, value).ok();
+    }
+
+    void put_metadata(const std::string& key, const std::string& value) {
+        rocksdb::Status s = m_db->Put(m_write_options, key, value);
+        assert(s.ok());
+    }
+
+    bool has_location_index() const {
+        return m_cf_locations != nullptr || m_node_location_store || m_node_location_writer;
+    }
+
+    //True if node locations are served from a node location store, see node_location_store.hpp
+    bool has_node_location_store() const {
+        return m_node_location_store != nullptr;
+    }
+
+    bool has_spatial_index() const {
+        return m_cf_spatial != nullptr;
+    }
+
+    /*  Calls func(node_id, location) for every location a node ever had inside the
+     *  box. A node that was at several places inside the box is reported for each.
+     */
+    template <typename TFunc>
+    void for_each_location_in_box(const osmium::Box& box, TFunc&& func) {
+        std::unique_ptr<rocksdb::Iterator> it{m_db->NewIterator(rocksdb::ReadOptions(), m_cf_spatial)};
+
+        osmium::Location location;
+        int64_t node_id;
+        for (const auto& range : osmwayback::cover_box(box)) {
+            for (it->Seek(osmwayback::make_spatial_bound(range.first)); it->Valid(); it->Next()) {
+                if (osmwayback::read_big_endian(it->key().data()) > range.second) {
+                    break;
+                }
+                osmwayback::parse_spatial_key(it->key().data(), &location, &node_id);
+                if (box.contains(location)) {
+                    func(node_id, location);
+                }
+            }
+        }
+    }
+
+    bool has_user_index() const {
+        return m_cf_users != nullptr;
+    }
+
+    /*  Calls func(timestamp, osm_type, osm_id, version) for every object version
+     *  created by `uid`, in time order.
+     */
+    template <typename TFunc>
+    void for_each_user_edit(const uint32_t uid, TFunc&& func) {
+        std::unique_ptr<rocksdb::Iterator> it{m_db->NewIterator(rocksdb::ReadOptions(), m_cf_users)};
+
+        const std::string prefix = osmwayback::make_user_bound(uid);
+        uint32_t key_uid;
+        uint64_t timestamp;
+        int osm_type;
+        int64_t osm_id;
+        uint32_t version;
+        for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+            osmwayback::parse_user_key(it->key().data(), &key_uid, &timestamp, &osm_type, &osm_id, &version);
+            func(timestamp, osm_type, osm_id, version);
+        }
+    }
+
+    bool has_parent_index() const {
+        return m_cf_parents != nullptr;
+    }
+
+    /*  Calls func(parent_type, parent_id, first_version, last_version) for every
+     *  range of versions of a way or relation that had the object as a node or
+     *  member, in parent order. Nodes have way and relation parents, ways and
+     *  relations only relation parents.
+     */
+    template <typename TFunc>
+    void for_each_parent(const int osm_type, const int64_t osm_id, TFunc&& func) {
+        std::unique_ptr<rocksdb::Iterator> it{m_db->NewIterator(rocksdb::ReadOptions(), m_cf_parents)};
+
+        const std::string prefix = osmwayback::make_parent_bound(osm_type, osm_id);
+        int parent_type;
+        int64_t parent_id;
+        uint32_t first_version;
+        uint32_t last_version;
+        for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+            osmwayback::parse_parent_key(it->key().data(), &parent_type, &parent_id, &first_version, &last_version);
+            func(parent_type, parent_id, first_version, last_version);
+        }
+    }
+
+    bool has_changeset_index() const {
+        return m_cf_changesets != nullptr;
+    }
+
+    /*  Calls func(changeset, osm_type, osm_id, version) for every object version
+     *  created in a changeset from `first` to `last` (inclusive), in changeset order.
+     */
+    template <typename TFunc>
+    void for_each_changeset_entry(const uint32_t first, const uint32_t last, TFunc&& func) {
+        std::unique_ptr<rocksdb::Iterator> it{m_db->NewIterator(rocksdb::ReadOptions(), m_cf_changesets)};
+
+        uint32_t changeset;
+        int osm_type;
+        int64_t osm_id;
+        uint32_t version;
+        for (it->Seek(osmwayback::make_changeset_bound(first)); it->Valid(); it->Next()) {
+            osmwayback::parse_changeset_key(it->key().data(), &changeset, &osm_type, &osm_id, &version);
+            if (changeset > last) {
+                break;
+            }
+            func(changeset, osm_type, osm_id, version);
+        }
+    }
+
+    /*  The locations entry of a node (JSON, see encode_location_json). With a
+     *  node location store it is encoded from the stored history, readers that
+     *  decode it anyway should use get_node_location_history.
+     */
+    rocksdb::Status get_node_locations(const rocksdb::Slice& node_id, std::string* value) {
+        if (m_node_location_store) {
+            std::vector<jsonencoding::NodeLocationVersion> versions;
+            if (!get_node_location_history(parse_node_id(node_id), &versions)) {
+                return rocksdb::Status::NotFound();
+            }
+            *value = jsonencoding::encode_location_history(versions);
+            return rocksdb::Status::OK();
+        }
+        return m_db->Get(rocksdb::ReadOptions(), m_cf_locations, node_id, value);
+    }
+
+    // Every version of a node's location in timestamp order, false if it has none
+    bool get_node_location_history(const int64_t node_id, std::vector<jsonencoding::NodeLocationVersion>* versions) {
+        if (m_node_location_store) {
+            return m_node_location_store->get(node_id, versions);
+        }
+        versions->clear();
+        std::string value;
+        const DecimalKey key{node_id};
+        return m_db->Get(rocksdb::ReadOptions(), m_cf_locations, key.slice(), &value).ok() &&
+               jsonencoding::decode_location_history(value, versions);
+    }
+
+    // Batch variant of get_node_locations, one status and value per node
+    std::vector<rocksdb::Status> get_node_locations(const std::vector<std::string>& nodeIDs, std::vector<std::string>* values) {
+        if (m_node_location_store) {
+            std::vector<rocksdb::Status> statuses;
+            values->resize(nodeIDs.size());
+            for (size_t i = 0; i < nodeIDs.size(); i++) {
+                statuses.push_back(get_node_locations(nodeIDs[i], &(*values)[i]));
+            }
+            return statuses;
+        }
+        std::vector<rocksdb::Slice> keys(nodeIDs.begin(), nodeIDs.end());
+        std::vector<rocksdb::ColumnFamilyHandle*> families(keys.size(), m_cf_locations);
+        return m_db->MultiGet(rocksdb::ReadOptions(), families, keys, values);
     }
 
 /*
@@ -194,9 +1256,10 @@ public:
     void store_pbf_node(const osmium::Node&node) {
       std::string lookup = make_lookup( node.id(), node.version() );
 
-      if ( store_pbf_object( osmwayback::encode_node(node), lookup, m_cf_nodes) ){
+      if ( store_pbf_object( osmwayback::encode_node(node, previous_tags(node), tag_filter()), lookup, m_cf_nodes) ){
           stored_nodes_count++;
       }
+      remember_tags(node);
 
       //PBF Nodes always include geometries, flush in bulks of 5M
       if (stored_nodes_count != 0 && (stored_nodes_count % 5000000) == 0) {
@@ -208,9 +1271,10 @@ public:
     void store_pbf_way(const osmium::Way&way) {
       std::string lookup = make_lookup( way.id(), way.version() );
 
-      if ( store_pbf_object( osmwayback::encode_way(way), lookup, m_cf_ways) ){
+      if ( store_pbf_object( encode_way_record(way), lookup, m_cf_ways) ){
           stored_ways_count++;
       }
+      remember_tags(way);
 
       //PBF Ways... flush in bulks of 2M
       if (stored_ways_count != 0 && (stored_ways_count % 2000000) == 0) {
@@ -219,61 +1283,217 @@ public:
       }
     }
 
-    /*  Looks up a NODE ID and performs an upsert to the locations CF, adding new historical
-     *    versions to it, keyed by changeset.
+    /*  Adds this version of a node to its entry in the locations CF, keyed by
+     *  changeset. This is a Merge, not a read-modify-write: the operand holds
+     *  only this version and location_merge.hpp folds it into the entry.
      */
     void upsert_node_location(const osmium::Node& node){
+        if (m_node_location_writer) {
+            m_node_location_writer->add(node);
+            stored_locations_count++;
+            return;
+        }
 
         rapidjson::Document nodeLocations;
-
-        std::string rocksEntry;
+        nodeLocations.SetObject();
 
         //First, extract location information from this node.
         std::string nodeKey = std::to_string(node.id());
 
-        rocksdb::Status s = m_db->Get(rocksdb::ReadOptions(), m_cf_locations, nodeKey, &rocksEntry);
-
-        if ( s.IsNotFound() ){
-            //There is not value at that key, so start the object
-            nodeLocations.SetObject();
-        }else{
-            //nodeLocations is a JSON object...
-            nodeLocations.Parse<0>(rocksEntry.c_str());
-        }
         //Add this changeset to the node
         if( jsonencoding::encode_location_json(node, nodeLocations) ){
             rapidjson::StringBuffer buffer;
             rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
             nodeLocations.Accept(writer);
 
-            rocksdb::Status stat = m_db->Put(rocksdb::WriteOptions(), m_cf_locations, nodeKey, buffer.GetString());
+            rocksdb::Status stat = m_buffer_batch.Merge(m_cf_locations, nodeKey, rocksdb::Slice(buffer.GetString(), buffer.GetSize()));
 
             if ( stat.ok() ){
                 stored_locations_count++;
             }
+
+            //Write in chunks of 2000
+            if (m_buffer_batch.Count() > 2000) {
+                m_db->Write(m_write_options, &m_buffer_batch);
+                m_buffer_batch.Clear();
+            }
         }
         if (stored_locations_count != 0 && (stored_locations_count % 1000000) == 0) {
             flush_family("locations", m_cf_locations);
         }
     }
 
-    void store_json_relation(const osmium::Relation& relation) {
-        //Get basic properties, initialize json
-        rapidjson::Document json;
-        json = jsonencoding::extract_osm_properties(relation);
+    //Index this version's location by its position on the curve, see spatial.hpp
+    void store_spatial_location(const osmium::Node& node) {
+        if (node.deleted() || !node.location().valid()) {
+            return;
+        }
+        if ( store_pbf_object( "", osmwayback::make_spatial_key(node.location(), node.id()), m_cf_spatial) ){
+            stored_spatial_count++;
+        }
+        if (stored_spatial_count != 0 && (stored_spatial_count % 5000000) == 0) {
+            flush_family("spatial", m_cf_spatial);
+        }
+    }
+
+    //Record which object version this changeset created
+    void store_changeset_entry(const osmium::OSMObject& object) {
+        const int osm_type = static_cast<int>(object.type());
+        if ( store_pbf_object( "", osmwayback::make_changeset_key(object.changeset(), osm_type, object.id(), object.version()), m_cf_changesets) ){
+            stored_changeset_count++;
+        }
+        if (stored_changeset_count != 0 && (stored_changeset_count % 5000000) == 0) {
+            flush_family("changesets", m_cf_changesets);
+        }
+    }
+
+    /*  Records the nodes or members of this version of a way or relation as
+     *  ranges of parent versions in the parents CF, see keys.hpp. A range is
+     *  written when a version drops the child or the next parent starts, so
+     *  parents must be stored in id and version order.
+     */
+    void store_parent_entries(const osmium::OSMObject& parent) {
+        OpenParentRanges& ranges = m_parent_ranges[parent.type() == osmium::item_type::way ? 0 : 1];
+        if (ranges.type == 0 || ranges.id != parent.id()) {
+            close_parent_ranges(&ranges);
+            ranges.type = static_cast<int>(parent.type());
+            ranges.id = parent.id();
+            ranges.version = 0;
+            if (m_mode == OpenMode::update) {
+                reopen_parent_ranges(parent, &ranges);
+            }
+        }
 
+        std::vector<std::pair<int, int64_t>> children;
+        if (parent.type() == osmium::item_type::way) {
+            for (const osmium::NodeRef& nr : static_cast<const osmium::Way&>(parent).nodes()) {
+                children.emplace_back(static_cast<int>(osmium::item_type::node), nr.ref());
+            }
+        } else {
+            for (const osmium::RelationMember& member : static_cast<const osmium::Relation&>(parent).members()) {
+                children.emplace_back(static_cast<int>(member.type()), member.ref());
+            }
+        }
+        std::sort(children.begin(), children.end());
+        children.erase(std::unique(children.begin(), children.end()), children.end());
+
+        for (auto it = ranges.children.begin(); it != ranges.children.end();) {
+            if (std::binary_search(children.begin(), children.end(), it->first)) {
+                ++it;
+            } else {
+                write_parent_range(ranges, it->first, it->second);
+                it = ranges.children.erase(it);
+            }
+        }
+        for (const auto& child : children) {
+            ranges.children.emplace(child, parent.version());
+        }
+        ranges.version = parent.version();
+    }
+
+    //The users CF is optional, it is only created when asked for
+    void enable_user_index() {
+        create_family("users", rocksdb::ColumnFamilyOptions(), &m_cf_users);
+    }
+
+    /*  Store the aA/aM/aD tag diff against the previous version with every
+     *  version, see pbf_encoding.hpp. Objects must be stored in id and version
+     *  order, as they are in a history file.
+     */
+    void enable_tag_diffs() {
+        m_tag_diffs = true;
+        put_metadata(TAG_DIFFS_KEY, "1");
+    }
+
+    /*  Store way node lists as snapshots every `interval` versions and edit
+     *  scripts in between, see way_delta.hpp. Ways must be stored in id and
+     *  version order, as they are in a history file.
+     */
+    void enable_way_deltas(const uint32_t interval) {
+        m_way_snapshot_interval = std::max(1u, interval);
+        put_metadata(WAY_SNAPSHOT_INTERVAL_KEY, std::to_string(m_way_snapshot_interval));
+    }
+
+    //Only keep the tags `filter` keeps, see tag_filter.hpp
+    void set_tag_filter(const osmwayback::TagFilter& filter) {
+        m_tag_filter = filter;
+        put_metadata(TAG_FILTER_KEY, osmwayback::format_tag_filter(filter));
+    }
+
+    /*  Keep node location histories in a memory mapped node location store
+     *  instead of the locations family, which is dropped. Nodes must be stored
+     *  in id and version order.
+     */
+    void enable_node_location_store() {
+        if (m_cf_locations) {
+            m_db->DropColumnFamily(m_cf_locations);
+            m_db->DestroyColumnFamilyHandle(m_cf_locations);
+            m_cf_locations = nullptr;
+        }
+        m_node_location_writer.reset(new osmwayback::NodeLocationWriter(m_index_dir, false));
+        put_metadata(NODE_LOCATION_STORE_KEY, "1");
+    }
+
+    /*  Leave out versions that change nothing but filtered tags or metadata,
+     *  see collapses(). Objects must be stored in id and version order.
+     */
+    void enable_version_collapsing() {
+        m_collapse_versions = true;
+        put_metadata(COLLAPSE_VERSIONS_KEY, "1");
+    }
+
+    /*  True if `object` has the same kept tags, geometry and visibility as the
+     *  version of it stored last, so it should not be stored (or indexed in any
+     *  other family) at all. Always false unless version collapsing is enabled.
+     *  When updating, the first version of an object in the changes is compared
+     *  to the latest older version in the index.
+     */
+    bool collapses(const osmium::OSMObject& object) {
+        if (!m_collapse_versions) {
+            return false;
+        }
+        StoredContent& previous = m_stored_content[static_cast<int>(object.type()) - 1];
+        if (previous.id != object.id()) {
+            previous.id = object.id();
+            previous.valid = m_mode == OpenMode::update && load_stored_content(object, &previous.content);
+        }
+
+        osmwayback::ObjectVersion content;
+        osmwayback::object_content(object, tag_filter(), &content);
+        if (previous.valid && osmwayback::same_content(previous.content, content)) {
+            collapsed_versions_count++;
+            return true;
+        }
+        previous.content = std::move(content);
+        previous.valid = true;
+        return false;
+    }
+
+    //Record this version in its author's edit history
+    void store_user_entry(const osmium::OSMObject& object) {
+        const int osm_type = static_cast<int>(object.type());
+        const std::string key = osmwayback::make_user_key(object.uid(), object.timestamp().seconds_since_epoch(), osm_type, object.id(), object.version());
+        if ( store_pbf_object( "", key, m_cf_users) ){
+            stored_user_count++;
+        }
+        if (stored_user_count != 0 && (stored_user_count % 5000000) == 0) {
+            flush_family("users", m_cf_users);
+        }
+    }
+
+    void store_pbf_relation(const osmium::Relation& relation) {
         std::string lookup = make_lookup( relation.id(), relation.version() );
 
-        if(store_json_object(json, lookup, m_cf_relations)) {
+        if ( store_pbf_object( osmwayback::encode_relation(relation, previous_tags(relation), tag_filter()), lookup, m_cf_relations) ){
             stored_relations_count++;
         }
+        remember_tags(relation);
         if (stored_relations_count != 0 && (stored_relations_count % 1000000) == 0) {
             flush_family("relations", m_cf_relations);
             report_count_stats();
         }
     }
 
-
 /*
     Store objects to RocksDB
 */
@@ -309,18 +1529,41 @@ public:
     }
 
     void flush() {
+        if (m_cf_parents) {
+            close_parent_ranges(&m_parent_ranges[0]);
+            close_parent_ranges(&m_parent_ranges[1]);
+        }
         m_db->Write(m_write_options, &m_buffer_batch);
         m_buffer_batch.Clear();
+        if (m_node_location_writer) {
+            m_node_location_writer->flush();
+        }
 
-        flush_family("nodes",       m_cf_nodes);
-        flush_family("ways",        m_cf_ways);
-        flush_family("relations",   m_cf_relations);
-        flush_family("locations",   m_cf_locations);
+        //Optional families may be missing from an index that is being updated
+        std::vector<std::pair<std::string, rocksdb::ColumnFamilyHandle*>> families;
+        const std::vector<std::pair<std::string, rocksdb::ColumnFamilyHandle*>> all_families{
+            {"nodes",      m_cf_nodes},
+            {"ways",       m_cf_ways},
+            {"relations",  m_cf_relations},
+            {"locations",  m_cf_locations},
+            {"spatial",    m_cf_spatial},
+            {"changesets", m_cf_changesets},
+            {"users",      m_cf_users},
+            {"parents",    m_cf_parents}
+        };
+        for (const auto& family : all_families) {
+            if (family.second) {
+                flush_family(family.first, family.second);
+                families.push_back(family);
+            }
+        }
+        //The WAL is disabled, so the metadata has to be flushed too
+        flush_family("metadata", m_db->DefaultColumnFamily());
 
-        compact_family("nodes",     m_cf_nodes);
-        compact_family("ways",      m_cf_ways);
-        compact_family("relations", m_cf_relations);
-        compact_family("locations", m_cf_locations);
+        //An update only adds a day's worth of changes, leave compaction to rocksdb (or finalize_index)
+        if (m_mode == OpenMode::create) {
+            compact_families(families);
+        }
 
         report_count_stats();
     }
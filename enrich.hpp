@@ -0,0 +1,423 @@
+#pragma once
+
+/*
+    Feature Enrichment
+    ==================
+
+    The lookups behind add_history and add_geometry, working on a parsed GeoJSON
+    feature so that they can be shared by the command line tools and the
+    history server.
+
+    add_history:        adds the `@history` property (see HISTORICAL_SCHEMA.md)
+    add_node_locations: adds `nodeLocations`, every version of every node ever
+                        referenced in `@history`
+    add_node_histories: the same node histories for a list of node IDs, for
+                        features that share them (see node_batch.hpp)
+    add_minor_versions: adds major version geometries and `minorVersions`
+                        instead (see minor_versions.hpp)
+
+    These throw if a feature is missing the properties they need.
+
+    Working data (stored records, node keys, parsed location entries) is
+    reused between versions and nodes and never copied into std::strings, so
+    a feature whose document lives in a FeatureArena (see feature_arena.hpp)
+    rarely reaches malloc.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "db.hpp"
+#include "feature_arena.hpp"
+#include "pbf_encoding.hpp"
+#include "json_encoding.hpp"
+#include "minor_versions.hpp"
+#include "tag_diff.hpp"
+
+namespace osmwayback {
+
+    const bool PBF_DECODING = true;
+
+    struct EnrichStats {
+        std::atomic<long> lookup_fail{0};
+        std::atomic<long> dbrocks_parse_error{0};
+        std::atomic<long> history_count{0};
+        std::atomic<long> node_lookup_failures{0};
+        std::atomic<long> minor_version_count{0};
+    };
+
+    inline void add_history(ObjectStore* store, rapidjson::Document& geojson_doc, EnrichStats* stats) {
+        //Lookup critical object attributes
+        const auto version     = geojson_doc["properties"]["@version"].GetInt();
+        const auto osm_id      = geojson_doc["properties"]["@id"].GetInt64();
+        const rapidjson::Value& type = geojson_doc["properties"]["@type"];
+
+        rapidjson::Value object_history(rapidjson::kArrayType);
+        //Versions are decoded straight into the feature's allocator so they outlive this call
+        rapidjson::Document stored_doc(&geojson_doc.GetAllocator());
+
+        int osmType = 1;
+
+        if(type == "node")     osmType = 1;
+        else if(type == "way")      osmType = 2;
+        else if(type == "relation") osmType = 3;
+
+        //Tags of the last version without a stored diff and of the current one, swapped per version
+        VersionTags previous_tags;
+        VersionTags version_tags;
+        bool has_previous = false;
+
+        int hist_it_idx = 0; //Can't trust the versions because they may not be contiguous
+
+        std::string rocksEntry; //Reused by every version
+        for(int v = 1; v <= version; v++) { //Going up to current version so that history is complete
+
+            rocksdb::Status s = store->get_tags(osm_id, osmType, v, &rocksEntry);
+
+            if (s.ok()) {
+                //An index built with --tag-diffs stores aA/aM/aD with each version
+                bool stored_diff = false;
+                if (PBF_DECODING && osmType==1){
+                    stored_diff = osmwayback::decode_node(rocksEntry, &stored_doc, true);
+                }else if (PBF_DECODING && osmType==2){
+                    stored_diff = osmwayback::decode_way(rocksEntry, &stored_doc, true);
+                }else if (PBF_DECODING && osmType==3){
+                    stored_diff = osmwayback::decode_relation(rocksEntry, &stored_doc, true);
+                }else{
+                    if(stored_doc.Parse<0>(rocksEntry.c_str()).HasParseError()) {
+                        stats->dbrocks_parse_error++;
+                        continue;
+                    }
+                }
+
+                if (!stored_diff) {
+                    /*
+                        a  = tags (attributes)
+                        aA = attributes added;
+                        aM = attributes modified;
+                        aD = attributes deleted;
+                    */
+
+                    osmwayback::read_version_tags(stored_doc, &version_tags);
+
+                    //It's the first version
+                    if (!has_previous){
+                        //If it's the first version, then all of these tags are new
+                        if (stored_doc.HasMember("a") && !stored_doc["a"].ObjectEmpty()){
+                            stored_doc.AddMember("aA", stored_doc["a"], geojson_doc.GetAllocator());
+                        }
+                    }else{
+                        osmwayback::add_tag_diff(previous_tags, version_tags, stored_doc, geojson_doc.GetAllocator());
+                    }
+                    previous_tags.swap(version_tags);
+                    has_previous = true;
+                    stored_doc.RemoveMember("a"); //We'll remove the larger attributes object because we're only keeping diffs.
+                }
+                hist_it_idx++;
+
+                //Save the new object into the object history
+                object_history.PushBack(stored_doc, geojson_doc.GetAllocator());
+
+            } else {
+                stats->lookup_fail++;
+                continue;
+            }
+        }//end VERSION LOOP
+
+        //Last, add history to original object
+        geojson_doc["properties"].AddMember("@history", object_history, geojson_doc.GetAllocator());
+        stats->history_count += hist_it_idx;
+    }
+
+    //The nodeLocations entry of one node, as add_node_locations copies it from a locations entry
+    inline void add_location_versions(const std::vector<jsonencoding::NodeLocationVersion>& versions, rapidjson::Value* history, rapidjson::Document::AllocatorType& a) {
+        for (const auto& v : versions) {
+            rapidjson::Value changesetID;
+            changesetID.SetString(std::to_string(v.changeset), a);
+
+            rapidjson::Value nodeVersion(rapidjson::kObjectType);
+            nodeVersion.AddMember("h", rapidjson::Value(v.user, a), a);
+            nodeVersion.AddMember("u", static_cast<int>(v.uid), a);
+            nodeVersion.AddMember("i", static_cast<int>(v.version), a);
+            nodeVersion.AddMember("t", static_cast<int64_t>(v.timestamp), a);
+            nodeVersion.AddMember("c", static_cast<int64_t>(v.changeset), a);
+            if (v.location.valid()) {
+                rapidjson::Value coordinates(rapidjson::kArrayType);
+                coordinates.PushBack(v.location.lon(), a);
+                coordinates.PushBack(v.location.lat(), a);
+                nodeVersion.AddMember("p", coordinates, a);
+            }
+            history->AddMember(changesetID, nodeVersion, a);
+        }
+    }
+
+    //Appends every node ID in the `n` lists of a feature's @history
+    inline void collect_node_refs(const rapidjson::Value& geojson_doc, std::vector<int64_t>* nodeRefs) {
+        //Iterate through the history object, looking for node references
+        for (auto& histObj : geojson_doc["properties"]["@history"].GetArray()){
+
+            //If there are node references
+            if (histObj.HasMember("n") ){
+                for (auto& nodeRef : histObj["n"].GetArray()){
+                    nodeRefs->push_back(nodeRef.GetInt64());
+                }
+            }
+        }
+    }
+
+    /*  Adds the history of every node in nodeRefs to `nodeLocations`, keyed by
+     *  node ID and changeset ID, with values allocated from `a`. nodeRefs
+     *  must be sorted and unique.
+     */
+    inline void add_node_histories(ObjectStore* store, const std::vector<int64_t>& nodeRefs, rapidjson::Value& nodeLocations,
+                                   rapidjson::Document::AllocatorType& a, EnrichStats* stats) {
+        //Node IDs as keys, in the order of their decimal strings like the rest of the output
+        std::vector<std::pair<DecimalKey, int64_t>> nodeKeys;
+        nodeKeys.reserve(nodeRefs.size());
+        for (const int64_t ref : nodeRefs) {
+            nodeKeys.emplace_back(DecimalKey{ref}, ref);
+        }
+        std::sort(nodeKeys.begin(), nodeKeys.end(), [](const std::pair<DecimalKey, int64_t>& lhs, const std::pair<DecimalKey, int64_t>& rhs) {
+            return lhs.first.slice().compare(rhs.first.slice()) < 0;
+        });
+
+        FeatureArena& arena = thread_arena();
+        std::string rocksEntry; //Reused by every node
+        std::vector<jsonencoding::NodeLocationVersion> versions; //Reused by every node, node location store only
+
+        /* nodeLocations will become the following object.
+         * {
+              nodeID : {
+                changesetID : {
+                  p: [lon, lat]
+                  i: <version>
+                  u: <uid>
+                  h: <handle>
+                },
+                changesetID : ...
+              },
+              nodeID : ...
+            }
+         */
+
+        //Iterate through the set of unique node IDs associated with this object
+        for (const auto& node : nodeKeys){
+            const DecimalKey& nodeKey = node.first;
+
+            //The node location store decodes straight into versions, no JSON to parse
+            if (store->has_node_location_store()) {
+                if (store->get_node_location_history(node.second, &versions)) {
+                    rapidjson::Value nodeIDStr;
+                    nodeIDStr.SetString(nodeKey.data(), static_cast<rapidjson::SizeType>(nodeKey.size()), a);
+                    rapidjson::Value thisNodeHistoryNew(rapidjson::kObjectType);
+                    add_location_versions(versions, &thisNodeHistoryNew, a);
+                    nodeLocations.AddMember(nodeIDStr, thisNodeHistoryNew, a);
+                } else {
+                    stats->node_lookup_failures++;
+                }
+                continue;
+            }
+
+            rocksdb::Status status = store->get_node_locations(nodeKey.slice(), &rocksEntry);
+
+            //rocksEntry is now the string from rocksDB, parse it into JSON
+            if(status.ok()){
+                rapidjson::Value nodeIDStr;
+                nodeIDStr.SetString(nodeKey.data(), static_cast<rapidjson::SizeType>(nodeKey.size()), a); //Set the ID of the node
+
+                //Only needed until its entries are copied into the feature
+                rapidjson::Document thisNodeHistory(&arena.scratch());
+                thisNodeHistory.Parse<rapidjson::kParseFullPrecisionFlag>( rocksEntry.c_str() );
+
+                //DEBUGGING: Print out the string from rocksDB
+                // std::cerr << rocksEntry.c_str() << std::endl;
+
+                //A new object we'll deepcopy values into?
+                rapidjson::Value thisNodeHistoryNew(rapidjson::kObjectType);
+
+                //Iterate through the history of this individual node
+                for ( rapidjson::Value::ConstMemberIterator itr = thisNodeHistory.MemberBegin();
+                      itr != thisNodeHistory.MemberEnd();
+                      ++itr) {   //iterate through object
+
+                    //Debugging: Print the ID of the changeset
+                    // std::cerr << itr->name.GetString() << " "; //key name
+
+                    rapidjson::Value changesetID;
+                    changesetID.SetString(itr->name.GetString(), itr->name.GetStringLength(), a);
+
+                    rapidjson::Value nodeVersion(rapidjson::kObjectType);
+                    nodeVersion.SetObject();
+
+                    rapidjson::Value handle;
+                    handle.SetString(itr->value["h"].GetString(), itr->value["h"].GetStringLength(), a);
+                    nodeVersion.AddMember("h",handle,a);
+
+                    rapidjson::Value uid;
+                    uid.SetInt(itr->value["u"].GetInt());
+                    nodeVersion.AddMember("u",uid,a);
+
+                    rapidjson::Value version;
+                    version.SetInt(itr->value["i"].GetInt());
+                    nodeVersion.AddMember("i",version,a);
+
+                    rapidjson::Value timestamp;
+                    timestamp.SetInt64(itr->value["t"].GetInt64());
+                    nodeVersion.AddMember("t",timestamp,a);
+
+                    rapidjson::Value changeset;
+                    changeset.SetInt64(itr->value["c"].GetInt64());
+                    nodeVersion.AddMember("c",changeset,a);
+
+                    if(itr->value["p"].IsArray()){
+                        rapidjson::Value coordinates(rapidjson::kArrayType);
+                        coordinates.PushBack(itr->value["p"][0].GetDouble(), a);
+                        coordinates.PushBack(itr->value["p"][1].GetDouble(), a);
+                        nodeVersion.AddMember("p",coordinates,a);
+                    }
+
+                    thisNodeHistoryNew.AddMember(changesetID,nodeVersion,a);
+                }
+
+                nodeLocations.AddMember(nodeIDStr,thisNodeHistoryNew,a);
+                arena.clear_scratch();
+
+            }else{
+                stats->node_lookup_failures++;
+            }
+        }
+    }
+
+    inline void add_node_locations(ObjectStore* store, rapidjson::Document& geojson_doc, EnrichStats* stats) {
+        //Start a list of unique node IDs ever associated with any version of this object
+        std::vector<int64_t> nodeRefs;
+        collect_node_refs(geojson_doc, &nodeRefs);
+        std::sort(nodeRefs.begin(), nodeRefs.end());
+        nodeRefs.erase(std::unique(nodeRefs.begin(), nodeRefs.end()), nodeRefs.end());
+
+        rapidjson::Value nodeLocations(rapidjson::kObjectType);
+        add_node_histories(store, nodeRefs, nodeLocations, geojson_doc.GetAllocator(), stats);
+
+        if (!nodeLocations.Empty()){
+            geojson_doc.AddMember("nodeLocations",nodeLocations,geojson_doc.GetAllocator());
+        }else{
+          //Node locations is empty
+        }
+    }
+
+    //[lon, lat], or null for a node without a location
+    inline void set_location(const osmium::Location& location, rapidjson::Value* coordinates, rapidjson::Document::AllocatorType& a) {
+        if (!location.valid()) {
+            coordinates->SetNull();
+            return;
+        }
+        coordinates->SetArray();
+        coordinates->PushBack(location.lon(), a);
+        coordinates->PushBack(location.lat(), a);
+    }
+
+    /*  Computes the geometry of every major version of a way and the minor versions
+     *  between them, see minor_versions.hpp.
+     *
+     *  Each @history entry with node refs gets "g": [[lon, lat], ...] (aligned with "n",
+     *  null where a node has no location), and the feature gets:
+     *
+     *  minorVersions: [
+     *    { i: <major version>, m: <minor version>, t: <timestamp>, c: <changeset>,
+     *      u: <uid>, h: <handle>, n: [[nodeID, lon, lat], ...] (only the nodes that moved) },
+     *    ...
+     *  ]
+     */
+    inline void add_minor_versions(ObjectStore* store, rapidjson::Document& geojson_doc, EnrichStats* stats) {
+        rapidjson::Document::AllocatorType& a = geojson_doc.GetAllocator();
+        rapidjson::Value& history = geojson_doc["properties"]["@history"];
+
+        //Fetch the history of each distinct node once
+        osmwayback::NodeHistories histories;
+        for (auto& histObj : history.GetArray()) {
+            if (histObj.HasMember("n")) {
+                for (auto& nodeRef : histObj["n"].GetArray()) {
+                    const int64_t ref = nodeRef.GetInt64();
+                    if (histories.count(ref)) {
+                        continue;
+                    }
+                    if (!store->get_node_location_history(ref, &histories[ref])) {
+                        histories.erase(ref);
+                        stats->node_lookup_failures++;
+                    }
+                }
+            }
+        }
+
+        std::vector<osmwayback::MinorVersion> minor_versions;
+
+        for (rapidjson::SizeType i = 0; i < history.Size(); i++) {
+            rapidjson::Value& histObj = history[i];
+            if (!histObj.HasMember("n")) {
+                continue;
+            }
+
+            std::vector<int64_t> refs;
+            for (auto& nodeRef : histObj["n"].GetArray()) {
+                refs.push_back(nodeRef.GetInt64());
+            }
+
+            osmwayback::MajorVersionWindow window;
+            window.version     = histObj["i"].GetUint();
+            window.valid_since = histObj["t"].GetUint64();
+            window.changeset   = histObj["c"].GetUint();
+            if (i + 1 < history.Size()) {
+                window.has_next       = true;
+                window.valid_until    = history[i + 1]["t"].GetUint64();
+                window.next_changeset = history[i + 1]["c"].GetUint();
+            }
+
+            rapidjson::Value geometry(rapidjson::kArrayType);
+            for (const auto& location : osmwayback::major_version_geometry(refs, histories, window)) {
+                rapidjson::Value coordinates;
+                set_location(location, &coordinates, a);
+                geometry.PushBack(coordinates, a);
+            }
+            histObj.AddMember("g", geometry, a);
+
+            osmwayback::compute_minor_versions(refs, histories, window, &minor_versions);
+        }
+
+        rapidjson::Value minorVersions(rapidjson::kArrayType);
+        for (const auto& mv : minor_versions) {
+            rapidjson::Value minorVersion(rapidjson::kObjectType);
+            minorVersion.AddMember("i", mv.major_version, a);
+            minorVersion.AddMember("m", mv.minor_version, a);
+            minorVersion.AddMember("t", mv.timestamp, a);
+            minorVersion.AddMember("c", mv.changeset, a);
+            minorVersion.AddMember("u", mv.uid, a);
+            rapidjson::Value handle;
+            handle.SetString(mv.user, a);
+            minorVersion.AddMember("h", handle, a);
+
+            rapidjson::Value moves(rapidjson::kArrayType);
+            for (const auto& move : mv.nodes) {
+                rapidjson::Value m(rapidjson::kArrayType);
+                m.PushBack(move.first, a);
+                m.PushBack(move.second.lon(), a);
+                m.PushBack(move.second.lat(), a);
+                moves.PushBack(m, a);
+            }
+            minorVersion.AddMember("n", moves, a);
+            minorVersions.PushBack(minorVersion, a);
+        }
+        stats->minor_version_count += minor_versions.size();
+
+        geojson_doc.AddMember("minorVersions", minorVersions, a);
+    }
+}
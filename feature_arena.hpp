@@ -0,0 +1,99 @@
+#pragma once
+
+/*
+    Feature Arenas
+    ==============
+
+    add_history and add_geometry process one feature after another, and each
+    feature used to allocate and free its own documents, buffers and writers.
+    A FeatureArena keeps that working set from one feature to the next:
+
+    - document(): the feature's Document. Its values come from a pool whose
+      first chunk (FEATURE_ARENA_BYTES) is allocated once, so a typical
+      feature never reaches malloc. reset() frees the pool in one step.
+    - scratch(): a second pool, for documents that are only needed during one
+      lookup (e.g. the stored locations of a node). Free it with
+      clear_scratch().
+    - write(): serializes into an output buffer with a Writer that both keep
+      their capacity.
+
+    Use one arena per thread (thread_arena()). Nothing allocated from an arena
+    may be used after its next reset().
+*/
+
+#include <cstddef>
+#include <memory>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+namespace osmwayback {
+
+    const size_t FEATURE_ARENA_BYTES = 1024 * 1024;
+    const size_t SCRATCH_ARENA_BYTES = 256 * 1024;
+
+    class FeatureArena {
+        using Allocator = rapidjson::Document::AllocatorType;
+
+        //The buffers are declared first, the pools are constructed on them
+        std::unique_ptr<char[]> m_values_buffer;
+        std::unique_ptr<char[]> m_scratch_buffer;
+        Allocator m_values;
+        Allocator m_scratch;
+
+        rapidjson::Document m_document;
+        rapidjson::StringBuffer m_output{};
+        rapidjson::Writer<rapidjson::StringBuffer> m_writer;
+
+    public:
+        FeatureArena() :
+            m_values_buffer(new char[FEATURE_ARENA_BYTES]),
+            m_scratch_buffer(new char[SCRATCH_ARENA_BYTES]),
+            m_values(m_values_buffer.get(), FEATURE_ARENA_BYTES),
+            m_scratch(m_scratch_buffer.get(), SCRATCH_ARENA_BYTES),
+            m_document(&m_values),
+            m_writer(m_output) {
+        }
+
+        FeatureArena(const FeatureArena&) = delete;
+        FeatureArena& operator=(const FeatureArena&) = delete;
+
+        rapidjson::Document& document() {
+            return m_document;
+        }
+
+        Allocator& scratch() {
+            return m_scratch;
+        }
+
+        void clear_scratch() {
+            m_scratch.Clear();
+        }
+
+        // Serializes `value`; the buffer is valid until the next call
+        const rapidjson::StringBuffer& write(const rapidjson::Value& value) {
+            m_output.Clear();
+            m_writer.Reset(m_output);
+            value.Accept(m_writer);
+            return m_output;
+        }
+
+        // Frees everything allocated for the last feature
+        void reset() {
+            m_document.SetNull();
+            m_values.Clear();
+            m_scratch.Clear();
+        }
+    };
+
+    inline FeatureArena& thread_arena() {
+        static thread_local FeatureArena arena;
+        return arena;
+    }
+
+}
@@ -0,0 +1,112 @@
+/*
+
+  USAGE: finalize_index <INDEX DIR> [THREADS]
+
+  Turns an index built by build_lookup_index into its read-optimized layout.
+  Run it once, after the build and before the query tools.
+
+  Every column family is rewritten with the options of the read profile
+  (see "Read Profile" in db.hpp) and the compression recorded at build time
+  (see "Compression" in db.hpp), and fully compacted into a single level, so
+  a point lookup reads at most one table file per column family. The bloom
+  filters of the finished tables are also what lets lookups of missing keys
+  (e.g. gaps in version numbers) skip the table without reading it.
+
+  The time of finalization is recorded under the key `wayback:finalized` in
+  the default column family.
+
+*/
+
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [THREADS]" << std::endl;
+        std::exit(1);
+    }
+
+    const std::string index_dir = argv[1];
+    const int threads = (argc > 2) ? std::atoi(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+
+    rocksdb::Options db_options;
+    db_options.create_if_missing = false;
+    db_options.IncreaseParallelism(threads > 0 ? threads : 1);
+    db_options.max_subcompactions = static_cast<uint32_t>(threads > 0 ? threads : 1);
+    db_options.target_file_size_base = 512 * 1024 * 1024;
+
+    std::vector<std::string> family_names;
+    rocksdb::Status s = rocksdb::DB::ListColumnFamilies(db_options, index_dir, &family_names);
+    if (!s.ok()) {
+        std::cerr << "Could not open index " << index_dir << ": " << s.ToString() << std::endl;
+        std::exit(2);
+    }
+
+    //Compaction writes the new tables with these options
+    const auto block_cache = rocksdb::NewLRUCache(DEFAULT_BLOCK_CACHE_MB * 1024 * 1024);
+    const CompressionProfile compression = read_compression_profile(index_dir);
+    std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+    for (const auto& name : family_names) {
+        const auto family_compression = compression.find(name);
+        column_families.push_back(rocksdb::ColumnFamilyDescriptor(name, read_family_options(name, block_cache,
+            family_compression == compression.end() ? nullptr : &family_compression->second)));
+    }
+
+    rocksdb::DB* db;
+    std::vector<rocksdb::ColumnFamilyHandle*> handles;
+    s = rocksdb::DB::Open(db_options, index_dir, column_families, &handles, &db);
+    if (!s.ok()) {
+        std::cerr << "Could not open index " << index_dir << ": " << s.ToString() << std::endl;
+        std::exit(2);
+    }
+
+    rocksdb::CompactRangeOptions compact_options;
+    compact_options.exclusive_manual_compaction = true;
+    compact_options.change_level = true;
+    compact_options.target_level = 1;
+    compact_options.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForce;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < family_names.size(); i++) {
+        if (family_names[i] == rocksdb::kDefaultColumnFamilyName) {
+            continue;
+        }
+        const auto family_start = std::chrono::steady_clock::now();
+        std::cerr << "Finalizing " << family_names[i] << "...";
+
+        s = db->CompactRange(compact_options, handles[i], nullptr, nullptr);
+        if (!s.ok()) {
+            std::cerr << "failed: " << s.ToString() << std::endl;
+            std::exit(3);
+        }
+
+        uint64_t size{0};
+        db->GetIntProperty(handles[i], "rocksdb.total-sst-files-size", &size);
+        const auto diff = std::chrono::steady_clock::now() - family_start;
+        std::cerr << "done in " << std::chrono::duration <double, std::milli> (diff).count() << " ms, "
+                  << (size / (1024 * 1024)) << " MB" << std::endl;
+    }
+
+    s = db->Put(rocksdb::WriteOptions(), FINALIZED_KEY, std::to_string(std::time(nullptr)));
+    assert(s.ok());
+    db->Flush(rocksdb::FlushOptions{});
+
+    for (auto handle : handles) {
+        db->DestroyColumnFamilyHandle(handle);
+    }
+    delete db;
+
+    const auto diff = std::chrono::steady_clock::now() - start;
+    std::cerr << "Finalized " << index_dir << " in " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+}
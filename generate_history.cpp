@@ -0,0 +1,435 @@
+/*
+
+  USAGE: generate_history <OUTPUT.osh.pbf> [OPTIONS]
+
+  Writes a synthetic OSM history file for scaling tests. The same options and
+  seed always produce the same file (the random numbers come straight from
+  std::mt19937_64, whose output is fixed by the standard).
+
+  OPTIONS (defaults in brackets):
+
+    --seed N             random seed [1]
+    --scale N            multiplies the object counts [1]
+    --nodes N            number of nodes [100000]
+    --ways N             number of ways [10000]
+    --relations N        number of multipolygon relations [200]
+    --versions X         mean number of versions per object [3]
+    --max-versions N     cap on versions per object [1000]
+    --hot-fraction X     fraction of objects with long histories [0.001]
+    --hot-versions X     mean number of versions of those objects [200]
+    --tag-churn X        probability that a new version changes the tags [0.5]
+    --node-movement X    probability that a new node version moves the node [0.5]
+    --way-churn X        probability that a new way version adds or removes a node [0.3]
+    --node-sharing X     probability that a way node is shared with a nearby way [0.2]
+    --way-nodes N        mean number of nodes per way [8]
+    --deleted X          probability that an object's last version deletes it [0.02]
+    --users N            number of distinct users [5000]
+
+  Nodes are laid out as a random walk over a 1x1 degree box, so ways (which take
+  their nodes mostly in id order) stay local. Changeset IDs are derived from the
+  timestamp (one per 10 minutes), so objects edited at about the same time share
+  changesets as they do in real data.
+
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/io/any_output.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/timestamp.hpp>
+
+const uint64_t HISTORY_START = 1199145600; // 2008-01-01
+const uint64_t HISTORY_SPAN = 10 * 365 * 24 * 3600;
+const uint64_t CHANGESET_SECONDS = 600;
+
+const size_t BUFFER_SIZE = 16 * 1024 * 1024;
+
+struct GeneratorOptions {
+    uint64_t seed{1};
+    double scale{1};
+    int64_t nodes{100000};
+    int64_t ways{10000};
+    int64_t relations{200};
+    double versions{3};
+    uint32_t max_versions{1000};
+    double hot_fraction{0.001};
+    double hot_versions{200};
+    double tag_churn{0.5};
+    double node_movement{0.5};
+    double way_churn{0.3};
+    double node_sharing{0.2};
+    int way_nodes{8};
+    double deleted{0.02};
+    uint32_t users{5000};
+};
+
+class Random {
+    std::mt19937_64 m_engine;
+
+public:
+    explicit Random(const uint64_t seed) :
+        m_engine(seed) {
+    }
+
+    uint64_t uniform(const uint64_t n) {
+        return n ? m_engine() % n : 0;
+    }
+
+    // In [0, 1)
+    double real() {
+        return static_cast<double>(m_engine() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    bool chance(const double p) {
+        return real() < p;
+    }
+
+    double between(const double min, const double max) {
+        return min + (max - min) * real();
+    }
+
+    // Geometric with the given mean, at least 1
+    uint32_t count(const double mean, const uint32_t max) {
+        const double p = mean <= 1 ? 1.0 : 1.0 / mean;
+        uint32_t n = 1;
+        while (n < max && !chance(p)) {
+            n++;
+        }
+        return n;
+    }
+};
+
+typedef std::vector<std::pair<std::string, std::string>> Tags;
+
+const std::vector<std::string> HIGHWAY_VALUES{"residential", "service", "track", "footway", "primary", "secondary", "tertiary"};
+const std::vector<std::string> BUILDING_VALUES{"yes", "house", "residential", "garage", "commercial"};
+const std::vector<std::string> SURFACE_VALUES{"asphalt", "paved", "gravel", "unpaved", "concrete"};
+const std::vector<std::string> AMENITY_VALUES{"bench", "cafe", "parking", "school", "restaurant", "waste_basket"};
+const std::vector<std::string> EXTRA_KEYS{"name", "source", "note", "fixme", "ref", "operator"};
+
+class HistoryGenerator {
+    GeneratorOptions m_options;
+    Random m_random;
+    osmium::io::Writer& m_writer;
+    osmium::memory::Buffer m_buffer{BUFFER_SIZE, osmium::memory::Buffer::auto_grow::yes};
+
+    osmium::Box m_box{-74.5, 42.0, -73.5, 43.0};
+    osmium::Location m_walk{-74.0, 42.5};
+
+    int64_t m_node_cursor{1};
+
+    const std::string& pick(const std::vector<std::string>& values) {
+        return values[m_random.uniform(values.size())];
+    }
+
+    uint32_t version_count() {
+        if (m_random.chance(m_options.hot_fraction)) {
+            return m_random.count(m_options.hot_versions, m_options.max_versions);
+        }
+        return m_random.count(m_options.versions, m_options.max_versions);
+    }
+
+    // Increasing timestamps for every version of one object, inside the history span
+    std::vector<uint64_t> timestamps(const uint32_t versions) {
+        std::vector<uint64_t> result;
+        uint64_t t = HISTORY_START + m_random.uniform(HISTORY_SPAN / 2);
+        const uint64_t step = (HISTORY_START + HISTORY_SPAN - t) / versions;
+        for (uint32_t v = 0; v < versions; v++) {
+            result.push_back(t);
+            t += 1 + m_random.uniform(step);
+        }
+        return result;
+    }
+
+    void churn_tags(Tags* tags) {
+        const uint64_t action = m_random.uniform(3);
+        if (action == 0 || tags->empty()) {
+            const std::string& key = pick(EXTRA_KEYS);
+            for (const auto& tag : *tags) {
+                if (tag.first == key) {
+                    return;
+                }
+            }
+            tags->emplace_back(key, key + "_" + std::to_string(m_random.uniform(1000)));
+        } else if (action == 1) {
+            auto& tag = (*tags)[m_random.uniform(tags->size())];
+            tag.second += "_" + std::to_string(m_random.uniform(1000));
+        } else if (tags->size() > 1) {
+            tags->erase(tags->begin() + static_cast<std::ptrdiff_t>(m_random.uniform(tags->size())));
+        }
+    }
+
+    template <typename TBuilder>
+    void set_meta(TBuilder& builder, const int64_t id, const uint32_t version, const uint64_t timestamp, const bool visible) {
+        const uint32_t uid = 1 + static_cast<uint32_t>(m_random.uniform(m_options.users));
+        builder.object().set_id(id);
+        builder.object().set_version(version);
+        builder.object().set_changeset(static_cast<uint32_t>(1 + (timestamp - HISTORY_START) / CHANGESET_SECONDS));
+        builder.object().set_timestamp(osmium::Timestamp{static_cast<uint32_t>(timestamp)});
+        builder.object().set_uid(uid);
+        builder.object().set_visible(visible);
+        builder.add_user("user_" + std::to_string(uid));
+    }
+
+    template <typename TBuilder>
+    void add_tags(TBuilder& builder, const Tags& tags) {
+        osmium::builder::TagListBuilder tl_builder{m_buffer, &builder};
+        for (const auto& tag : tags) {
+            tl_builder.add_tag(tag.first, tag.second);
+        }
+    }
+
+    void commit() {
+        m_buffer.commit();
+        if (m_buffer.committed() > BUFFER_SIZE - 1024 * 1024) {
+            m_writer(std::move(m_buffer));
+            m_buffer = osmium::memory::Buffer{BUFFER_SIZE, osmium::memory::Buffer::auto_grow::yes};
+        }
+    }
+
+    // Next step of the random walk, reflected back into the box
+    osmium::Location walk(const double step) {
+        double lon = m_walk.lon() + m_random.between(-step, step);
+        double lat = m_walk.lat() + m_random.between(-step, step);
+        if (lon < m_box.bottom_left().lon() || lon > m_box.top_right().lon()) lon = m_walk.lon() - (lon - m_walk.lon());
+        if (lat < m_box.bottom_left().lat() || lat > m_box.top_right().lat()) lat = m_walk.lat() - (lat - m_walk.lat());
+        m_walk = osmium::Location{lon, lat};
+        return m_walk;
+    }
+
+    void node(const int64_t id) {
+        const uint32_t versions = version_count();
+        const auto times = timestamps(versions);
+        const bool deleted = versions > 1 && m_random.chance(m_options.deleted);
+
+        osmium::Location location = walk(0.0005);
+        Tags tags;
+        if (m_random.chance(0.1)) {
+            tags.emplace_back("amenity", pick(AMENITY_VALUES));
+        }
+
+        for (uint32_t v = 1; v <= versions; v++) {
+            if (v > 1) {
+                if (m_random.chance(m_options.node_movement)) {
+                    location = osmium::Location{location.lon() + m_random.between(-0.0001, 0.0001),
+                                                location.lat() + m_random.between(-0.0001, 0.0001)};
+                }
+                if (!tags.empty() && m_random.chance(m_options.tag_churn)) {
+                    churn_tags(&tags);
+                }
+            }
+            const bool visible = !(deleted && v == versions);
+            {
+                osmium::builder::NodeBuilder builder{m_buffer};
+                set_meta(builder, id, v, times[v - 1], visible);
+                if (visible) {
+                    builder.object().set_location(location);
+                    add_tags(builder, tags);
+                }
+            }
+            commit();
+        }
+    }
+
+    int64_t next_node_ref(const int64_t previous) {
+        if (previous > 0 && m_random.chance(m_options.node_sharing)) {
+            //Reuse a node from just before, usually part of a neighbouring way
+            const int64_t back = 1 + static_cast<int64_t>(m_random.uniform(200));
+            if (previous - back >= 1) {
+                return previous - back;
+            }
+        }
+        const int64_t ref = m_node_cursor;
+        m_node_cursor = (m_node_cursor % m_options.nodes) + 1;
+        return ref;
+    }
+
+    void way(const int64_t id) {
+        const uint32_t versions = version_count();
+        const auto times = timestamps(versions);
+        const bool deleted = versions > 1 && m_random.chance(m_options.deleted);
+
+        std::vector<int64_t> refs;
+        const uint64_t node_count = 2 + m_random.uniform(static_cast<uint64_t>(2 * m_options.way_nodes - 2));
+        for (uint64_t i = 0; i < node_count; i++) {
+            refs.push_back(next_node_ref(refs.empty() ? 0 : refs.back()));
+        }
+
+        Tags tags;
+        if (m_random.chance(0.5)) {
+            tags.emplace_back("building", pick(BUILDING_VALUES));
+            refs.push_back(refs.front());
+        } else {
+            tags.emplace_back("highway", pick(HIGHWAY_VALUES));
+            tags.emplace_back("surface", pick(SURFACE_VALUES));
+        }
+
+        for (uint32_t v = 1; v <= versions; v++) {
+            if (v > 1) {
+                if (m_random.chance(m_options.tag_churn)) {
+                    churn_tags(&tags);
+                }
+                if (m_random.chance(m_options.way_churn) && refs.size() > 3) {
+                    //Add or remove an interior node, keeping closed ways closed
+                    const auto position = refs.begin() + 1 + static_cast<std::ptrdiff_t>(m_random.uniform(refs.size() - 2));
+                    if (m_random.chance(0.5)) {
+                        refs.erase(position);
+                    } else {
+                        refs.insert(position, 1 + static_cast<int64_t>(m_random.uniform(static_cast<uint64_t>(m_options.nodes))));
+                    }
+                }
+            }
+            const bool visible = !(deleted && v == versions);
+            {
+                osmium::builder::WayBuilder builder{m_buffer};
+                set_meta(builder, id, v, times[v - 1], visible);
+                if (visible) {
+                    {
+                        osmium::builder::WayNodeListBuilder wnl_builder{m_buffer, &builder};
+                        for (const int64_t ref : refs) {
+                            wnl_builder.add_node_ref(osmium::NodeRef{ref});
+                        }
+                    }
+                    add_tags(builder, tags);
+                }
+            }
+            commit();
+        }
+    }
+
+    void relation(const int64_t id) {
+        const uint32_t versions = version_count();
+        const auto times = timestamps(versions);
+        const bool deleted = versions > 1 && m_random.chance(m_options.deleted);
+
+        std::vector<std::pair<int64_t, std::string>> members;
+        const uint64_t member_count = 1 + m_random.uniform(3);
+        for (uint64_t i = 0; i < member_count; i++) {
+            members.emplace_back(1 + static_cast<int64_t>(m_random.uniform(static_cast<uint64_t>(m_options.ways))), i == 0 ? "outer" : "inner");
+        }
+
+        Tags tags{{"type", "multipolygon"}, {"landuse", "grass"}};
+
+        for (uint32_t v = 1; v <= versions; v++) {
+            if (v > 1) {
+                if (m_random.chance(m_options.tag_churn)) {
+                    churn_tags(&tags);
+                }
+                if (m_random.chance(m_options.way_churn)) {
+                    members.back().first = 1 + static_cast<int64_t>(m_random.uniform(static_cast<uint64_t>(m_options.ways)));
+                }
+            }
+            const bool visible = !(deleted && v == versions);
+            {
+                osmium::builder::RelationBuilder builder{m_buffer};
+                set_meta(builder, id, v, times[v - 1], visible);
+                if (visible) {
+                    {
+                        osmium::builder::RelationMemberListBuilder ml_builder{m_buffer, &builder};
+                        for (const auto& member : members) {
+                            ml_builder.add_member(osmium::item_type::way, member.first, member.second.c_str());
+                        }
+                    }
+                    add_tags(builder, tags);
+                }
+            }
+            commit();
+        }
+    }
+
+public:
+    HistoryGenerator(const GeneratorOptions& options, osmium::io::Writer& writer) :
+        m_options(options),
+        m_random(options.seed),
+        m_writer(writer) {
+    }
+
+    //History files are sorted by type, then id, then version
+    void generate() {
+        for (int64_t id = 1; id <= m_options.nodes; id++) {
+            node(id);
+            if (id % 1000000 == 0) {
+                std::cerr << "\rGenerated " << id / 1000000 << "M nodes";
+            }
+        }
+        for (int64_t id = 1; id <= m_options.ways; id++) {
+            way(id);
+        }
+        for (int64_t id = 1; id <= m_options.relations; id++) {
+            relation(id);
+        }
+        if (m_buffer.committed() > 0) {
+            m_writer(std::move(m_buffer));
+        }
+        std::cerr << "\rGenerated " << m_options.nodes << " nodes, " << m_options.ways << " ways, "
+                  << m_options.relations << " relations" << std::endl;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        std::cerr << "Usage: " << argv[0] << " OUTPUT.osh.pbf [--OPTION VALUE ...]" << std::endl;
+        std::exit(1);
+    }
+
+    const std::string output = argv[1];
+    GeneratorOptions options;
+
+    for (int i = 2; i < argc; i += 2) {
+        const std::string option = argv[i];
+        const char* value = argv[i + 1];
+        if      (option == "--seed")          options.seed          = std::strtoull(value, nullptr, 10);
+        else if (option == "--scale")         options.scale         = std::atof(value);
+        else if (option == "--nodes")         options.nodes         = std::atoll(value);
+        else if (option == "--ways")          options.ways          = std::atoll(value);
+        else if (option == "--relations")     options.relations     = std::atoll(value);
+        else if (option == "--versions")      options.versions      = std::atof(value);
+        else if (option == "--max-versions")  options.max_versions  = static_cast<uint32_t>(std::atoi(value));
+        else if (option == "--hot-fraction")  options.hot_fraction  = std::atof(value);
+        else if (option == "--hot-versions")  options.hot_versions  = std::atof(value);
+        else if (option == "--tag-churn")     options.tag_churn     = std::atof(value);
+        else if (option == "--node-movement") options.node_movement = std::atof(value);
+        else if (option == "--way-churn")     options.way_churn     = std::atof(value);
+        else if (option == "--node-sharing")  options.node_sharing  = std::atof(value);
+        else if (option == "--way-nodes")     options.way_nodes     = std::atoi(value);
+        else if (option == "--deleted")       options.deleted       = std::atof(value);
+        else if (option == "--users")         options.users         = static_cast<uint32_t>(std::atoi(value));
+        else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            std::exit(1);
+        }
+    }
+
+    options.nodes     = static_cast<int64_t>(options.nodes * options.scale);
+    options.ways      = static_cast<int64_t>(options.ways * options.scale);
+    options.relations = static_cast<int64_t>(options.relations * options.scale);
+
+    if (options.nodes < 1 || options.ways < 0 || options.relations < 0 || options.way_nodes < 2 ||
+        options.max_versions < 1 || options.users < 1) {
+        std::cerr << "Invalid options" << std::endl;
+        std::exit(1);
+    }
+    if (options.ways == 0) {
+        options.relations = 0;
+    }
+
+    osmium::io::Header header;
+    header.set_has_multiple_object_versions(true);
+    header.set("generator", "osm-wayback generate_history");
+    header.add_box(osmium::Box{-74.5, 42.0, -73.5, 43.0});
+
+    osmium::io::Writer writer{output, header, osmium::io::overwrite::allow};
+    HistoryGenerator generator{options, writer};
+    generator.generate();
+    writer.close();
+}
@@ -11,6 +11,7 @@ module.exports = function(osmObject){
 
 //Attributes of given OSM element and all possible versions
 this.nodeLocations = osmObject.nodeLocations;
+this.minorVersions = osmObject.minorVersions; //Precomputed by `add_geometry --minor-versions`
 this.versions      = osmObject.history;
 this.osmID         = osmObject.osmID;
 
@@ -337,6 +338,75 @@ this.buildAllPossibleVersionGeometries = function(args){
 }
 
 
+/**
+ *  Construct geometries from the major version geometries (`g`) and the
+ *  `minorVersions` list written by `add_geometry --minor-versions`. No node
+ *  histories are needed: each minor version lists only the nodes that moved.
+ *
+ *  Expects: Nothing, call on Object.
+ *
+ *  Returns: Nothing, populates the ``historicalGeometries`` attribute.
+*/
+this.buildGeometriesFromMinorVersions = function(){
+  var that = this;
+
+  for(var i=0; i<that.versions.length; i++){
+    var version = that.versions[i];
+    if (!version.hasOwnProperty('g') || !version.hasOwnProperty('n')){
+      continue;
+    }
+
+    var majorVersionNumber = version.i;
+    var nextMajorSince     = (i<that.versions.length-1)? that.versions[i+1].t : null;
+    var positions          = version.g.slice(0);
+
+    var minorVersions = that.minorVersions.filter(function(mV){return mV.i==majorVersionNumber});
+
+    that.historicalGeometries[majorVersionNumber] = [{
+      type:"Feature",
+      properties:{
+        '@version': majorVersionNumber,
+        '@minorVersion': 0,
+        '@user' : version.h,
+        '@changeset' : version.c,
+        '@uid' : version.u,
+        '@validSince': version.t,
+        '@validUntil': (minorVersions.length>0)? minorVersions[0].t : nextMajorSince
+      },
+      geometry: {
+        type:"LineString",
+        coordinates : positions.filter(function(p){return p!==null})
+      }
+    }]
+
+    minorVersions.forEach(function(mV, j){
+      var moved = {};
+      mV.n.forEach(function(move){ moved[move[0]] = [move[1], move[2]] });
+
+      positions = version.n.map(function(ref, idx){
+        return moved.hasOwnProperty(ref)? moved[ref] : positions[idx];
+      })
+
+      that.historicalGeometries[majorVersionNumber].push({
+        type:"Feature",
+        geometry:{
+          type:"LineString",
+          coordinates: positions.filter(function(p){return p!==null})
+        },
+        properties:{
+          '@version':majorVersionNumber,
+          '@minorVersion':mV.m,
+          '@changeset':mV.c,
+          '@user':mV.h,
+          '@uid' :mV.u,
+          '@validSince':mV.t,
+          '@validUntil': (j<minorVersions.length-1)? minorVersions[j+1].t : nextMajorSince
+        }
+      })
+    })
+  }
+}
+
 /**
  *  Iterate through an OSM object's history and construct all possible geometries
  *
@@ -348,6 +418,10 @@ this.buildGeometries = function(){
   var that = this;
   var validSince, validUntil;
 
+  if(that.minorVersions){
+    return that.buildGeometriesFromMinorVersions();
+  }
+
   if(DEBUG){
     console.warn(`\n\nReconstructing Geometries for ID: ${that.osmID}\n==================`)
   }
@@ -0,0 +1,362 @@
+#pragma once
+
+/*
+    History Merge
+    =============
+
+    build_lookup_index stores objects in type, id and version order (tag
+    diffs, way deltas, version collapsing, parent ranges and the node location
+    store all rely on it). A HistoryMerge delivers that order from any number
+    of inputs:
+
+    - Sorted inputs (a history file with the Sort.Type_then_ID feature, or any
+      input with --sorted) are streamed as they are read. Each one is checked
+      as it goes, an input that turns out unsorted stops the build.
+    - Everything else goes through an ExternalSorter: objects are collected in
+      their osmium buffers up to a memory limit, sorted, and spilled to an
+      uncompressed PBF run in a temporary directory. The last batch stays in
+      memory. Every run is read by its own osmium reader, with its threads and
+      buffers, so beyond MAX_MERGE_RUNS runs they are first merged into larger
+      runs, MAX_MERGE_RUNS at a time.
+
+    All inputs and runs are then merged with a heap of their current objects.
+    Overlapping extracts contain the same versions more than once, the merge
+    passes on only the first object of each (type, id, version).
+*/
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <osmium/io/any_input.hpp>
+#include <osmium/io/any_output.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/object.hpp>
+
+namespace osmwayback {
+
+    const size_t DEFAULT_SORT_MEMORY_MB = 1024;
+
+    const size_t MAX_MERGE_RUNS = 16; //Spilled runs read at the same time
+
+    const osmium::osm_entity_bits::type HISTORY_ENTITIES = osmium::osm_entity_bits::node | osmium::osm_entity_bits::way | osmium::osm_entity_bits::relation;
+
+    //The order of osmium::object_order_type_id_version without the timestamp: negative ids first
+    struct VersionKey {
+        osmium::item_type type{osmium::item_type::undefined};
+        bool positive{false};
+        osmium::unsigned_object_id_type id{0};
+        uint32_t version{0};
+
+        explicit VersionKey(const osmium::OSMObject& object) :
+            type(object.type()),
+            positive(object.id() > 0),
+            id(object.positive_id()),
+            version(object.version()) {
+        }
+
+        VersionKey() = default;
+
+        bool operator<(const VersionKey& other) const {
+            return std::tie(type, positive, id, version) < std::tie(other.type, other.positive, other.id, other.version);
+        }
+
+        bool operator==(const VersionKey& other) const {
+            return type == other.type && positive == other.positive && id == other.id && version == other.version;
+        }
+    };
+
+    // True if the file says it is sorted by type and id, as planet history files do
+    inline bool declares_sorted(const std::string& filename) {
+        osmium::io::Reader reader{filename, osmium::osm_entity_bits::nothing};
+        const bool sorted = reader.header().get("sorting") == "Type_then_ID";
+        reader.close();
+        return sorted;
+    }
+
+    // Objects in type, id and version order, one at a time
+    class HistorySource {
+    public:
+        virtual ~HistorySource() = default;
+
+        // The current object, nullptr once the source is exhausted; valid until next()
+        virtual const osmium::OSMObject* current() const = 0;
+
+        virtual void next() = 0;
+    };
+
+    // A sorted file, read as the merge goes
+    class FileSource : public HistorySource {
+        std::string m_filename;
+        osmium::io::Reader m_reader;
+        osmium::memory::Buffer m_buffer{};
+        osmium::memory::Buffer::t_iterator<osmium::OSMObject> m_it{};
+        osmium::memory::Buffer::t_iterator<osmium::OSMObject> m_end{};
+        const osmium::OSMObject* m_current{nullptr};
+        VersionKey m_previous{};
+
+    public:
+        explicit FileSource(const std::string& filename) :
+            m_filename(filename),
+            m_reader(filename, HISTORY_ENTITIES) {
+            next();
+        }
+
+        const osmium::OSMObject* current() const override {
+            return m_current;
+        }
+
+        void next() override {
+            while (m_it == m_end) {
+                m_buffer = m_reader.read();
+                if (!m_buffer) {
+                    m_current = nullptr;
+                    m_reader.close();
+                    return;
+                }
+                m_it = m_buffer.begin<osmium::OSMObject>();
+                m_end = m_buffer.end<osmium::OSMObject>();
+            }
+            m_current = &*m_it;
+            ++m_it;
+
+            const VersionKey key{*m_current};
+            if (key < m_previous) {
+                throw std::runtime_error{m_filename + " is not sorted by type, id and version"};
+            }
+            m_previous = key;
+        }
+    };
+
+    // The last batch of an ExternalSorter, sorted in memory
+    class MemorySource : public HistorySource {
+        std::vector<osmium::memory::Buffer> m_buffers;
+        std::vector<const osmium::OSMObject*> m_objects;
+        size_t m_next{0};
+
+    public:
+        MemorySource(std::vector<osmium::memory::Buffer>&& buffers, std::vector<const osmium::OSMObject*>&& objects) :
+            m_buffers(std::move(buffers)),
+            m_objects(std::move(objects)) {
+        }
+
+        const osmium::OSMObject* current() const override {
+            return m_next < m_objects.size() ? m_objects[m_next] : nullptr;
+        }
+
+        void next() override {
+            m_next++;
+        }
+    };
+
+    class HistoryMerge {
+        std::vector<std::unique_ptr<HistorySource>> m_sources;
+        std::vector<size_t> m_heap{}; //Sources with a current object, the smallest on top
+        size_t m_pending; //The source of the object returned last, advanced by the next call
+        VersionKey m_last{};
+        bool m_has_last{false};
+
+        bool greater(const size_t lhs, const size_t rhs) const {
+            return VersionKey{*m_sources[rhs]->current()} < VersionKey{*m_sources[lhs]->current()};
+        }
+
+        void push(const size_t source) {
+            if (m_sources[source]->current()) {
+                m_heap.push_back(source);
+                std::push_heap(m_heap.begin(), m_heap.end(), [this](const size_t lhs, const size_t rhs) { return greater(lhs, rhs); });
+            }
+        }
+
+    public:
+        unsigned long duplicate_count{0};
+
+        explicit HistoryMerge(std::vector<std::unique_ptr<HistorySource>>&& sources) :
+            m_sources(std::move(sources)),
+            m_pending(m_sources.size()) {
+            for (size_t i = 0; i < m_sources.size(); i++) {
+                push(i);
+            }
+        }
+
+        // The next object in type, id and version order, nullptr at the end; valid until the next call
+        const osmium::OSMObject* next() {
+            while (true) {
+                if (m_pending < m_sources.size()) {
+                    m_sources[m_pending]->next();
+                    push(m_pending);
+                    m_pending = m_sources.size();
+                }
+                if (m_heap.empty()) {
+                    return nullptr;
+                }
+                std::pop_heap(m_heap.begin(), m_heap.end(), [this](const size_t lhs, const size_t rhs) { return greater(lhs, rhs); });
+                m_pending = m_heap.back();
+                m_heap.pop_back();
+
+                const osmium::OSMObject* object = m_sources[m_pending]->current();
+                const VersionKey key{*object};
+                if (m_has_last && key == m_last) {
+                    duplicate_count++;
+                    continue;
+                }
+                m_last = key;
+                m_has_last = true;
+                return object;
+            }
+        }
+    };
+
+    /*  Sorts unsorted inputs in runs of at most `memory_mb` of osmium buffers.
+     *  The spill files are removed with the sorter, which must outlive the
+     *  sources it returns. At most MAX_MERGE_RUNS of them are returned.
+     */
+    class ExternalSorter {
+        std::string m_directory;
+        size_t m_memory_limit;
+
+        std::vector<osmium::memory::Buffer> m_buffers{};
+        std::vector<const osmium::OSMObject*> m_objects{};
+        size_t m_bytes{0};
+        std::vector<std::string> m_runs{};
+        size_t m_spilled{0};
+        size_t m_next_run{0}; //Spilled and merged runs, for their file names
+        unsigned long m_duplicate_count{0};
+
+        void sort_objects() {
+            std::sort(m_objects.begin(), m_objects.end(), [](const osmium::OSMObject* lhs, const osmium::OSMObject* rhs) {
+                return VersionKey{*lhs} < VersionKey{*rhs};
+            });
+        }
+
+        std::string new_run() {
+            if (m_next_run == 0) {
+                ::mkdir(m_directory.c_str(), 0755);
+            }
+            return m_directory + "/run-" + std::to_string(m_next_run++) + ".osh.pbf";
+        }
+
+        //Runs are only read back once, not worth compressing
+        static osmium::io::File run_file(const std::string& run) {
+            return osmium::io::File{run, "pbf,pbf_compression=none"};
+        }
+
+        static osmium::io::Header run_header() {
+            osmium::io::Header header;
+            header.set_has_multiple_object_versions(true);
+            return header;
+        }
+
+        void spill() {
+            sort_objects();
+            const std::string run = new_run();
+
+            osmium::io::Writer writer{run_file(run), run_header(), osmium::io::overwrite::allow};
+            for (const osmium::OSMObject* object : m_objects) {
+                writer(*object);
+            }
+            writer.close();
+            m_runs.push_back(run);
+            m_spilled++;
+
+            m_objects.clear();
+            m_buffers.clear();
+            m_bytes = 0;
+        }
+
+        // Merges the oldest runs, MAX_MERGE_RUNS at a time, until no more than MAX_MERGE_RUNS are left
+        void merge_runs() {
+            while (m_runs.size() > MAX_MERGE_RUNS) {
+                const std::vector<std::string> inputs(m_runs.begin(), m_runs.begin() + MAX_MERGE_RUNS);
+                const std::string run = new_run();
+                {
+                    std::vector<std::unique_ptr<HistorySource>> sources;
+                    for (const auto& input : inputs) {
+                        sources.emplace_back(new FileSource(input));
+                    }
+                    HistoryMerge merge{std::move(sources)};
+                    osmium::io::Writer writer{run_file(run), run_header(), osmium::io::overwrite::allow};
+                    while (const osmium::OSMObject* object = merge.next()) {
+                        writer(*object);
+                    }
+                    writer.close();
+                    m_duplicate_count += merge.duplicate_count;
+                }
+                for (const auto& input : inputs) {
+                    std::remove(input.c_str());
+                }
+                m_runs.erase(m_runs.begin(), m_runs.begin() + MAX_MERGE_RUNS);
+                m_runs.push_back(run);
+            }
+        }
+
+    public:
+        ExternalSorter(const std::string& directory, const size_t memory_mb) :
+            m_directory(directory),
+            m_memory_limit(std::max<size_t>(1, memory_mb) * 1024 * 1024) {
+        }
+
+        ExternalSorter(const ExternalSorter&) = delete;
+        ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+        ~ExternalSorter() {
+            for (const auto& run : m_runs) {
+                std::remove(run.c_str());
+            }
+            if (m_next_run > 0) {
+                ::rmdir(m_directory.c_str());
+            }
+        }
+
+        void add(const std::string& filename) {
+            osmium::io::Reader reader{filename, HISTORY_ENTITIES};
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+                    m_objects.push_back(&*it);
+                }
+                m_bytes += buffer.committed();
+                m_buffers.push_back(std::move(buffer)); //Moving a buffer keeps its memory, the pointers stay valid
+                if (m_bytes > m_memory_limit) {
+                    spill();
+                }
+            }
+            reader.close();
+        }
+
+        // Runs spilled from memory, before any intermediate merges
+        size_t run_count() const {
+            return m_spilled;
+        }
+
+        // Versions already dropped as duplicates by intermediate merges
+        unsigned long duplicate_count() const {
+            return m_duplicate_count;
+        }
+
+        // Moves the runs and the in-memory batch into `sources`
+        void finish(std::vector<std::unique_ptr<HistorySource>>* sources) {
+            merge_runs();
+            for (const auto& run : m_runs) {
+                sources->emplace_back(new FileSource(run));
+            }
+            if (!m_objects.empty()) {
+                sort_objects();
+                sources->emplace_back(new MemorySource(std::move(m_buffers), std::move(m_objects)));
+            }
+            m_buffers.clear();
+            m_objects.clear();
+            m_bytes = 0;
+        }
+    };
+
+}
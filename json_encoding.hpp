@@ -9,6 +9,11 @@
 #include "rapidjson/document.h"
 
 #include <osmium/osm/types.hpp>
+#include <osmium/osm/location.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 namespace jsonencoding {
 
@@ -27,7 +32,7 @@ namespace jsonencoding {
         Record Node Locations with basic properties
     */
 
-    bool encode_location_json(const osmium::Node& node, rapidjson::Document& doc){
+    inline bool encode_location_json(const osmium::Node& node, rapidjson::Document& doc){
 
         rapidjson::Document::AllocatorType& a = doc.GetAllocator();
         rapidjson::Value thisNode(rapidjson::kObjectType);
@@ -67,10 +72,96 @@ namespace jsonencoding {
         return true;
     }
 
+    /*
+        Decode a locations entry (as written by encode_location_json) into
+        its versions, sorted by timestamp. Deleted versions keep an undefined
+        location.
+    */
+    struct NodeLocationVersion {
+        uint64_t timestamp{0};
+        uint32_t changeset{0};
+        uint32_t version{0};
+        uint32_t uid{0};
+        std::string user{};
+        osmium::Location location{};
+    };
+
+    inline bool decode_location_history(const std::string& data, std::vector<NodeLocationVersion>* versions) {
+        versions->clear();
+
+        rapidjson::Document doc;
+        if (doc.Parse<rapidjson::kParseFullPrecisionFlag>(data.c_str()).HasParseError() || !doc.IsObject()) {
+            return false;
+        }
+
+        for (auto it = doc.MemberBegin(); it != doc.MemberEnd(); ++it) {
+            NodeLocationVersion v;
+            v.timestamp = it->value["t"].GetUint64();
+            v.changeset = it->value["c"].GetUint();
+            v.version   = it->value["i"].GetUint();
+            v.uid       = it->value["u"].GetUint();
+            v.user      = it->value["h"].GetString();
+            if (it->value.HasMember("p") && it->value["p"].IsArray()) {
+                v.location = osmium::Location{it->value["p"][0].GetDouble(), it->value["p"][1].GetDouble()};
+            }
+            versions->push_back(v);
+        }
+
+        std::sort(versions->begin(), versions->end(), [](const NodeLocationVersion& lhs, const NodeLocationVersion& rhs) {
+            return lhs.timestamp < rhs.timestamp || (lhs.timestamp == rhs.timestamp && lhs.version < rhs.version);
+        });
+        return true;
+    }
+
+    // The reverse of decode_location_history: a locations entry as encode_location_json writes it
+    inline std::string encode_location_history(const std::vector<NodeLocationVersion>& versions) {
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        writer.StartObject();
+        for (const auto& v : versions) {
+            writer.Key(std::to_string(v.changeset));
+            writer.StartObject();
+            if (v.location.valid()) {
+                writer.Key("p");
+                writer.StartArray();
+                writer.Double(v.location.lon());
+                writer.Double(v.location.lat());
+                writer.EndArray();
+            }
+            writer.Key("t");
+            writer.Uint(uint32_t(v.timestamp));
+            writer.Key("c");
+            writer.Uint(v.changeset);
+            writer.Key("i");
+            writer.Uint(v.version);
+            writer.Key("h");
+            writer.String(v.user);
+            writer.Key("u");
+            writer.Uint(v.uid);
+            writer.EndObject();
+        }
+        writer.EndObject();
+        return std::string(buffer.GetString(), buffer.GetSize());
+    }
+
+    /*
+        Pick the version of a node that was valid at `timestamp`: the latest one
+        at or before it, or one from the same changeset as the parent object.
+    */
+    inline const NodeLocationVersion* location_at(const std::vector<NodeLocationVersion>& versions, const uint64_t timestamp, const uint32_t changeset) {
+        const NodeLocationVersion* valid = nullptr;
+        for (const auto& v : versions) {
+            if (v.timestamp <= timestamp || v.changeset == changeset) {
+                valid = &v;
+            }
+        }
+        return valid;
+    }
+
     /*
       Extract only primary properties
     */
-    rapidjson::Document extract_primary_properties(const osmium::OSMObject& object){
+    inline rapidjson::Document extract_primary_properties(const osmium::OSMObject& object){
         rapidjson::Document doc;
         doc.SetObject();
 
@@ -89,7 +180,7 @@ namespace jsonencoding {
     /*
       Extract main OSM properties from the object
     */
-    rapidjson::Document extract_osm_properties(const osmium::OSMObject& object){
+    inline rapidjson::Document extract_osm_properties(const osmium::OSMObject& object){
         rapidjson::Document doc;
         doc.SetObject();
 
@@ -0,0 +1,141 @@
+#pragma once
+
+/*
+    Binary Keys
+    ===========
+
+    The nodes, ways, relations and locations column families are keyed by
+    decimal strings (see make_lookup). Column families that are range-scanned
+    by number use fixed-width big-endian keys instead, so that RocksDB's
+    bytewise ordering is numeric ordering:
+
+    spatial:    <cell:8><node id:8>                        (see spatial.hpp)
+    changesets: <changeset:4><type:1><id:8><version:4>
+    users:      <uid:4><timestamp:8><type:1><id:8><version:4>
+    parents:    <child type:1><child id:8><parent type:1><parent id:8><first version:4><last version:4>
+
+    A parents key records that versions first to last (inclusive) of a way or
+    relation had the child as a node or member. A parent that drops a child
+    and adds it back later has one key per range.
+*/
+
+#include <cstdint>
+#include <string>
+
+namespace osmwayback {
+
+    inline void append_big_endian(std::string& out, const uint64_t value) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out += static_cast<char>((value >> shift) & 0xff);
+        }
+    }
+
+    inline uint64_t read_big_endian(const char* data) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) {
+            value = (value << 8) | static_cast<unsigned char>(data[i]);
+        }
+        return value;
+    }
+
+    inline void append_big_endian32(std::string& out, const uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out += static_cast<char>((value >> shift) & 0xff);
+        }
+    }
+
+    inline uint32_t read_big_endian32(const char* data) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value = (value << 8) | static_cast<unsigned char>(data[i]);
+        }
+        return value;
+    }
+
+    const size_t CHANGESET_KEY_SIZE = 4 + 1 + 8 + 4;
+
+    inline std::string make_changeset_key(const uint32_t changeset, const int osm_type, const int64_t osm_id, const uint32_t version) {
+        std::string key;
+        key.reserve(CHANGESET_KEY_SIZE);
+        append_big_endian32(key, changeset);
+        key += static_cast<char>(osm_type);
+        append_big_endian(key, static_cast<uint64_t>(osm_id));
+        append_big_endian32(key, version);
+        return key;
+    }
+
+    inline std::string make_changeset_bound(const uint32_t changeset) {
+        std::string key;
+        append_big_endian32(key, changeset);
+        return key;
+    }
+
+    inline void parse_changeset_key(const char* data, uint32_t* changeset, int* osm_type, int64_t* osm_id, uint32_t* version) {
+        *changeset = read_big_endian32(data);
+        *osm_type  = static_cast<int>(data[4]);
+        *osm_id    = static_cast<int64_t>(read_big_endian(data + 5));
+        *version   = read_big_endian32(data + 13);
+    }
+
+    const size_t USER_KEY_SIZE = 4 + 8 + 1 + 8 + 4;
+
+    inline std::string make_user_key(const uint32_t uid, const uint64_t timestamp, const int osm_type, const int64_t osm_id, const uint32_t version) {
+        std::string key;
+        key.reserve(USER_KEY_SIZE);
+        append_big_endian32(key, uid);
+        append_big_endian(key, timestamp);
+        key += static_cast<char>(osm_type);
+        append_big_endian(key, static_cast<uint64_t>(osm_id));
+        append_big_endian32(key, version);
+        return key;
+    }
+
+    inline std::string make_user_bound(const uint32_t uid) {
+        std::string key;
+        append_big_endian32(key, uid);
+        return key;
+    }
+
+    inline void parse_user_key(const char* data, uint32_t* uid, uint64_t* timestamp, int* osm_type, int64_t* osm_id, uint32_t* version) {
+        *uid       = read_big_endian32(data);
+        *timestamp = read_big_endian(data + 4);
+        *osm_type  = static_cast<int>(data[12]);
+        *osm_id    = static_cast<int64_t>(read_big_endian(data + 13));
+        *version   = read_big_endian32(data + 21);
+    }
+
+    const size_t PARENT_KEY_SIZE = 1 + 8 + 1 + 8 + 4 + 4;
+
+    inline std::string make_parent_key(const int child_type, const int64_t child_id, const int parent_type, const int64_t parent_id,
+                                       const uint32_t first_version, const uint32_t last_version) {
+        std::string key;
+        key.reserve(PARENT_KEY_SIZE);
+        key += static_cast<char>(child_type);
+        append_big_endian(key, static_cast<uint64_t>(child_id));
+        key += static_cast<char>(parent_type);
+        append_big_endian(key, static_cast<uint64_t>(parent_id));
+        append_big_endian32(key, first_version);
+        append_big_endian32(key, last_version);
+        return key;
+    }
+
+    //Every parent of a child, or with parent_type and parent_id the ranges of one parent
+    inline std::string make_parent_bound(const int child_type, const int64_t child_id, const int parent_type = 0, const int64_t parent_id = 0) {
+        std::string key;
+        key += static_cast<char>(child_type);
+        append_big_endian(key, static_cast<uint64_t>(child_id));
+        if (parent_type) {
+            key += static_cast<char>(parent_type);
+            append_big_endian(key, static_cast<uint64_t>(parent_id));
+        }
+        return key;
+    }
+
+    inline void parse_parent_key(const char* data, int* parent_type, int64_t* parent_id, uint32_t* first_version, uint32_t* last_version) {
+        *parent_type   = static_cast<int>(data[9]);
+        *parent_id     = static_cast<int64_t>(read_big_endian(data + 10));
+        *first_version = read_big_endian32(data + 18);
+        *last_version  = read_big_endian32(data + 22);
+    }
+
+}
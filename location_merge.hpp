@@ -0,0 +1,92 @@
+#pragma once
+
+/*
+    Location Merge Operator
+    =======================
+
+    Every version of a node is added to its entry in the `locations` column
+    family with a rocksdb Merge instead of a read-modify-write: the operand is
+    a locations object holding only the new version (as written by
+    encode_location_json), and rocksdb folds the operands into the stored
+    object when it is read or compacted.
+
+    Entries are keyed by changeset and the higher version wins within a
+    changeset, the same rule encode_location_json applies, so merging is
+    associative and the order operands are applied in does not matter.
+
+    Every reader and writer of the `locations` family must set this operator
+    (see read_family_options in db.hpp), or reads of unmerged entries fail.
+*/
+
+#include <memory>
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "rocksdb/merge_operator.h"
+#include "rocksdb/slice.h"
+
+namespace osmwayback {
+
+    //Adds the changeset entries of `operand` to `doc`, keeping the higher version of each
+    inline void merge_location_entries(const rapidjson::Value& operand, rapidjson::Document& doc) {
+        rapidjson::Document::AllocatorType& a = doc.GetAllocator();
+
+        for (auto it = operand.MemberBegin(); it != operand.MemberEnd(); ++it) {
+            const auto existing = doc.FindMember(it->name);
+            if (existing != doc.MemberEnd()) {
+                if (existing->value["i"].GetUint() > it->value["i"].GetUint()) {
+                    continue;
+                }
+                doc.RemoveMember(existing);
+            }
+            rapidjson::Value key(it->name, a);
+            rapidjson::Value entry(it->value, a);
+            doc.AddMember(key, entry, a);
+        }
+    }
+
+    class LocationMergeOperator : public rocksdb::AssociativeMergeOperator {
+
+    public:
+        bool Merge(const rocksdb::Slice& /*key*/, const rocksdb::Slice* existing_value, const rocksdb::Slice& value,
+                   std::string* new_value, rocksdb::Logger* /*logger*/) const override {
+            rapidjson::Document doc;
+            if (existing_value) {
+                if (doc.Parse<rapidjson::kParseFullPrecisionFlag>(existing_value->data(), existing_value->size()).HasParseError() || !doc.IsObject()) {
+                    return false;
+                }
+            } else {
+                doc.SetObject();
+            }
+
+            rapidjson::Document operand;
+            if (operand.Parse<rapidjson::kParseFullPrecisionFlag>(value.data(), value.size()).HasParseError() || !operand.IsObject()) {
+                return false;
+            }
+            merge_location_entries(operand, doc);
+
+            rapidjson::StringBuffer buffer;
+            rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+            doc.Accept(writer);
+            new_value->assign(buffer.GetString(), buffer.GetSize());
+            return true;
+        }
+
+        const char* Name() const override {
+            return "WaybackLocationMerge";
+        }
+    };
+
+    inline std::shared_ptr<rocksdb::MergeOperator> location_merge_operator() {
+        static const std::shared_ptr<rocksdb::MergeOperator> merge_operator = std::make_shared<LocationMergeOperator>();
+        return merge_operator;
+    }
+
+}
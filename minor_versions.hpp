@@ -0,0 +1,188 @@
+#pragma once
+
+/*
+    Minor Version Detection
+    =======================
+
+    A way's geometry changes whenever one of its nodes moves, even if the way
+    itself is not edited. These changes are "minor versions" of the way's
+    current major version.
+
+    For one major version, the time-sorted histories of all of its nodes are
+    merged (k-way, by timestamp) and every node move between this major version
+    and the next one becomes an event. Events from the same changeset, or less
+    than MINOR_VERSION_THRESHOLD seconds apart, are grouped into one minor
+    version: an editor moving a handful of nodes produces one geometry change,
+    not one per node.
+
+    This replaces the node sorting done by geometry-reconstruction's
+    way-history-builder.js, so the full node histories don't have to be shipped
+    downstream.
+*/
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/location.hpp>
+
+#include "json_encoding.hpp"
+
+namespace osmwayback {
+
+    const uint64_t MINOR_VERSION_THRESHOLD = 60 * 1; // 1 minute, same as way-history-builder.js
+
+    typedef std::map<int64_t, std::vector<jsonencoding::NodeLocationVersion>> NodeHistories;
+
+    struct MinorVersion {
+        uint32_t major_version{0};
+        uint32_t minor_version{0};
+        uint64_t timestamp{0};
+        uint32_t changeset{0};
+        uint32_t uid{0};
+        std::string user{};
+
+        //Nodes that moved in this minor version and their new location
+        std::vector<std::pair<int64_t, osmium::Location>> nodes{};
+    };
+
+    struct MajorVersionWindow {
+        uint32_t version{0};
+        uint64_t valid_since{0};
+        uint32_t changeset{0};
+
+        bool has_next{false};
+        uint64_t valid_until{0};
+        uint32_t next_changeset{0};
+    };
+
+    /*  The geometry of a major version: the location of each ref at the time the
+     *  version was created. Refs without a valid location are left undefined.
+     */
+    inline std::vector<osmium::Location> major_version_geometry(const std::vector<int64_t>& refs, const NodeHistories& histories, const MajorVersionWindow& window) {
+        std::vector<osmium::Location> locations;
+        locations.reserve(refs.size());
+
+        for (const int64_t ref : refs) {
+            osmium::Location location{};
+            auto history = histories.find(ref);
+            if (history != histories.end()) {
+                const auto* node = jsonencoding::location_at(history->second, window.valid_since, window.changeset);
+                if (node) {
+                    location = node->location;
+                }
+            }
+            locations.push_back(location);
+        }
+        return locations;
+    }
+
+    /*  Finds the minor versions of one major version. Minor versions are numbered
+     *  from 1 within each major version (the major version itself is minor
+     *  version 0) and appended to `minor_versions`.
+     */
+    inline void compute_minor_versions(const std::vector<int64_t>& refs, const NodeHistories& histories, const MajorVersionWindow& window, std::vector<MinorVersion>* minor_versions) {
+
+        //Current location of each distinct node, starting from the major version
+        std::map<int64_t, osmium::Location> current;
+        {
+            const auto major = major_version_geometry(refs, histories, window);
+            for (size_t i = 0; i < refs.size(); i++) {
+                current[refs[i]] = major[i];
+            }
+        }
+
+        //A cursor into one node's history: (timestamp, index into `cursors`)
+        typedef std::pair<uint64_t, size_t> HeapEntry;
+        struct Cursor {
+            int64_t ref;
+            const std::vector<jsonencoding::NodeLocationVersion>* versions;
+            size_t pos;
+        };
+
+        std::vector<Cursor> cursors;
+        std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap;
+
+        auto in_window = [&window](const jsonencoding::NodeLocationVersion& v) {
+            return !window.has_next || v.timestamp < window.valid_until;
+        };
+
+        for (const auto& node : current) {
+            auto history = histories.find(node.first);
+            if (history == histories.end()) {
+                continue;
+            }
+            const auto& versions = history->second;
+
+            //Skip every version up to and including the major version itself
+            size_t pos = 0;
+            while (pos < versions.size() && versions[pos].timestamp <= window.valid_since) {
+                pos++;
+            }
+            if (pos < versions.size() && in_window(versions[pos])) {
+                cursors.push_back(Cursor{node.first, &versions, pos});
+                heap.push(HeapEntry{versions[pos].timestamp, cursors.size() - 1});
+            }
+        }
+
+        MinorVersion pending;
+        std::map<int64_t, osmium::Location> pending_moves;
+        bool has_pending = false;
+        uint32_t minor_count = 0;
+
+        auto emit = [&]() {
+            if (!has_pending) {
+                return;
+            }
+            for (const auto& move : pending_moves) {
+                if (current[move.first] != move.second) {
+                    current[move.first] = move.second;
+                    pending.nodes.push_back(move);
+                }
+            }
+            if (!pending.nodes.empty()) {
+                pending.major_version = window.version;
+                pending.minor_version = ++minor_count;
+                minor_versions->push_back(pending);
+            }
+            pending = MinorVersion{};
+            pending_moves.clear();
+            has_pending = false;
+        };
+
+        while (!heap.empty()) {
+            const HeapEntry top = heap.top();
+            heap.pop();
+
+            Cursor& cursor = cursors[top.second];
+            const jsonencoding::NodeLocationVersion& v = (*cursor.versions)[cursor.pos];
+
+            //Moves made by the major versions themselves are not minor versions
+            const bool own_changeset = v.changeset == window.changeset || (window.has_next && v.changeset == window.next_changeset);
+
+            if (!own_changeset && v.location.valid()) {
+                if (has_pending && v.changeset != pending.changeset && v.timestamp > pending.timestamp + MINOR_VERSION_THRESHOLD) {
+                    emit();
+                }
+                if (!has_pending) {
+                    pending.changeset = v.changeset;
+                    pending.uid = v.uid;
+                    pending.user = v.user;
+                    has_pending = true;
+                }
+                pending.timestamp = v.timestamp;
+                pending_moves[cursor.ref] = v.location;
+            }
+
+            cursor.pos++;
+            if (cursor.pos < cursor.versions->size() && in_window((*cursor.versions)[cursor.pos])) {
+                heap.push(HeapEntry{(*cursor.versions)[cursor.pos].timestamp, top.second});
+            }
+        }
+        emit();
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+/*
+    Node Location Batches
+    =====================
+
+    add_node_locations gives every feature the full history of each of its
+    nodes, so a node shared by several ways (a junction, a boundary between
+    landuse polygons) is written once per way. With add_geometry --batch N,
+    features are collected per output shard into batches of N, and each
+    batch is written as one line:
+
+        {
+          "type": "FeatureCollection",
+          "nodeLocations": { nodeID: { changesetID: {...}, ... }, ... },
+          "features": [ <features as without --batch, but no nodeLocations> ]
+        }
+
+    `nodeLocations` has the same entries as the per-feature objects, for
+    the union of the nodes referenced in the batch's `@history`. Features
+    only keep their node IDs (the `n` lists), and the reconstruction reads
+    their locations from the batch.
+
+    Batches gain the most when neighbouring features go to the same shard
+    (--shard-key tile), and in input order when the input is sorted.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "db.hpp"
+#include "enrich.hpp"
+#include "shards.hpp"
+
+namespace osmwayback {
+
+    struct NodeBatchStats {
+        long batch_count{0};
+        long feature_node_count{0}; //Node histories the features would have carried one by one
+        long batch_node_count{0};   //Node histories written in batches
+    };
+
+    class NodeBatch {
+        std::string m_features{};
+        std::vector<int64_t> m_refs{};
+        std::vector<int64_t> m_feature_refs{};
+        size_t m_count{0};
+
+    public:
+        size_t size() const {
+            return m_count;
+        }
+
+        // Adds a feature, `data` is its serialization
+        void add(const rapidjson::Value& feature, const char* data, const size_t size, NodeBatchStats* stats) {
+            const rapidjson::Value& properties = feature["properties"];
+            if (properties["@type"] != "node" && properties.HasMember("@history")) {
+                m_feature_refs.clear();
+                collect_node_refs(feature, &m_feature_refs);
+                std::sort(m_feature_refs.begin(), m_feature_refs.end());
+                m_feature_refs.erase(std::unique(m_feature_refs.begin(), m_feature_refs.end()), m_feature_refs.end());
+                stats->feature_node_count += static_cast<long>(m_feature_refs.size());
+                m_refs.insert(m_refs.end(), m_feature_refs.begin(), m_feature_refs.end());
+            }
+
+            m_features += m_count == 0 ? '[' : ',';
+            m_features.append(data, size);
+            m_count++;
+        }
+
+        // Writes the batch as one line to `shard` and empties it
+        void write(ObjectStore* store, ShardedWriter* output, const size_t shard, EnrichStats* enrich_stats, NodeBatchStats* stats) {
+            if (m_count == 0) {
+                return;
+            }
+
+            std::sort(m_refs.begin(), m_refs.end());
+            m_refs.erase(std::unique(m_refs.begin(), m_refs.end()), m_refs.end());
+
+            rapidjson::Document nodeLocations;
+            nodeLocations.SetObject();
+            add_node_histories(store, m_refs, nodeLocations, nodeLocations.GetAllocator(), enrich_stats);
+            stats->batch_node_count += static_cast<long>(m_refs.size());
+            stats->batch_count++;
+
+            rapidjson::StringBuffer buffer;
+            rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+            writer.StartObject();
+            writer.Key("type");
+            writer.String("FeatureCollection");
+            writer.Key("nodeLocations");
+            nodeLocations.Accept(writer);
+            writer.Key("features");
+            m_features += ']';
+            writer.RawValue(m_features.data(), m_features.size(), rapidjson::kArrayType);
+            writer.EndObject();
+
+            output->write_line(shard, buffer.GetString(), buffer.GetSize());
+
+            m_features.clear();
+            m_refs.clear();
+            m_count = 0;
+        }
+    };
+
+}
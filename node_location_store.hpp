@@ -0,0 +1,383 @@
+#pragma once
+
+/*
+    Node Location Store
+    ===================
+
+    An alternative to the locations column family, built with
+    `build_lookup_index --node-location-store`. Node ids are dense, so the
+    location histories are kept the way libosmium keeps dense location
+    indexes instead of in an LSM tree behind string keys:
+
+    - INDEX_DIR/node_locations/offsets: one uint64 per node id, memory mapped.
+      Entry i is 1 + the position of node i's history in `records`, 0 if the
+      node has none. Ids that never occur are holes in a sparse file.
+    - INDEX_DIR/node_locations/records: an append-only file of histories, each
+      a varint byte length followed by its versions in timestamp order. A
+      version is the varints timestamp, changeset, version, uid, user length,
+      the user bytes, 1 if a location follows (0 for deleted versions) and the
+      zigzag x and y of the location in osmium's fixed point coordinates.
+
+    A history holds the same versions as a locations entry (the highest version
+    per changeset, see location_merge.hpp), so looking one up is an offset read
+    and a decode of a few bytes from the page cache. ObjectStore serves
+    get_node_locations from here when the index has a store.
+
+    update_index appends a new history for every node it changes and points the
+    node's offset at it; the old history stays in the file unreferenced.
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <protozero/exception.hpp>
+#include <protozero/varint.hpp>
+
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+
+#include "json_encoding.hpp"
+
+namespace osmwayback {
+
+    const std::string NODE_LOCATION_STORE_DIR = "node_locations";
+
+    //Offsets of up to this many consecutive ids are written at once while building
+    const size_t NODE_LOCATION_OFFSET_WINDOW = 1024 * 1024;
+    const size_t NODE_LOCATION_RECORD_BUFFER = 4 * 1024 * 1024;
+
+    inline void encode_location_record(const std::vector<jsonencoding::NodeLocationVersion>& versions, std::string* record) {
+        record->clear();
+        auto out = std::back_inserter(*record);
+        for (const auto& v : versions) {
+            protozero::write_varint(out, v.timestamp);
+            protozero::write_varint(out, v.changeset);
+            protozero::write_varint(out, v.version);
+            protozero::write_varint(out, v.uid);
+            protozero::write_varint(out, v.user.size());
+            record->append(v.user);
+            protozero::write_varint(out, v.location.valid() ? 1 : 0);
+            if (v.location.valid()) {
+                protozero::write_varint(out, protozero::encode_zigzag64(v.location.x()));
+                protozero::write_varint(out, protozero::encode_zigzag64(v.location.y()));
+            }
+        }
+    }
+
+    // The versions of a record without its length, false if it is corrupt
+    inline bool decode_location_record(const char* data, const char* end, std::vector<jsonencoding::NodeLocationVersion>* versions) {
+        versions->clear();
+        try {
+            while (data < end) {
+                jsonencoding::NodeLocationVersion v;
+                v.timestamp = protozero::decode_varint(&data, end);
+                v.changeset = static_cast<uint32_t>(protozero::decode_varint(&data, end));
+                v.version   = static_cast<uint32_t>(protozero::decode_varint(&data, end));
+                v.uid       = static_cast<uint32_t>(protozero::decode_varint(&data, end));
+                const uint64_t user_size = protozero::decode_varint(&data, end);
+                if (user_size > static_cast<uint64_t>(end - data)) {
+                    return false;
+                }
+                v.user.assign(data, user_size);
+                data += user_size;
+                if (protozero::decode_varint(&data, end)) {
+                    const auto x = static_cast<int32_t>(protozero::decode_zigzag64(protozero::decode_varint(&data, end)));
+                    const auto y = static_cast<int32_t>(protozero::decode_zigzag64(protozero::decode_varint(&data, end)));
+                    v.location = osmium::Location{x, y};
+                }
+                versions->push_back(std::move(v));
+            }
+        } catch (const protozero::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    /*  Adds a version to a history the way location_merge.hpp does: a changeset
+     *  keeps only its highest version. Call sort_location_history after the last.
+     */
+    inline void add_location_version(std::vector<jsonencoding::NodeLocationVersion>* versions, const osmium::Node& node) {
+        jsonencoding::NodeLocationVersion v;
+        v.timestamp = uint32_t(node.timestamp());
+        v.changeset = node.changeset();
+        v.version = node.version();
+        v.uid = node.uid();
+        v.user = node.user();
+        if (!node.deleted() && node.location().valid()) {
+            v.location = node.location();
+        }
+        for (auto& existing : *versions) {
+            if (existing.changeset == v.changeset) {
+                if (existing.version <= v.version) {
+                    existing = std::move(v);
+                }
+                return;
+            }
+        }
+        versions->push_back(std::move(v));
+    }
+
+    inline void sort_location_history(std::vector<jsonencoding::NodeLocationVersion>* versions) {
+        std::sort(versions->begin(), versions->end(), [](const jsonencoding::NodeLocationVersion& lhs, const jsonencoding::NodeLocationVersion& rhs) {
+            return lhs.timestamp < rhs.timestamp || (lhs.timestamp == rhs.timestamp && lhs.version < rhs.version);
+        });
+    }
+
+    inline std::string node_location_file(const std::string& index_dir, const char* name) {
+        return index_dir + "/" + NODE_LOCATION_STORE_DIR + "/" + name;
+    }
+
+    /*  Writes the store while building or updating an index. Nodes must come in
+     *  id order, all versions of a node together, as they do in a history file
+     *  (and in the sorted changes update_index applies).
+     */
+    class NodeLocationWriter {
+        int m_offsets_fd{-1};
+        int m_records_fd{-1};
+        bool m_update{false};
+
+        uint64_t m_records_size{0}; //Including the part still in m_records
+        std::string m_records{};
+        std::string m_record{};
+
+        //Offsets from m_window_start on, only used when building: there is nothing to overwrite
+        std::vector<uint64_t> m_window{};
+        int64_t m_window_start{0};
+
+        int64_t m_node_id{-1};
+        std::vector<jsonencoding::NodeLocationVersion> m_versions{};
+
+        static void write_all(const int fd, const char* data, size_t size, off_t offset) {
+            while (size > 0) {
+                const ssize_t written = ::pwrite(fd, data, size, offset);
+                if (written <= 0) {
+                    throw std::runtime_error{"could not write node location store"};
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+                offset += written;
+            }
+        }
+
+        static bool read_all(const int fd, char* data, const size_t size, const off_t offset) {
+            size_t done = 0;
+            while (done < size) {
+                const ssize_t got = ::pread(fd, data + done, size - done, offset + static_cast<off_t>(done));
+                if (got <= 0) {
+                    return false;
+                }
+                done += static_cast<size_t>(got);
+            }
+            return true;
+        }
+
+        void flush_records() {
+            write_all(m_records_fd, m_records.data(), m_records.size(), static_cast<off_t>(m_records_size - m_records.size()));
+            m_records.clear();
+        }
+
+        void flush_window() {
+            if (!m_window.empty()) {
+                write_all(m_offsets_fd, reinterpret_cast<const char*>(m_window.data()), m_window.size() * sizeof(uint64_t),
+                          static_cast<off_t>(m_window_start) * static_cast<off_t>(sizeof(uint64_t)));
+                m_window.clear();
+            }
+        }
+
+        void set_offset(const int64_t id, const uint64_t value) {
+            if (m_update) {
+                write_all(m_offsets_fd, reinterpret_cast<const char*>(&value), sizeof(value), static_cast<off_t>(id) * static_cast<off_t>(sizeof(value)));
+                return;
+            }
+            if (m_window.empty() || id < m_window_start || id >= m_window_start + static_cast<int64_t>(NODE_LOCATION_OFFSET_WINDOW)) {
+                flush_window();
+                m_window_start = id;
+            }
+            m_window.resize(static_cast<size_t>(id - m_window_start) + 1, 0);
+            m_window.back() = value;
+        }
+
+        //The stored history of a node that is being updated
+        void read_history(const int64_t id, std::vector<jsonencoding::NodeLocationVersion>* versions) {
+            versions->clear();
+            uint64_t offset = 0;
+            if (!read_all(m_offsets_fd, reinterpret_cast<char*>(&offset), sizeof(offset), static_cast<off_t>(id) * static_cast<off_t>(sizeof(offset))) || offset == 0) {
+                return;
+            }
+            if (offset > m_records_size) {
+                return;
+            }
+            char header[10];
+            const size_t available = static_cast<size_t>(std::min<uint64_t>(sizeof(header), m_records_size - (offset - 1)));
+            if (!read_all(m_records_fd, header, available, static_cast<off_t>(offset - 1))) {
+                return;
+            }
+            const char* data = header;
+            uint64_t size = 0;
+            try {
+                size = protozero::decode_varint(&data, header + available);
+            } catch (const protozero::exception&) {
+                return;
+            }
+            std::string record(size, '\0');
+            if (read_all(m_records_fd, &record[0], size, static_cast<off_t>(offset - 1 + static_cast<uint64_t>(data - header)))) {
+                decode_location_record(record.data(), record.data() + record.size(), versions);
+            }
+        }
+
+        void finish_node() {
+            if (m_node_id < 0 || m_versions.empty()) {
+                return;
+            }
+            sort_location_history(&m_versions);
+            encode_location_record(m_versions, &m_record);
+
+            const uint64_t offset = m_records_size;
+            const size_t before = m_records.size();
+            protozero::write_varint(std::back_inserter(m_records), m_record.size());
+            m_records.append(m_record);
+            m_records_size += m_records.size() - before;
+            set_offset(m_node_id, offset + 1);
+
+            //An update may come back to a node, read_history only looks at the file
+            if (m_update || m_records.size() > NODE_LOCATION_RECORD_BUFFER) {
+                flush_records();
+            }
+            m_versions.clear();
+        }
+
+    public:
+        // `update` keeps the existing files and appends to them
+        NodeLocationWriter(const std::string& index_dir, const bool update) :
+            m_update(update) {
+            ::mkdir((index_dir + "/" + NODE_LOCATION_STORE_DIR).c_str(), 0755);
+            const int flags = O_RDWR | O_CREAT | (update ? 0 : O_TRUNC);
+            m_offsets_fd = ::open(node_location_file(index_dir, "offsets").c_str(), flags, 0644);
+            m_records_fd = ::open(node_location_file(index_dir, "records").c_str(), flags, 0644);
+            if (m_offsets_fd < 0 || m_records_fd < 0) {
+                throw std::runtime_error{"could not open node location store in " + index_dir};
+            }
+            struct stat records;
+            if (::fstat(m_records_fd, &records) != 0) {
+                throw std::runtime_error{"could not open node location store in " + index_dir};
+            }
+            m_records_size = static_cast<uint64_t>(records.st_size);
+        }
+
+        NodeLocationWriter(const NodeLocationWriter&) = delete;
+        NodeLocationWriter& operator=(const NodeLocationWriter&) = delete;
+
+        ~NodeLocationWriter() {
+            if (m_offsets_fd >= 0) ::close(m_offsets_fd);
+            if (m_records_fd >= 0) ::close(m_records_fd);
+        }
+
+        //Negative ids (from editors, never in a planet history) can't index the array and are skipped
+        void add(const osmium::Node& node) {
+            if (node.id() < 0) {
+                return;
+            }
+            if (node.id() != m_node_id) {
+                finish_node();
+                m_node_id = node.id();
+                if (m_update) {
+                    read_history(m_node_id, &m_versions);
+                }
+            }
+            add_location_version(&m_versions, node);
+        }
+
+        // Writes everything added so far to disk
+        void flush() {
+            finish_node();
+            m_node_id = -1;
+            flush_records();
+            flush_window();
+            ::fsync(m_records_fd);
+            ::fsync(m_offsets_fd);
+        }
+    };
+
+    // Read access to the store; lookups are const and can be shared by threads
+    class NodeLocationStore {
+        const char* m_offsets{nullptr};
+        size_t m_offsets_size{0};
+        const char* m_records{nullptr};
+        size_t m_records_size{0};
+
+        static const char* map(const std::string& filename, size_t* size) {
+            const int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error{"could not open " + filename};
+            }
+            struct stat file;
+            if (::fstat(fd, &file) != 0) {
+                ::close(fd);
+                throw std::runtime_error{"could not open " + filename};
+            }
+            *size = static_cast<size_t>(file.st_size);
+            void* data = nullptr;
+            if (*size > 0) {
+                data = ::mmap(nullptr, *size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error{"could not map " + filename};
+            }
+            return static_cast<const char*>(data);
+        }
+
+    public:
+        explicit NodeLocationStore(const std::string& index_dir) {
+            m_offsets = map(node_location_file(index_dir, "offsets"), &m_offsets_size);
+            m_records = map(node_location_file(index_dir, "records"), &m_records_size);
+            //Histories are read in random order, don't read ahead
+            if (m_offsets) ::madvise(const_cast<char*>(m_offsets), m_offsets_size, MADV_RANDOM);
+            if (m_records) ::madvise(const_cast<char*>(m_records), m_records_size, MADV_RANDOM);
+        }
+
+        NodeLocationStore(const NodeLocationStore&) = delete;
+        NodeLocationStore& operator=(const NodeLocationStore&) = delete;
+
+        ~NodeLocationStore() {
+            if (m_offsets) ::munmap(const_cast<char*>(m_offsets), m_offsets_size);
+            if (m_records) ::munmap(const_cast<char*>(m_records), m_records_size);
+        }
+
+        // The versions of a node in timestamp order, false if it has no history
+        bool get(const int64_t id, std::vector<jsonencoding::NodeLocationVersion>* versions) const {
+            versions->clear();
+            if (id < 0 || static_cast<uint64_t>(id) >= m_offsets_size / sizeof(uint64_t)) {
+                return false;
+            }
+            uint64_t offset = 0;
+            std::memcpy(&offset, m_offsets + static_cast<size_t>(id) * sizeof(uint64_t), sizeof(offset));
+            if (offset == 0 || offset > m_records_size) {
+                return false;
+            }
+            const char* data = m_records + offset - 1;
+            const char* end = m_records + m_records_size;
+            try {
+                const uint64_t size = protozero::decode_varint(&data, end);
+                if (size > static_cast<uint64_t>(end - data)) {
+                    return false;
+                }
+                end = data + size;
+            } catch (const protozero::exception&) {
+                return false;
+            }
+            return decode_location_record(data, end, versions);
+        }
+    };
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+    Object Versions
+    ===============
+
+    Plain structs for one stored version of a node, way or relation, filled by
+    decode_object (pbf_encoding.hpp) and returned by the libwayback API
+    (wayback.hpp). Only osmium's basic types are needed to use them.
+*/
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+
+namespace osmwayback {
+
+    struct Member {
+        osmium::item_type type;
+        int64_t ref;
+        std::string role;
+    };
+
+    struct ObjectVersion {
+        uint64_t timestamp{0};
+        uint32_t changeset{0};
+        uint32_t version{0};
+        uint32_t uid{0};
+        std::string user{};
+        bool visible{true};
+        bool deleted{false};
+        osmium::Location location{};
+        std::vector<int64_t> nodes{};
+        std::vector<Member> members{};
+        std::vector<std::pair<std::string, std::string>> tags{};
+
+        const char* get_tag(const char* key) const {
+            for (const auto& tag : tags) {
+                if (tag.first == key) {
+                    return tag.second.c_str();
+                }
+            }
+            return nullptr;
+        }
+    };
+
+}
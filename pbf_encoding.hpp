@@ -9,6 +9,17 @@
 #include "rapidjson/document.h"
 
 #include <osmium/osm/types.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "object_version.hpp"
+#include "tag_diff.hpp"
+#include "tag_filter.hpp"
+#include "way_delta.hpp"
 
 namespace osmwayback {
 
@@ -26,13 +37,76 @@ namespace osmwayback {
     5. User (String)
     6. Visible (bool)
     7. Deleted (bool)
+    8. Node: longitude (double) / Way: node refs (packed int64)
+    9. Node: latitude (double)
     10: Tags
+    11: Relation: member refs (packed sint64)
+    12: Relation: member types (packed uint32, osmium::item_type)
+    13: Relation: member roles (string, one per member)
+    14: Tag diff included (bool, always before the other fields when present)
+    15: Tags added since the previous version (key, value strings)
+    16: Tags modified (key, previous value, new value strings)
+    17: Tags deleted (key, previous value strings)
+    18: Way: node refs (packed sint64, delta coded)
+    19: Way: node edit script against an earlier version (embedded message)
+
+    Fields 14-17 are only written by `build_lookup_index --tag-diffs`. They hold
+    the aA/aM/aD diff against the previous version of the object in the history
+    file (all tags are added for the first version), so add_history does not
+    have to load and compare the tags of every version.
+
+    Fields 18 and 19 replace field 8 in indexes built with
+    `build_lookup_index --way-deltas`, see way_delta.hpp.
+
+    Tags dropped by the tag filter of an index (see tag_filter.hpp) are not
+    written to any field.
 */
 
-    const std::string encode_node(const osmium::Node& node) {
+    //Writes fields 15-17 in the order add_tag_diff would produce them
+    inline void encode_tag_diff(protozero::pbf_writer& encoder, const VersionTags& previous, const osmium::TagList& tags,
+                                const TagFilter* tag_filter = nullptr) {
+        VersionTags current;
+        for (const osmium::Tag& tag : tags) {
+            if (keep_tag(tag_filter, tag)) {
+                current.insert(std::make_pair(tag.key(), tag.value()));
+            }
+        }
+
+        if (map_compare(previous, current)) {
+            return;
+        }
+
+        for (const auto& tag : current) {
+            const auto search = previous.find(tag.first);
+            if (search == previous.end()) {
+                encoder.add_string(15, tag.first);
+                encoder.add_string(15, tag.second);
+            } else if (search->second != tag.second) {
+                encoder.add_string(16, tag.first);
+                encoder.add_string(16, search->second);
+                encoder.add_string(16, tag.second);
+            }
+        }
+        for (const auto& tag : previous) {
+            if (current.count(tag.first) == 0) {
+                encoder.add_string(17, tag.first);
+                encoder.add_string(17, tag.second);
+            }
+        }
+    }
+
+    /*  previous_tags: write a tag diff against these tags (fields 14-17), nullptr for none
+     *  tag_filter: the tags to keep, nullptr for all
+     */
+    inline const std::string encode_node(const osmium::Node& node, const VersionTags* previous_tags = nullptr,
+                                         const TagFilter* tag_filter = nullptr) {
         std::string data;
         protozero::pbf_writer encoder(data);
 
+        if (previous_tags) {
+            encoder.add_bool(14, true);
+        }
+
         encoder.add_fixed64(1, static_cast<int>(node.timestamp().seconds_since_epoch()));
         encoder.add_uint32(2, node.changeset());
         encoder.add_uint32(3, node.version());
@@ -57,16 +131,46 @@ namespace osmwayback {
         //Add the tags
         const osmium::TagList& tags = node.tags();
         for (const osmium::Tag& tag : tags) {
-          encoder.add_string(10, tag.key());
-          encoder.add_string(10, tag.value());
+          if (keep_tag(tag_filter, tag)) {
+              encoder.add_string(10, tag.key());
+              encoder.add_string(10, tag.value());
+          }
+      }
+      if (previous_tags) {
+          encode_tag_diff(encoder, *previous_tags, tags, tag_filter);
       }
       return data;
     }
 
-    const std::string encode_way(const osmium::Way& way) {
+    /*  previous_tags: write a tag diff against these tags (fields 14-17), nullptr for none
+     *  node_encoding: store the node list as a snapshot or edit script (fields 18-19),
+     *                 nullptr for plain refs (field 8)
+     *  tag_filter: the tags to keep, nullptr for all
+     */
+    inline const std::string encode_way(const osmium::Way& way, const VersionTags* previous_tags = nullptr,
+                                        const WayNodeEncoding* node_encoding = nullptr, const TagFilter* tag_filter = nullptr) {
         std::string data;
         protozero::pbf_writer encoder(data);
 
+        //Node references, stored whole or as an edit script against the base version
+        std::vector<int64_t> noderefs;
+        for (const osmium::NodeRef& nr : way.nodes()) {
+            noderefs.push_back(nr.ref());
+        }
+
+        //The edit script comes first, so readers can tell a delta record from its first bytes
+        if (node_encoding && node_encoding->base_nodes) {
+            protozero::pbf_writer delta(encoder, 19);
+            delta.add_uint32(1, node_encoding->base_version);
+            delta.add_uint32(2, node_encoding->depth);
+            const std::vector<int64_t> script = node_edit_script(*node_encoding->base_nodes, noderefs);
+            delta.add_packed_sint64(3, script.begin(), script.end());
+        }
+
+        if (previous_tags) {
+            encoder.add_bool(14, true);
+        }
+
         encoder.add_fixed64(1, static_cast<int>(way.timestamp().seconds_since_epoch()));
         encoder.add_uint32(2, way.changeset());
         encoder.add_uint32(3, way.version());
@@ -76,22 +180,79 @@ namespace osmwayback {
         encoder.add_bool(6, way.visible());
         encoder.add_bool(7, way.deleted());
 
-        //Add node references: TODO: Optimize
-        std::vector<int64_t> noderefs;
-        for (const osmium::NodeRef& nr : way.nodes()) {
-            noderefs.push_back(nr.ref());
+        if (!node_encoding) {
+            encoder.add_packed_int64(8,  noderefs.begin(), noderefs.end());
+        } else if (!node_encoding->base_nodes) {
+            add_delta_coded_nodes(encoder, 18, noderefs.begin(), noderefs.end());
         }
-        encoder.add_packed_int64(8,  noderefs.begin(), noderefs.end());
 
         //Add the tags
         const osmium::TagList& tags = way.tags();
         for (const osmium::Tag& tag : tags) {
-          encoder.add_string(10, tag.key());
-          encoder.add_string(10, tag.value());
+          if (keep_tag(tag_filter, tag)) {
+              encoder.add_string(10, tag.key());
+              encoder.add_string(10, tag.value());
+          }
+        }
+        if (previous_tags) {
+            encode_tag_diff(encoder, *previous_tags, tags, tag_filter);
         }
         return data;
     }
 
+    /*  previous_tags: write a tag diff against these tags (fields 14-17), nullptr for none
+     *  tag_filter: the tags to keep, nullptr for all
+     */
+    inline const std::string encode_relation(const osmium::Relation& relation, const VersionTags* previous_tags = nullptr,
+                                             const TagFilter* tag_filter = nullptr) {
+        std::string data;
+        protozero::pbf_writer encoder(data);
+
+        if (previous_tags) {
+            encoder.add_bool(14, true);
+        }
+
+        encoder.add_fixed64(1, static_cast<int>(relation.timestamp().seconds_since_epoch()));
+        encoder.add_uint32(2, relation.changeset());
+        encoder.add_uint32(3, relation.version());
+        encoder.add_uint32(4, relation.uid());
+        encoder.add_string(5, relation.user());
+
+        encoder.add_bool(6, relation.visible());
+        encoder.add_bool(7, relation.deleted());
+
+        //Add the members: refs and types are packed, roles follow in member order
+        std::vector<int64_t> refs;
+        std::vector<uint32_t> types;
+        for (const osmium::RelationMember& member : relation.members()) {
+            refs.push_back(member.ref());
+            types.push_back(static_cast<uint32_t>(member.type()));
+        }
+        encoder.add_packed_sint64(11, refs.begin(), refs.end());
+        encoder.add_packed_uint32(12, types.begin(), types.end());
+        for (const osmium::RelationMember& member : relation.members()) {
+            encoder.add_string(13, member.role());
+        }
+
+        //Add the tags
+        const osmium::TagList& tags = relation.tags();
+        for (const osmium::Tag& tag : tags) {
+          if (keep_tag(tag_filter, tag)) {
+              encoder.add_string(10, tag.key());
+              encoder.add_string(10, tag.value());
+          }
+        }
+        if (previous_tags) {
+            encode_tag_diff(encoder, *previous_tags, tags, tag_filter);
+        }
+        return data;
+    }
+
+    //Relations were stored as JSON strings before they were PBF encoded
+    inline bool is_legacy_json(const std::string& data) {
+        return !data.empty() && data[0] == '{';
+    }
+
 /*
     PBF Object Decoding
     ===================
@@ -116,23 +277,115 @@ namespace osmwayback {
     //Object specific attributes:
     coordinates = p //p for point (only point geoms here)
     nodes      = n;
+    members    = m; [type (n/w/r), ref, role]
 
 */
 
-    // Decode PBF_Node as JSON Object (in place (?) )
-    void decode_node(std::string data, rapidjson::Document* doc) {
+
+    //A string field as a rapidjson string, copied into the allocator without a std::string in between
+    template <typename TAllocator>
+    inline rapidjson::Value string_value(const protozero::data_view& view, TAllocator& a) {
+        return rapidjson::Value(view.data(), static_cast<rapidjson::SizeType>(view.size()), a);
+    }
+
+    /*  Collects the tag diff fields (15-17) of a record while it is decoded and
+     *  adds them as aA, aM and aD, in the same order as add_tag_diff. The
+     *  strings are views into the record, which must outlive add_to().
+     */
+    class TagDiffDecoder {
+        std::vector<protozero::data_view> m_added;
+        std::vector<protozero::data_view> m_modified;
+        std::vector<protozero::data_view> m_deleted;
+
+    public:
+        void field(protozero::pbf_reader& message) {
+            switch (message.tag()) {
+                case 15:
+                    m_added.push_back(message.get_view());
+                    break;
+                case 16:
+                    m_modified.push_back(message.get_view());
+                    break;
+                case 17:
+                    m_deleted.push_back(message.get_view());
+                    break;
+                default:
+                    message.skip();
+            }
+        }
+
+        template <typename TAllocator>
+        void add_to(rapidjson::Value& doc, TAllocator& a) const {
+            if (m_modified.size() >= 3) {
+                rapidjson::Value mod_tags(rapidjson::kObjectType);
+                for (size_t i = 0; i + 2 < m_modified.size(); i += 3) {
+                    rapidjson::Value key = string_value(m_modified[i], a);
+                    rapidjson::Value prev_val = string_value(m_modified[i + 1], a);
+                    rapidjson::Value new_val = string_value(m_modified[i + 2], a);
+                    rapidjson::Value modified_tag(rapidjson::kArrayType);
+                    modified_tag.PushBack(prev_val, a);
+                    modified_tag.PushBack(new_val, a);
+                    mod_tags.AddMember(key, modified_tag, a);
+                }
+                doc.AddMember("aM", mod_tags, a);
+            }
+            if (m_added.size() >= 2) {
+                rapidjson::Value new_tags = tag_object(m_added, a);
+                doc.AddMember("aA", new_tags, a);
+            }
+            if (m_deleted.size() >= 2) {
+                rapidjson::Value del_tags = tag_object(m_deleted, a);
+                doc.AddMember("aD", del_tags, a);
+            }
+        }
+
+    private:
+        template <typename TAllocator>
+        static rapidjson::Value tag_object(const std::vector<protozero::data_view>& pairs, TAllocator& a) {
+            rapidjson::Value tags(rapidjson::kObjectType);
+            for (size_t i = 0; i + 1 < pairs.size(); i += 2) {
+                rapidjson::Value key = string_value(pairs[i], a);
+                rapidjson::Value value = string_value(pairs[i + 1], a);
+                tags.AddMember(key, value, a);
+            }
+            return tags;
+        }
+    };
+
+    /*  Decode PBF_Node as JSON Object (in place (?) )
+     *
+     *  With `history` set, a record that includes a tag diff (fields 14-17) is
+     *  decoded with aA/aM/aD instead of its tags ("a") and true is returned,
+     *  the same for ways and relations below. Otherwise the tags are decoded
+     *  as "a" and false is returned.
+     */
+    inline bool decode_node(const std::string& data, rapidjson::Document* doc, const bool history = false) {
         protozero::pbf_reader message(data);
 
         //Initialize the object (object is defined in add_tags)
         doc->SetObject();
         rapidjson::Document::AllocatorType& a = doc->GetAllocator();
 
-        std::string previous_key{};
+        protozero::data_view previous_key{};
         rapidjson::Value object_tags(rapidjson::kObjectType);
         rapidjson::Value coordinates(rapidjson::kArrayType);
         bool deleted;
+        bool tag_diff = false;
+        TagDiffDecoder diff;
         while (message.next()) {
             switch (message.tag()) {
+                case 14:
+                    tag_diff = message.get_bool() && history;
+                    break;
+                case 15:
+                case 16:
+                case 17:
+                    if (tag_diff) {
+                        diff.field(message);
+                    } else {
+                        message.skip();
+                    }
+                    break;
                 case 1:
                     doc->AddMember("t", message.get_fixed64(), a);
                     break;
@@ -146,7 +399,10 @@ namespace osmwayback {
                     doc->AddMember("u", message.get_uint32(), a);
                     break;
                 case 5:
-                    doc->AddMember("h", message.get_string(), a);
+                    {
+                        rapidjson::Value handle = string_value(message.get_view(), a);
+                        doc->AddMember("h", handle, a);
+                    }
                     break;
                 case 6:
                     message.get_bool();
@@ -166,14 +422,16 @@ namespace osmwayback {
                     break;
                 case 10:
                 //Tags
-                    if (previous_key.empty()) {
-                        previous_key = message.get_string();
+                    if (tag_diff) {
+                        message.skip();
+                    } else if (previous_key.data() == nullptr) {
+                        previous_key = message.get_view();
                     } else {
-                        rapidjson::Value key(previous_key.c_str(), a);
-                        rapidjson::Value value(message.get_string(), a);
+                        rapidjson::Value key = string_value(previous_key, a);
+                        rapidjson::Value value = string_value(message.get_view(), a);
 
                         object_tags.AddMember(key, value, a);
-                        previous_key = "";
+                        previous_key = protozero::data_view{};
                     }
                     break;
                 default:
@@ -188,10 +446,14 @@ namespace osmwayback {
         if ( !object_tags.ObjectEmpty() ){
             doc->AddMember("a",object_tags, a);
         }
+        if (tag_diff) {
+            diff.add_to(*doc, a);
+        }
+        return tag_diff;
     }
 
     // Decode PBF Way as JSON Object (in place (?) )
-    void decode_way(std::string data, rapidjson::Document* doc) {
+    inline bool decode_way(const std::string& data, rapidjson::Document* doc, const bool history = false) {
         protozero::pbf_reader message(data);
 
         //Initialize the object (object is defined in add_tags)
@@ -200,14 +462,28 @@ namespace osmwayback {
 
         rapidjson::Value noderefs(rapidjson::kArrayType);
 
-        std::string previous_key{};
+        protozero::data_view previous_key{};
         rapidjson::Value object_tags(rapidjson::kObjectType);
 
         protozero::iterator_range<protozero::pbf_reader::const_int64_iterator> nodeIDs;
 
         bool deleted;
+        bool tag_diff = false;
+        TagDiffDecoder diff;
         while (message.next()) {
             switch (message.tag()) {
+                case 14:
+                    tag_diff = message.get_bool() && history;
+                    break;
+                case 15:
+                case 16:
+                case 17:
+                    if (tag_diff) {
+                        diff.field(message);
+                    } else {
+                        message.skip();
+                    }
+                    break;
                 case 1:
                     doc->AddMember("t", message.get_fixed64(), a);
                     break;
@@ -221,7 +497,10 @@ namespace osmwayback {
                     doc->AddMember("u", message.get_uint32(), a);
                     break;
                 case 5:
-                    doc->AddMember("h", message.get_string(), a);
+                    {
+                        rapidjson::Value handle = string_value(message.get_view(), a);
+                        doc->AddMember("h", handle, a);
+                    }
                     break;
                 case 6:
                     message.get_bool();
@@ -240,16 +519,28 @@ namespace osmwayback {
                         noderefs.PushBack(nr,a);
                     }
                     break;
+                case 18:
+                    //Node refs, delta coded
+                    {
+                        int64_t ref = 0;
+                        for (auto delta : message.get_packed_sint64()) {
+                            ref += delta;
+                            noderefs.PushBack(ref, a);
+                        }
+                    }
+                    break;
                 case 10:
                     //Tags
-                    if (previous_key.empty()) {
-                        previous_key = message.get_string();
+                    if (tag_diff) {
+                        message.skip();
+                    } else if (previous_key.data() == nullptr) {
+                        previous_key = message.get_view();
                     } else {
-                        rapidjson::Value key(previous_key.c_str(), a);
-                        rapidjson::Value value(message.get_string(), a);
+                        rapidjson::Value key = string_value(previous_key, a);
+                        rapidjson::Value value = string_value(message.get_view(), a);
 
                         object_tags.AddMember(key, value, a);
-                        previous_key = "";
+                        previous_key = protozero::data_view{};
                     }
                     break;
                 default:
@@ -264,5 +555,275 @@ namespace osmwayback {
         if ( !object_tags.ObjectEmpty() ){
             doc->AddMember("a",object_tags, a);
         }
+        if (tag_diff) {
+            diff.add_to(*doc, a);
+        }
+        return tag_diff;
+    }
+    // Decode PBF Relation as JSON Object
+    inline bool decode_relation(const std::string& data, rapidjson::Document* doc, const bool history = false) {
+        if (is_legacy_json(data)) {
+            doc->Parse<0>(data.c_str());
+            return false;
+        }
+
+        protozero::pbf_reader message(data);
+
+        doc->SetObject();
+        rapidjson::Document::AllocatorType& a = doc->GetAllocator();
+
+        std::vector<int64_t> refs;
+        std::vector<uint32_t> types;
+        std::vector<std::string> roles;
+
+        protozero::data_view previous_key{};
+        rapidjson::Value object_tags(rapidjson::kObjectType);
+
+        bool deleted;
+        bool tag_diff = false;
+        TagDiffDecoder diff;
+        while (message.next()) {
+            switch (message.tag()) {
+                case 14:
+                    tag_diff = message.get_bool() && history;
+                    break;
+                case 15:
+                case 16:
+                case 17:
+                    if (tag_diff) {
+                        diff.field(message);
+                    } else {
+                        message.skip();
+                    }
+                    break;
+                case 1:
+                    doc->AddMember("t", message.get_fixed64(), a);
+                    break;
+                case 2:
+                    doc->AddMember("c", message.get_uint32(), a);
+                    break;
+                case 3:
+                    doc->AddMember("i", message.get_uint32(), a);
+                    break;
+                case 4:
+                    doc->AddMember("u", message.get_uint32(), a);
+                    break;
+                case 5:
+                    {
+                        rapidjson::Value handle = string_value(message.get_view(), a);
+                        doc->AddMember("h", handle, a);
+                    }
+                    break;
+                case 6:
+                    message.get_bool();
+                    break;
+                case 7:
+                    deleted = message.get_bool();
+                    if (deleted){
+                      doc->AddMember("d", deleted, a);
+                    }
+                    break;
+                case 10:
+                    //Tags
+                    if (tag_diff) {
+                        message.skip();
+                    } else if (previous_key.data() == nullptr) {
+                        previous_key = message.get_view();
+                    } else {
+                        rapidjson::Value key = string_value(previous_key, a);
+                        rapidjson::Value value = string_value(message.get_view(), a);
+
+                        object_tags.AddMember(key, value, a);
+                        previous_key = protozero::data_view{};
+                    }
+                    break;
+                case 11:
+                    for (auto ref : message.get_packed_sint64()) {
+                        refs.push_back(ref);
+                    }
+                    break;
+                case 12:
+                    for (auto type : message.get_packed_uint32()) {
+                        types.push_back(type);
+                    }
+                    break;
+                case 13:
+                    roles.push_back(message.get_string());
+                    break;
+                default:
+                    message.skip();
+            }
+        }
+
+        rapidjson::Value members(rapidjson::kArrayType);
+        for (size_t i = 0; i < refs.size() && i < types.size() && i < roles.size(); i++) {
+            rapidjson::Value member(rapidjson::kArrayType);
+            const char type_char[2] = { osmium::item_type_to_char(static_cast<osmium::item_type>(types[i])), 0 };
+            rapidjson::Value type_value(type_char, a);
+            rapidjson::Value role_value(roles[i], a);
+            member.PushBack(type_value, a);
+            member.PushBack(refs[i], a);
+            member.PushBack(role_value, a);
+            members.PushBack(member, a);
+        }
+
+        if ( !members.Empty() ){
+            doc->AddMember("m", members, a);
+        }
+
+        if ( !object_tags.ObjectEmpty() ){
+            doc->AddMember("a", object_tags, a);
+        }
+        if (tag_diff) {
+            diff.add_to(*doc, a);
+        }
+        return tag_diff;
+    }
+
+/*
+    Typed Object Decoding
+    =====================
+
+    Decodes a stored object (node, way or relation) into plain structs for code
+    that works with coordinates, node refs and members directly, such as the
+    relation geometry assembly. Nothing is converted to JSON on this path.
+    The structs are in object_version.hpp.
+*/
+
+    // Decode only the fields needed to place a version in time
+    inline void decode_meta(const std::string& data, uint64_t* timestamp, uint32_t* changeset, uint32_t* version) {
+        if (is_legacy_json(data)) {
+            rapidjson::Document doc;
+            doc.Parse<0>(data.c_str());
+            *timestamp = doc["t"].GetUint64();
+            *changeset = doc["c"].GetUint();
+            *version   = doc["i"].GetUint();
+            return;
+        }
+
+        protozero::pbf_reader message(data);
+        while (message.next()) {
+            switch (message.tag()) {
+                case 1:
+                    *timestamp = message.get_fixed64();
+                    break;
+                case 2:
+                    *changeset = message.get_uint32();
+                    break;
+                case 3:
+                    *version = message.get_uint32();
+                    break;
+                default:
+                    message.skip();
+            }
+        }
+    }
+
+    inline void decode_object(const std::string& data, ObjectVersion* object) {
+        *object = ObjectVersion{};
+
+        if (is_legacy_json(data)) {
+            rapidjson::Document doc;
+            doc.Parse<0>(data.c_str());
+            object->timestamp = doc["t"].GetUint64();
+            object->changeset = doc["c"].GetUint();
+            object->version   = doc["i"].GetUint();
+            object->uid       = doc["u"].GetUint();
+            object->user      = doc["h"].GetString();
+            object->deleted   = doc.HasMember("d") && doc["d"].GetBool();
+            if (doc.HasMember("a")) {
+                for (auto it = doc["a"].MemberBegin(); it != doc["a"].MemberEnd(); ++it) {
+                    object->tags.emplace_back(it->name.GetString(), it->value.GetString());
+                }
+            }
+            return;
+        }
+
+        protozero::pbf_reader message(data);
+
+        double lon = 0;
+        bool has_lon = false;
+        std::vector<uint32_t> types;
+        std::vector<std::string> roles;
+        std::string previous_key{};
+
+        while (message.next()) {
+            switch (message.tag()) {
+                case 1:
+                    object->timestamp = message.get_fixed64();
+                    break;
+                case 2:
+                    object->changeset = message.get_uint32();
+                    break;
+                case 3:
+                    object->version = message.get_uint32();
+                    break;
+                case 4:
+                    object->uid = message.get_uint32();
+                    break;
+                case 5:
+                    object->user = message.get_string();
+                    break;
+                case 6:
+                    object->visible = message.get_bool();
+                    break;
+                case 7:
+                    object->deleted = message.get_bool();
+                    break;
+                case 8:
+                    //Nodes store a double, ways store packed refs
+                    if (message.wire_type() == protozero::pbf_wire_type::fixed64) {
+                        lon = message.get_double();
+                        has_lon = true;
+                    } else {
+                        for (auto nr : message.get_packed_int64()) {
+                            object->nodes.push_back(nr);
+                        }
+                    }
+                    break;
+                case 18:
+                    read_delta_coded_nodes(message, &object->nodes);
+                    break;
+                case 9:
+                    if (has_lon) {
+                        object->location = osmium::Location{lon, message.get_double()};
+                    } else {
+                        message.skip();
+                    }
+                    break;
+                case 10:
+                    if (previous_key.empty()) {
+                        previous_key = message.get_string();
+                    } else {
+                        object->tags.emplace_back(previous_key, message.get_string());
+                        previous_key = "";
+                    }
+                    break;
+                case 11:
+                    for (auto ref : message.get_packed_sint64()) {
+                        object->members.push_back(Member{osmium::item_type::undefined, ref, ""});
+                    }
+                    break;
+                case 12:
+                    for (auto type : message.get_packed_uint32()) {
+                        types.push_back(type);
+                    }
+                    break;
+                case 13:
+                    roles.push_back(message.get_string());
+                    break;
+                default:
+                    message.skip();
+            }
+        }
+
+        for (size_t i = 0; i < object->members.size(); i++) {
+            if (i < types.size()) {
+                object->members[i].type = static_cast<osmium::item_type>(types[i]);
+            }
+            if (i < roles.size()) {
+                object->members[i].role = roles[i];
+            }
+        }
     }
 }
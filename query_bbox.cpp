@@ -0,0 +1,137 @@
+/*
+
+  USAGE: query_bbox <INDEX DIR> <MINLON> <MINLAT> <MAXLON> <MAXLAT> [--parents]
+
+  Lists every object that was ever inside the bounding box, using the spatial
+  column family of the rocksdb INDEX. This includes nodes that have since moved
+  away or been deleted.
+
+  Output is one object per line in the format of `osmium getid` (n123, w456, r789),
+  so the list can be used to cut a region out of a history file or to select
+  features for add_history.
+
+  With --parents, ways that ever contained one of these nodes and relations that
+  ever had one of these nodes or ways as a member are listed too. They are looked
+  up in the parents column family; an index built without it has its ways and
+  relations column families scanned instead.
+
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <unordered_set>
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+
+/*  Adds the id of every object of `osm_type` that has a version with a node ref
+ *  or member in `nodes` or `ways` to `found`, from the parents column family.
+ */
+void find_indexed_parents(ObjectStore* store, const int osm_type, const std::unordered_set<int64_t>& nodes,
+                          const std::unordered_set<int64_t>& ways, std::set<int64_t>* found) {
+    auto add = [osm_type, found](const int parent_type, const int64_t parent_id, const uint32_t, const uint32_t) {
+        if (parent_type == osm_type) {
+            found->insert(parent_id);
+        }
+    };
+    for (const int64_t id : nodes) {
+        store->for_each_parent(1, id, add);
+    }
+    for (const int64_t id : ways) {
+        store->for_each_parent(2, id, add);
+    }
+}
+
+//The same by scanning every version of `osm_type`, for indexes without parents
+void find_parents(ObjectStore* store, const int osm_type, const std::unordered_set<int64_t>& nodes,
+                  const std::unordered_set<int64_t>& ways, std::set<int64_t>* found) {
+    if (store->has_parent_index()) {
+        find_indexed_parents(store, osm_type, nodes, ways, found);
+        return;
+    }
+
+    osmwayback::ObjectVersion object;
+
+    std::unique_ptr<rocksdb::Iterator> it{store->new_iterator(osm_type)};
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        const std::string key = it->key().ToString();
+        const int64_t osm_id = std::stoll(key.substr(0, key.find('!')));
+        if (found->count(osm_id)) {
+            continue;
+        }
+
+        std::string value = it->value().ToString();
+        if (osm_type == 2 && !store->resolve_way(osm_id, static_cast<uint32_t>(std::stoul(key.substr(key.find('!') + 1))), &value).ok()) {
+            continue;
+        }
+        osmwayback::decode_object(value, &object);
+
+        for (const int64_t ref : object.nodes) {
+            if (nodes.count(ref)) {
+                found->insert(osm_id);
+                break;
+            }
+        }
+        for (const auto& member : object.members) {
+            if ((member.type == osmium::item_type::node && nodes.count(member.ref)) ||
+                (member.type == osmium::item_type::way && ways.count(member.ref))) {
+                found->insert(osm_id);
+                break;
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 6 || argc > 7 || (argc == 7 && std::strcmp(argv[6], "--parents"))) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR MINLON MINLAT MAXLON MAXLAT [--parents]" << std::endl;
+        std::exit(1);
+    }
+
+    std::string index_dir = argv[1];
+    const osmium::Box box{std::atof(argv[2]), std::atof(argv[3]), std::atof(argv[4]), std::atof(argv[5])};
+    const bool parents = (argc == 7);
+
+    ObjectStore store(index_dir, false);
+
+    if (!store.has_spatial_index()) {
+        std::cerr << "Index has no spatial column family, rebuild it with build_lookup_index" << std::endl;
+        std::exit(2);
+    }
+
+    std::set<int64_t> node_ids;
+    long location_count = 0;
+    store.for_each_location_in_box(box, [&](const int64_t node_id, const osmium::Location&) {
+        node_ids.insert(node_id);
+        location_count++;
+    });
+
+    for (const int64_t id : node_ids) {
+        std::cout << "n" << id << "\n";
+    }
+
+    std::cerr << node_ids.size() << " nodes (" << location_count << " locations) ever inside the box" << std::endl;
+
+    if (parents) {
+        const std::unordered_set<int64_t> nodes(node_ids.begin(), node_ids.end());
+
+        std::set<int64_t> way_ids;
+        find_parents(&store, 2, nodes, std::unordered_set<int64_t>{}, &way_ids);
+        for (const int64_t id : way_ids) {
+            std::cout << "w" << id << "\n";
+        }
+
+        const std::unordered_set<int64_t> ways(way_ids.begin(), way_ids.end());
+        std::set<int64_t> relation_ids;
+        find_parents(&store, 3, nodes, ways, &relation_ids);
+        for (const int64_t id : relation_ids) {
+            std::cout << "r" << id << "\n";
+        }
+
+        std::cerr << way_ids.size() << " ways, " << relation_ids.size() << " relations" << std::endl;
+    }
+}
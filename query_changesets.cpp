@@ -0,0 +1,130 @@
+/*
+
+  USAGE: query_changesets <INDEX DIR> [CHANGESET | FIRST-LAST ...]
+
+  Looks up every object version created in the given changesets (or changeset ID
+  ranges) in the changesets column family of the rocksdb INDEX. Without
+  arguments, changesets (or ranges) are read from stdin, one per line.
+
+  It outputs one JSON object per touched object version, in changeset order:
+
+  {
+    "changeset": <changeset ID>,
+    "type": "node" | "way" | "relation",
+    "id": <osm ID>,
+    "version": <version created by this changeset>,
+    "before": <previous version, or null if this changeset created the object>,
+    "after": <this version>
+  }
+
+  Versions use the same short attribute names as @history (see HISTORICAL_SCHEMA.md).
+
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+
+long entry_count = 0;
+long lookup_fail = 0;
+
+const char* type_name(const int osm_type) {
+    if (osm_type == 1) return "node";
+    if (osm_type == 2) return "way";
+    return "relation";
+}
+
+void write_changeset_entry(ObjectStore* store, const uint32_t changeset, const int osm_type, const int64_t osm_id, const uint32_t version) {
+    rapidjson::Document after;
+    if (!store->get_version_json(osm_id, osm_type, version, &after)) {
+        lookup_fail++;
+        return;
+    }
+
+    rapidjson::Document before;
+    const bool has_before = store->get_previous_version_json(osm_id, osm_type, version, &before);
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    writer.Key("changeset");
+    writer.Uint(changeset);
+    writer.Key("type");
+    writer.String(type_name(osm_type));
+    writer.Key("id");
+    writer.Int64(osm_id);
+    writer.Key("version");
+    writer.Uint(version);
+    writer.Key("before");
+    if (has_before) {
+        before.Accept(writer);
+    } else {
+        writer.Null();
+    }
+    writer.Key("after");
+    after.Accept(writer);
+    writer.EndObject();
+
+    std::cout << buffer.GetString() << "\n";
+    entry_count++;
+}
+
+void query(ObjectStore* store, const std::string& arg) {
+    const auto dash = arg.find('-');
+    const uint32_t first = static_cast<uint32_t>(std::stoul(arg.substr(0, dash)));
+    const uint32_t last = (dash == std::string::npos) ? first : static_cast<uint32_t>(std::stoul(arg.substr(dash + 1)));
+
+    store->for_each_changeset_entry(first, last, [store](const uint32_t changeset, const int osm_type, const int64_t osm_id, const uint32_t version) {
+        write_changeset_entry(store, changeset, osm_type, osm_id, version);
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [CHANGESET | FIRST-LAST ...]" << std::endl;
+        std::exit(1);
+    }
+
+    std::string index_dir = argv[1];
+
+    ObjectStore store(index_dir, false);
+
+    if (!store.has_changeset_index()) {
+        std::cerr << "Index has no changesets column family, rebuild it with build_lookup_index" << std::endl;
+        std::exit(2);
+    }
+
+    try {
+        if (argc > 2) {
+            for (int i = 2; i < argc; i++) {
+                query(&store, argv[i]);
+            }
+        } else {
+            for (std::string line; std::getline(std::cin, line);) {
+                if (!line.empty()) {
+                    query(&store, line);
+                }
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Invalid changeset: " << ex.what() << std::endl;
+        std::exit(1);
+    }
+
+    std::cerr << entry_count << " object versions found" << std::endl;
+    std::cerr << "\t" << lookup_fail << "\tLookup failures" << std::endl;
+}
@@ -0,0 +1,113 @@
+/*
+
+  USAGE: query_parents <INDEX DIR> [OBJECT ...]
+
+  Lists the ways and relations that ever had an object as a node or member, from
+  the parents column family of the rocksdb INDEX. Objects are given like osmium
+  ids: n123, w456 or r789. Without arguments, they are read from stdin, one per
+  line.
+
+  It outputs one JSON object per range of parent versions that had the object:
+
+    @type, @id: the object
+    type, id:   the parent way or relation
+    first:      the first version of the parent with the object
+    last:       the last version of the parent with the object (inclusive)
+
+  To propagate an edit of a node to its ways (or of a way to its relations),
+  only the parent versions from the range covering the edit on need a new
+  geometry.
+
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "db.hpp"
+
+long range_count = 0;
+
+const char* type_name(const int osm_type) {
+    if (osm_type == 1) return "node";
+    if (osm_type == 2) return "way";
+    return "relation";
+}
+
+void query(ObjectStore* store, const std::string& arg) {
+    int osm_type = 0;
+    if (arg.size() > 1) {
+        if (arg[0] == 'n') osm_type = 1;
+        if (arg[0] == 'w') osm_type = 2;
+        if (arg[0] == 'r') osm_type = 3;
+    }
+    if (osm_type == 0) {
+        throw std::invalid_argument{arg};
+    }
+    const int64_t osm_id = std::stoll(arg.substr(1));
+
+    store->for_each_parent(osm_type, osm_id, [osm_type, osm_id](const int parent_type, const int64_t parent_id, const uint32_t first, const uint32_t last) {
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("@type");
+        writer.String(type_name(osm_type));
+        writer.Key("@id");
+        writer.Int64(osm_id);
+        writer.Key("type");
+        writer.String(type_name(parent_type));
+        writer.Key("id");
+        writer.Int64(parent_id);
+        writer.Key("first");
+        writer.Uint(first);
+        writer.Key("last");
+        writer.Uint(last);
+        writer.EndObject();
+
+        std::cout << buffer.GetString() << "\n";
+        range_count++;
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [OBJECT ...]" << std::endl;
+        std::exit(1);
+    }
+
+    std::string index_dir = argv[1];
+
+    ObjectStore store(index_dir, false);
+
+    if (!store.has_parent_index()) {
+        std::cerr << "Index has no parents column family, rebuild it with build_lookup_index" << std::endl;
+        std::exit(2);
+    }
+
+    try {
+        if (argc > 2) {
+            for (int i = 2; i < argc; i++) {
+                query(&store, argv[i]);
+            }
+        } else {
+            for (std::string line; std::getline(std::cin, line);) {
+                if (!line.empty()) {
+                    query(&store, line);
+                }
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Invalid object (expected n123, w456 or r789): " << ex.what() << std::endl;
+        std::exit(1);
+    }
+
+    std::cerr << range_count << " parent ranges found" << std::endl;
+}
@@ -0,0 +1,118 @@
+/*
+
+  USAGE: query_user <INDEX DIR> [UID ...]
+
+  Streams the edit history of each user (by uid) from the users column family of
+  the rocksdb INDEX, which is only written by `build_lookup_index --users`. Without
+  arguments, uids are read from stdin, one per line.
+
+  It outputs one JSON object per object version the user created, in time order.
+  Each uses the short attribute names of @history (see HISTORICAL_SCHEMA.md), with
+  the tags replaced by the diff against the previous version (aA, aM, aD), plus:
+
+    @type: node, way or relation
+    @id:   osm ID
+
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+#include "tag_diff.hpp"
+
+long edit_count = 0;
+long lookup_fail = 0;
+
+const char* type_name(const int osm_type) {
+    if (osm_type == 1) return "node";
+    if (osm_type == 2) return "way";
+    return "relation";
+}
+
+void write_user_edit(ObjectStore* store, const int osm_type, const int64_t osm_id, const uint32_t version) {
+    rapidjson::Document edit;
+    if (!store->get_version_json(osm_id, osm_type, version, &edit)) {
+        lookup_fail++;
+        return;
+    }
+
+    osmwayback::VersionTags previous_tags;
+    osmwayback::VersionTags current_tags;
+
+    rapidjson::Document previous;
+    if (store->get_previous_version_json(osm_id, osm_type, version, &previous)) {
+        osmwayback::read_version_tags(previous, &previous_tags);
+    }
+    osmwayback::read_version_tags(edit, &current_tags);
+
+    edit.RemoveMember("a");
+    osmwayback::add_tag_diff(previous_tags, current_tags, edit, edit.GetAllocator());
+
+    rapidjson::Value type;
+    type.SetString(type_name(osm_type), edit.GetAllocator());
+    edit.AddMember("@type", type, edit.GetAllocator());
+    edit.AddMember("@id", osm_id, edit.GetAllocator());
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    edit.Accept(writer);
+
+    std::cout << buffer.GetString() << "\n";
+    edit_count++;
+}
+
+void query(ObjectStore* store, const std::string& arg) {
+    const uint32_t uid = static_cast<uint32_t>(std::stoul(arg));
+
+    store->for_each_user_edit(uid, [store](const uint64_t, const int osm_type, const int64_t osm_id, const uint32_t version) {
+        write_user_edit(store, osm_type, osm_id, version);
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [UID ...]" << std::endl;
+        std::exit(1);
+    }
+
+    std::string index_dir = argv[1];
+
+    ObjectStore store(index_dir, false);
+
+    if (!store.has_user_index()) {
+        std::cerr << "Index has no users column family, rebuild it with build_lookup_index --users" << std::endl;
+        std::exit(2);
+    }
+
+    try {
+        if (argc > 2) {
+            for (int i = 2; i < argc; i++) {
+                query(&store, argv[i]);
+            }
+        } else {
+            for (std::string line; std::getline(std::cin, line);) {
+                if (!line.empty()) {
+                    query(&store, line);
+                }
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Invalid uid: " << ex.what() << std::endl;
+        std::exit(1);
+    }
+
+    std::cerr << edit_count << " edits found" << std::endl;
+    std::cerr << "\t" << lookup_fail << "\tLookup failures" << std::endl;
+}
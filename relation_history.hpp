@@ -0,0 +1,266 @@
+#pragma once
+
+/*
+    Relation History Assembly
+    =========================
+
+    Rebuilds the geometry of every version of a multipolygon or boundary relation.
+
+    For each relation version, the member ways valid at that version's timestamp
+    are looked up in the index, their nodes are placed at the locations valid at
+    the same time, and the result is handed to osmium's area assembler.
+
+    Only major versions are built: member edits that happen between two relation
+    versions do not produce additional geometries.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#pragma GCC diagnostic pop
+
+#include <osmium/area/assembler.hpp>
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/geom/geojson.hpp>
+#include <osmium/memory/buffer.hpp>
+
+#include "db.hpp"
+#include "pbf_encoding.hpp"
+#include "json_encoding.hpp"
+
+namespace osmwayback {
+
+    struct RelationHistoryStats {
+        std::atomic<long> relations{0};
+        std::atomic<long> skipped_relations{0};
+        std::atomic<long> versions{0};
+        std::atomic<long> geometries{0};
+        std::atomic<long> assembly_failures{0};
+        std::atomic<long> missing_ways{0};
+        std::atomic<long> missing_nodes{0};
+    };
+
+    inline bool is_area_relation(const ObjectVersion& relation) {
+        const char* type = relation.get_tag("type");
+        return type && (!std::strcmp(type, "multipolygon") || !std::strcmp(type, "boundary"));
+    }
+
+    class RelationHistoryBuilder {
+        ObjectStore* m_store;
+        RelationHistoryStats* m_stats;
+
+        //Node histories are shared by most versions of a relation, only fetch them once
+        std::map<int64_t, std::vector<jsonencoding::NodeLocationVersion>> m_node_histories;
+
+        const std::vector<jsonencoding::NodeLocationVersion>& node_history(const int64_t node_id) {
+            auto cached = m_node_histories.find(node_id);
+            if (cached != m_node_histories.end()) {
+                return cached->second;
+            }
+
+            std::vector<jsonencoding::NodeLocationVersion>& versions = m_node_histories[node_id];
+            m_store->get_node_location_history(node_id, &versions);
+            return versions;
+        }
+
+        /*  Adds the version of a member way valid at the relation's timestamp to the
+         *  buffer, with node locations valid at that time. Returns false if the way
+         *  could not be placed.
+         */
+        bool add_member_way(const int64_t way_id, const ObjectVersion& relation, osmium::memory::Buffer& buffer) {
+            std::string rocksEntry;
+            if (!m_store->get_version_at(way_id, 2, relation.timestamp, relation.changeset, &rocksEntry).ok()) {
+                m_stats->missing_ways++;
+                return false;
+            }
+
+            ObjectVersion way;
+            decode_object(rocksEntry, &way);
+            if (way.deleted || way.nodes.empty()) {
+                m_stats->missing_ways++;
+                return false;
+            }
+
+            {
+                osmium::builder::WayBuilder builder{buffer};
+                builder.object().set_id(way_id);
+                builder.object().set_version(way.version);
+                builder.object().set_changeset(way.changeset);
+                {
+                    osmium::builder::WayNodeListBuilder wnl_builder{buffer, &builder};
+                    for (const int64_t ref : way.nodes) {
+                        const auto* node = jsonencoding::location_at(node_history(ref), relation.timestamp, relation.changeset);
+                        if (node && node->location.valid()) {
+                            wnl_builder.add_node_ref(osmium::NodeRef{ref, node->location});
+                        } else {
+                            m_stats->missing_nodes++;
+                        }
+                    }
+                }
+                {
+                    //Old-style multipolygons keep their tags on the outer way
+                    osmium::builder::TagListBuilder tl_builder{buffer, &builder};
+                    for (const auto& tag : way.tags) {
+                        tl_builder.add_tag(tag.first, tag.second);
+                    }
+                }
+            }
+            buffer.commit();
+            return true;
+        }
+
+        /*  Adds the relation with only the way members in `resolved`, in order: the
+         *  assembler pairs each member with the ways it is given by position.
+         */
+        void add_relation(const int64_t relation_id, const ObjectVersion& relation, const std::vector<const Member*>& resolved,
+                          osmium::memory::Buffer& buffer) {
+            {
+                osmium::builder::RelationBuilder builder{buffer};
+                builder.object().set_id(relation_id);
+                builder.object().set_version(relation.version);
+                builder.object().set_changeset(relation.changeset);
+                {
+                    osmium::builder::TagListBuilder tl_builder{buffer, &builder};
+                    for (const auto& tag : relation.tags) {
+                        tl_builder.add_tag(tag.first, tag.second);
+                    }
+                }
+                {
+                    osmium::builder::RelationMemberListBuilder ml_builder{buffer, &builder};
+                    for (const Member* member : resolved) {
+                        ml_builder.add_member(member->type, member->ref, member->role.c_str());
+                    }
+                }
+            }
+            buffer.commit();
+        }
+
+        void write_feature(rapidjson::Writer<rapidjson::StringBuffer>& writer, const int64_t relation_id,
+                           const ObjectVersion& relation, const ObjectVersion* next, const std::string& geometry) {
+            writer.StartObject();
+            writer.Key("type");
+            writer.String("Feature");
+            writer.Key("geometry");
+            writer.RawValue(geometry.c_str(), geometry.size(), rapidjson::kObjectType);
+            writer.Key("properties");
+            writer.StartObject();
+            writer.Key("@id");
+            writer.Int64(relation_id);
+            writer.Key("@type");
+            writer.String("relation");
+            writer.Key("@version");
+            writer.Uint(relation.version);
+            writer.Key("@minorVersion");
+            writer.Uint(0);
+            writer.Key("@changeset");
+            writer.Uint(relation.changeset);
+            writer.Key("@user");
+            writer.String(relation.user);
+            writer.Key("@uid");
+            writer.Uint(relation.uid);
+            writer.Key("@validSince");
+            writer.Uint64(relation.timestamp);
+            writer.Key("@validUntil");
+            if (next) {
+                writer.Uint64(next->timestamp);
+            } else {
+                writer.Null();
+            }
+            for (const auto& tag : relation.tags) {
+                writer.Key(tag.first);
+                writer.String(tag.second);
+            }
+            writer.EndObject();
+            writer.EndObject();
+        }
+
+    public:
+        RelationHistoryBuilder(ObjectStore* store, RelationHistoryStats* stats) :
+            m_store(store),
+            m_stats(stats) {
+        }
+
+        /*  Builds every version of one relation from its stored versions (as read
+         *  from the relations CF). Returns the features as line-delimited GeoJSON.
+         */
+        std::string build(const int64_t relation_id, const std::vector<std::string>& stored_versions) {
+            std::vector<ObjectVersion> versions(stored_versions.size());
+            for (size_t i = 0; i < stored_versions.size(); i++) {
+                decode_object(stored_versions[i], &versions[i]);
+            }
+            std::sort(versions.begin(), versions.end(), [](const ObjectVersion& lhs, const ObjectVersion& rhs) {
+                return lhs.version < rhs.version;
+            });
+
+            m_stats->relations++;
+
+            std::string out;
+            osmium::geom::GeoJSONFactory<> factory;
+            osmium::area::Assembler::config_type assembler_config;
+
+            for (size_t i = 0; i < versions.size(); i++) {
+                const ObjectVersion& relation = versions[i];
+                if (relation.deleted || !is_area_relation(relation)) {
+                    continue;
+                }
+                m_stats->versions++;
+
+                osmium::memory::Buffer ways_buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+                std::vector<const Member*> resolved_members;
+                for (const auto& member : relation.members) {
+                    if (member.type == osmium::item_type::way && add_member_way(member.ref, relation, ways_buffer)) {
+                        resolved_members.push_back(&member);
+                    }
+                }
+
+                //Collect pointers only after all ways are in, the buffer may move while growing
+                std::vector<const osmium::Way*> member_ways;
+                for (auto it = ways_buffer.begin<osmium::Way>(); it != ways_buffer.end<osmium::Way>(); ++it) {
+                    member_ways.push_back(&*it);
+                }
+
+                osmium::memory::Buffer relation_buffer{1024, osmium::memory::Buffer::auto_grow::yes};
+                add_relation(relation_id, relation, resolved_members, relation_buffer);
+                const osmium::Relation& osm_relation = relation_buffer.get<osmium::Relation>(0);
+
+                osmium::memory::Buffer area_buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+                osmium::area::Assembler assembler{assembler_config};
+                if (!assembler(osm_relation, member_ways, area_buffer)) {
+                    m_stats->assembly_failures++;
+                    continue;
+                }
+
+                const ObjectVersion* next = (i + 1 < versions.size()) ? &versions[i + 1] : nullptr;
+                for (auto it = area_buffer.begin<osmium::Area>(); it != area_buffer.end<osmium::Area>(); ++it) {
+                    try {
+                        const std::string geometry = factory.create_multipolygon(*it);
+
+                        rapidjson::StringBuffer buffer;
+                        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+                        write_feature(writer, relation_id, relation, next, geometry);
+
+                        out.append(buffer.GetString(), buffer.GetSize());
+                        out += '\n';
+                        m_stats->geometries++;
+                    } catch (const osmium::geometry_error&) {
+                        m_stats->assembly_failures++;
+                    }
+                }
+            }
+
+            if (out.empty()) {
+                m_stats->skipped_relations++;
+            }
+            return out;
+        }
+    };
+}
@@ -30,6 +30,9 @@ echo "==================================================="
 echo ""
 echo "* build_lookup_index $2_INDEX $1"
 time build/build_lookup_index $2_INDEX $1
+echo ""
+echo "* finalize_index $2_INDEX"
+time build/finalize_index $2_INDEX
 
 echo""
 echo "=============================================="
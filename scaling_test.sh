@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Builds and finalizes indexes from synthetic histories at 1x, 10x and 100x
+# (generate_history --scale) and records build time, index size and query
+# throughput.
+#
+# Usage: scaling_test.sh [BUILD DIR] [WORK DIR] [SCALES...]
+#
+# Results are appended to WORK DIR/scaling.jsonseq, one JSON object per scale,
+# with the wayback_bench output under "bench".
+
+set -e
+
+BUILD=${1:-build}
+WORK=${2:-$BUILD/scaling}
+shift 2 2>/dev/null || shift $#
+SCALES=${@:-1 10 100}
+
+mkdir -p $WORK
+RESULTS=$WORK/scaling.jsonseq
+
+for SCALE in $SCALES; do
+	HISTORY=$WORK/synthetic_${SCALE}x.osh.pbf
+	INDEX=$WORK/synthetic_${SCALE}x_INDEX
+
+	echo "== ${SCALE}x =="
+	echo "* generate_history $HISTORY --scale $SCALE"
+	$BUILD/generate_history $HISTORY --scale $SCALE
+
+	echo "* build_lookup_index $INDEX $HISTORY"
+	START=$(date +%s.%N)
+	$BUILD/build_lookup_index $INDEX $HISTORY
+	END=$(date +%s.%N)
+	BUILD_SECONDS=$(echo "$END - $START" | bc)
+
+	echo "* finalize_index $INDEX"
+	START=$(date +%s.%N)
+	$BUILD/finalize_index $INDEX
+	END=$(date +%s.%N)
+	FINALIZE_SECONDS=$(echo "$END - $START" | bc)
+
+	HISTORY_BYTES=$(du -sb $HISTORY | cut -f1)
+	INDEX_BYTES=$(du -sb $INDEX | cut -f1)
+
+	echo "* wayback_bench $HISTORY $INDEX"
+	BENCH=$($BUILD/wayback_bench $HISTORY $INDEX)
+
+	echo "{\"scale\":$SCALE,\"history_bytes\":$HISTORY_BYTES,\"build_seconds\":$BUILD_SECONDS,\"finalize_seconds\":$FINALIZE_SECONDS,\"index_bytes\":$INDEX_BYTES,\"bench\":$BENCH}" >> $RESULTS
+
+	rm -rf $INDEX
+done
+
+echo "Results in $RESULTS"
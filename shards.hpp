@@ -0,0 +1,303 @@
+#pragma once
+
+/*
+    Sharded Output
+    ==============
+
+    Splits the output of add_history and add_geometry into N independent files
+    that downstream jobs (tippecanoe, analytics) can consume in parallel.
+
+    A feature's shard is chosen by one of two keys:
+
+    - `id`: a hash of the feature's @type and @id, so every version of an
+      object always lands in the same shard and shards are evenly sized.
+    - `tile`: a hash of the quadtree tile (at SHARD_TILE_DEPTH, on the Z-order
+      curve of spatial.hpp) that holds the first coordinate of the feature's
+      geometry. All features starting in one tile share a shard. Features
+      without a geometry fall back to the id key.
+
+    Every shard has its own BlockWriter, fed by its own writer thread through a
+    bounded queue of blocks, so slow compression or a slow disk for one shard
+    does not hold up the lookups.
+
+    Shard i of OUTPUT is written to OUTPUT.i (before a trailing .gz, if any),
+    with i zero-padded to the width of the largest shard number.
+*/
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include <osmium/osm/location.hpp>
+
+#include "spatial.hpp"
+#include "stream_io.hpp"
+
+namespace osmwayback {
+
+    //Quadtree depth of the tiles used by the `tile` shard key (about 150km at the equator)
+    const int SHARD_TILE_DEPTH = 8;
+
+    enum class ShardKey {
+        id,
+        tile
+    };
+
+    inline bool parse_shard_key(const std::string& name, ShardKey* key) {
+        if (name == "id") {
+            *key = ShardKey::id;
+        } else if (name == "tile") {
+            *key = ShardKey::tile;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    inline std::string shard_filename(const std::string& filename, const size_t shard, const size_t shards) {
+        const std::string width_of = std::to_string(shards - 1);
+        std::string number = std::to_string(shard);
+        number.insert(0, width_of.size() - number.size(), '0');
+
+        if (has_gzip_suffix(filename)) {
+            return filename.substr(0, filename.size() - 3) + "." + number + ".gz";
+        }
+        return filename + "." + number;
+    }
+
+    //Finalizer of splitmix64, spreads consecutive ids and tiles over all shards
+    inline uint64_t mix_bits(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    namespace detail {
+
+        // The first [lon, lat] pair in a GeoJSON coordinates array of any nesting
+        inline bool first_coordinate(const rapidjson::Value& coordinates, osmium::Location* location) {
+            if (!coordinates.IsArray() || coordinates.Empty()) {
+                return false;
+            }
+            if (coordinates[0].IsNumber()) {
+                if (coordinates.Size() < 2 || !coordinates[1].IsNumber()) {
+                    return false;
+                }
+                *location = osmium::Location{coordinates[0].GetDouble(), coordinates[1].GetDouble()};
+                return location->valid();
+            }
+            return first_coordinate(coordinates[0], location);
+        }
+
+        inline bool geometry_location(const rapidjson::Value& geometry, osmium::Location* location) {
+            if (!geometry.IsObject()) {
+                return false;
+            }
+            const auto coordinates = geometry.FindMember("coordinates");
+            if (coordinates != geometry.MemberEnd()) {
+                return first_coordinate(coordinates->value, location);
+            }
+            //GeometryCollection
+            const auto geometries = geometry.FindMember("geometries");
+            if (geometries != geometry.MemberEnd() && geometries->value.IsArray() && !geometries->value.Empty()) {
+                return geometry_location(geometries->value[0], location);
+            }
+            return false;
+        }
+
+        inline bool feature_location(const rapidjson::Value& feature, osmium::Location* location) {
+            const auto geometry = feature.FindMember("geometry");
+            return geometry != feature.MemberEnd() && geometry_location(geometry->value, location);
+        }
+
+    }
+
+    class ShardedWriter {
+
+        struct Shard {
+            BlockWriter writer;
+            std::string block{};
+
+            std::deque<std::string> queue{};
+            bool done{false};
+            std::mutex mutex{};
+            std::condition_variable not_empty{};
+            std::condition_variable not_full{};
+            std::thread thread{};
+            std::string error{};
+
+            Shard(const std::string& filename, const bool compress, const int threads) :
+                writer(filename, compress, threads) {
+            }
+        };
+
+        ShardKey m_key;
+        std::vector<std::unique_ptr<Shard>> m_shards{};
+        const size_t m_max_queued{8};
+
+        static void run(Shard* shard) {
+            try {
+                while (true) {
+                    std::string block;
+                    {
+                        std::unique_lock<std::mutex> lock{shard->mutex};
+                        shard->not_empty.wait(lock, [shard] { return !shard->queue.empty() || shard->done; });
+                        if (shard->queue.empty()) {
+                            break;
+                        }
+                        block.swap(shard->queue.front());
+                        shard->queue.pop_front();
+                        shard->not_full.notify_one();
+                    }
+                    shard->writer.write(block.data(), block.size());
+                }
+                shard->writer.close();
+            } catch (const std::exception& ex) {
+                //Stop accepting blocks so the producer never waits on a dead shard
+                std::unique_lock<std::mutex> lock{shard->mutex};
+                shard->error = ex.what();
+                shard->done = true;
+                shard->queue.clear();
+                shard->not_full.notify_all();
+            }
+        }
+
+        void enqueue(Shard* shard) {
+            std::unique_lock<std::mutex> lock{shard->mutex};
+            shard->not_full.wait(lock, [this, shard] { return shard->queue.size() < m_max_queued || shard->done; });
+            if (!shard->done) {
+                shard->queue.push_back(std::move(shard->block));
+                shard->not_empty.notify_one();
+            }
+            shard->block.clear();
+        }
+
+    public:
+        /*  With one shard, everything goes to `filename` ("-" for stdout) from the
+         *  calling thread. With more, `filename` must name a file and the
+         *  compression threads are divided between the shards.
+         */
+        ShardedWriter(const std::string& filename, const size_t shards, const ShardKey key, const bool compress, const int threads = 0) :
+            m_key(key) {
+            if (shards == 0) {
+                throw std::runtime_error{"need at least one shard"};
+            }
+            if (shards == 1) {
+                m_shards.emplace_back(new Shard(filename, compress, threads));
+                return;
+            }
+            if (filename == "-") {
+                throw std::runtime_error{"sharded output needs an output file"};
+            }
+
+            const int total_threads = threads > 0 ? threads : static_cast<int>(std::thread::hardware_concurrency());
+            const int shard_threads = std::max(1, total_threads / static_cast<int>(shards));
+            for (size_t i = 0; i < shards; i++) {
+                m_shards.emplace_back(new Shard(shard_filename(filename, i, shards), compress, shard_threads));
+            }
+            for (auto& shard : m_shards) {
+                shard->thread = std::thread{&ShardedWriter::run, shard.get()};
+            }
+        }
+
+        ShardedWriter(const ShardedWriter&) = delete;
+        ShardedWriter& operator=(const ShardedWriter&) = delete;
+
+        ~ShardedWriter() {
+            try {
+                close();
+            } catch (...) {
+            }
+        }
+
+        size_t size() const {
+            return m_shards.size();
+        }
+
+        size_t shard(const rapidjson::Value& feature) const {
+            if (m_shards.size() == 1) {
+                return 0;
+            }
+
+            osmium::Location location;
+            if (m_key == ShardKey::tile && detail::feature_location(feature, &location)) {
+                const uint64_t tile = spatial_cell(location) >> (64 - 2 * SHARD_TILE_DEPTH);
+                return static_cast<size_t>(mix_bits(tile) % m_shards.size());
+            }
+
+            uint64_t id = 0;
+            uint64_t type = 0;
+            const auto properties = feature.FindMember("properties");
+            if (properties != feature.MemberEnd() && properties->value.IsObject()) {
+                const auto id_member = properties->value.FindMember("@id");
+                if (id_member != properties->value.MemberEnd() && id_member->value.IsInt64()) {
+                    id = static_cast<uint64_t>(id_member->value.GetInt64());
+                }
+                const auto type_member = properties->value.FindMember("@type");
+                if (type_member != properties->value.MemberEnd() && type_member->value.IsString() && type_member->value.GetStringLength() > 0) {
+                    type = static_cast<uint64_t>(type_member->value.GetString()[0]);
+                }
+            }
+            return static_cast<size_t>(mix_bits(id ^ (type << 56)) % m_shards.size());
+        }
+
+        // Writes a line and its newline to one shard
+        void write_line(const size_t shard, const char* data, const size_t size) {
+            if (m_shards.size() == 1) {
+                m_shards[0]->writer.write_line(data, size);
+                return;
+            }
+
+            Shard* s = m_shards[shard].get();
+            s->block.append(data, size);
+            s->block += '\n';
+            if (s->block.size() >= STREAM_BLOCK_SIZE) {
+                enqueue(s);
+            }
+        }
+
+        void close() {
+            if (m_shards.size() == 1) {
+                m_shards[0]->writer.close();
+                return;
+            }
+
+            for (auto& shard : m_shards) {
+                if (!shard->thread.joinable()) {
+                    continue;
+                }
+                if (!shard->block.empty()) {
+                    enqueue(shard.get());
+                }
+                {
+                    std::lock_guard<std::mutex> lock{shard->mutex};
+                    shard->done = true;
+                    shard->not_empty.notify_one();
+                }
+                shard->thread.join();
+            }
+            for (const auto& shard : m_shards) {
+                if (!shard->error.empty()) {
+                    throw std::runtime_error{shard->error};
+                }
+            }
+        }
+    };
+
+}
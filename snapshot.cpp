@@ -0,0 +1,589 @@
+/*
+
+  USAGE: snapshot <INDEX DIR> <OUTPUT> --at TIME [--at TIME ...] [--threads N]
+
+  Writes the map as it was at TIME, straight from the index instead of another
+  `osmium time-filter` pass over the history file: for every object, the
+  version valid at TIME (the latest one created at or before it), unless that
+  version deleted the object.
+
+  TIME is an ISO 8601 timestamp (2015-01-01T00:00:00Z) or seconds since the
+  epoch. Any number of times are extracted in the same scan. With more than
+  one, each time goes to its own file, named like OUTPUT with the time
+  inserted before the extension (planet.osm.pbf -> planet.20150101T000000Z.osm.pbf).
+
+  The format follows the extension of OUTPUT:
+
+  - .geojsonseq (or .geojsonseq.gz): tagged nodes as points and ways as
+    linestrings, with the node locations valid at TIME, and the @type, @id,
+    @version, @changeset, @timestamp, @uid and @user properties that
+    add_history reads. Relations are left out (see build_relation_geometries).
+  - anything else osmium writes (.osm.pbf, .osm, .opl, ...): all nodes, ways
+    and relations.
+
+  Every column family is scanned in parallel ranges (--threads N, default: all
+  cores). Objects come out grouped by type but in no particular order within
+  a type, as the index sorts ids as strings anyway; use `osmium sort` where
+  sorted input is needed.
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#pragma GCC diagnostic pop
+
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/io/any_output.hpp>
+#include <osmium/io/header.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/timestamp.hpp>
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+#include "json_encoding.hpp"
+#include "pbf_encoding.hpp"
+#include "stream_io.hpp"
+
+const size_t OUTPUT_BATCH_SIZE = 1024 * 1024; // Bytes a worker collects per snapshot before handing them to its writer
+const size_t NODE_CACHE_SIZE = 100000;        // Node histories a worker keeps for the next ways, which often share nodes
+
+struct SnapshotStats {
+    std::atomic<long> missing_nodes{0};
+    std::atomic<long> short_ways{0};
+    std::atomic<long> unreadable_ways{0};
+};
+
+SnapshotStats stats;
+
+bool is_geojsonseq(const std::string& filename) {
+    const std::string name = osmwayback::has_gzip_suffix(filename) ? filename.substr(0, filename.size() - 3) : filename;
+    const std::string suffix = ".geojsonseq";
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool parse_time(const std::string& arg, uint64_t* timestamp) {
+    if (!arg.empty() && std::all_of(arg.begin(), arg.end(), [](const char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+        *timestamp = std::stoull(arg);
+        return true;
+    }
+    try {
+        *timestamp = osmium::Timestamp{arg.c_str()}.seconds_since_epoch();
+    } catch (const std::invalid_argument&) {
+        return false;
+    }
+    return true;
+}
+
+// OUTPUT with the time inserted before the extension: out.osm.pbf -> out.20150101T000000Z.osm.pbf
+std::string snapshot_filename(const std::string& output, const uint64_t timestamp) {
+    std::string time = osmium::Timestamp{static_cast<uint32_t>(timestamp)}.to_iso();
+    time.erase(std::remove_if(time.begin(), time.end(), [](const char c) { return c == '-' || c == ':'; }), time.end());
+
+    const size_t slash = output.find_last_of('/');
+    const size_t dot = output.find('.', slash == std::string::npos ? 0 : slash + 1);
+    if (dot == std::string::npos) {
+        return output + "." + time;
+    }
+    return output.substr(0, dot) + "." + time + output.substr(dot);
+}
+
+// One point in time and the file its objects go to. Workers hand over whole batches.
+class Snapshot {
+    std::mutex m_mutex{};
+    std::unique_ptr<osmium::io::Writer> m_osm_writer{};
+    std::unique_ptr<osmwayback::BlockWriter> m_geojson_writer{};
+
+public:
+    const uint64_t timestamp;
+    const std::string filename;
+    std::atomic<long> objects[3];
+
+    Snapshot(const uint64_t time, const std::string& output, const bool geojson, const int threads) :
+        timestamp(time),
+        filename(output) {
+        for (auto& count : objects) {
+            count = 0;
+        }
+        if (geojson) {
+            m_geojson_writer.reset(new osmwayback::BlockWriter(filename, osmwayback::has_gzip_suffix(filename), threads));
+        } else {
+            osmium::io::Header header;
+            header.set("generator", "osm-wayback snapshot");
+            header.set("osmosis_replication_timestamp", osmium::Timestamp{static_cast<uint32_t>(timestamp)}.to_iso());
+            m_osm_writer.reset(new osmium::io::Writer{filename, header, osmium::io::overwrite::allow});
+        }
+    }
+
+    void write(osmium::memory::Buffer&& buffer) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        (*m_osm_writer)(std::move(buffer));
+    }
+
+    void write(const std::string& lines) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_geojson_writer->write(lines.data(), lines.size());
+    }
+
+    void close() {
+        if (m_osm_writer) {
+            m_osm_writer->close();
+        } else {
+            m_geojson_writer->close();
+        }
+    }
+};
+
+// A stored version of the object being scanned
+struct StoredVersion {
+    uint32_t version{0};
+    uint64_t timestamp{0};
+    std::string value{};
+};
+
+// The latest version created at or before `timestamp`, -1 if the object did not exist yet
+int valid_version(const std::vector<StoredVersion>& versions, const uint64_t timestamp) {
+    int valid = -1;
+    for (size_t i = 0; i < versions.size(); i++) {
+        const StoredVersion& v = versions[i];
+        if (v.timestamp > timestamp) {
+            continue;
+        }
+        if (valid < 0 || v.timestamp > versions[static_cast<size_t>(valid)].timestamp ||
+            (v.timestamp == versions[static_cast<size_t>(valid)].timestamp && v.version > versions[static_cast<size_t>(valid)].version)) {
+            valid = static_cast<int>(i);
+        }
+    }
+    return valid;
+}
+
+template <typename TBuilder>
+void set_meta(TBuilder& builder, const int64_t id, const osmwayback::ObjectVersion& object) {
+    builder.object().set_id(id);
+    builder.object().set_version(object.version);
+    builder.object().set_changeset(object.changeset);
+    builder.object().set_timestamp(osmium::Timestamp{static_cast<uint32_t>(object.timestamp)});
+    builder.object().set_uid(object.uid);
+    builder.object().set_visible(true);
+    builder.add_user(object.user);
+}
+
+template <typename TBuilder>
+void add_tags(osmium::memory::Buffer& buffer, TBuilder& builder, const osmwayback::ObjectVersion& object) {
+    osmium::builder::TagListBuilder tl_builder{buffer, &builder};
+    for (const auto& tag : object.tags) {
+        tl_builder.add_tag(tag.first, tag.second);
+    }
+}
+
+void add_osm_object(osmium::memory::Buffer& buffer, const int osm_type, const int64_t id, const osmwayback::ObjectVersion& object) {
+    if (osm_type == 1) {
+        osmium::builder::NodeBuilder builder{buffer};
+        set_meta(builder, id, object);
+        if (object.location.valid()) {
+            builder.object().set_location(object.location);
+        }
+        add_tags(buffer, builder, object);
+    } else if (osm_type == 2) {
+        osmium::builder::WayBuilder builder{buffer};
+        set_meta(builder, id, object);
+        {
+            osmium::builder::WayNodeListBuilder wnl_builder{buffer, &builder};
+            for (const int64_t ref : object.nodes) {
+                wnl_builder.add_node_ref(osmium::NodeRef{ref});
+            }
+        }
+        add_tags(buffer, builder, object);
+    } else {
+        osmium::builder::RelationBuilder builder{buffer};
+        set_meta(builder, id, object);
+        {
+            osmium::builder::RelationMemberListBuilder ml_builder{buffer, &builder};
+            for (const auto& member : object.members) {
+                ml_builder.add_member(member.type, member.ref, member.role.c_str());
+            }
+        }
+        add_tags(buffer, builder, object);
+    }
+    buffer.commit();
+}
+
+/*  Scans key ranges of one column family and writes every object to each
+ *  snapshot it is part of. Each worker thread has its own output batches,
+ *  node history cache and iterators.
+ */
+class SnapshotWorker {
+    ObjectStore* m_store;
+    std::vector<std::unique_ptr<Snapshot>>& m_snapshots;
+    bool m_geojson;
+
+    std::vector<osmium::memory::Buffer> m_buffers{};
+    std::vector<std::string> m_lines{};
+
+    rapidjson::StringBuffer m_json{};
+    rapidjson::Writer<rapidjson::StringBuffer> m_writer;
+    std::vector<osmium::Location> m_coordinates{};
+
+    std::unordered_map<int64_t, std::vector<jsonencoding::NodeLocationVersion>> m_node_histories{};
+    std::unique_ptr<rocksdb::Iterator> m_nodes{};
+
+    // Every location of a node, from the locations family or, in indexes without it, the node's versions
+    const std::vector<jsonencoding::NodeLocationVersion>& node_history(const int64_t node_id) {
+        auto cached = m_node_histories.find(node_id);
+        if (cached != m_node_histories.end()) {
+            return cached->second;
+        }
+        if (m_node_histories.size() >= NODE_CACHE_SIZE) {
+            m_node_histories.clear();
+        }
+
+        std::vector<jsonencoding::NodeLocationVersion>& versions = m_node_histories[node_id];
+        if (m_store->has_location_index()) {
+            m_store->get_node_location_history(node_id, &versions);
+            return versions;
+        }
+
+        if (!m_nodes) {
+            m_nodes.reset(m_store->new_iterator(1));
+        }
+        const std::string prefix = std::to_string(node_id) + "!";
+        for (m_nodes->Seek(prefix); m_nodes->Valid() && m_nodes->key().starts_with(prefix); m_nodes->Next()) {
+            osmwayback::ObjectVersion node;
+            osmwayback::decode_object(m_nodes->value().ToString(), &node);
+            jsonencoding::NodeLocationVersion v;
+            v.timestamp = node.timestamp;
+            v.changeset = node.changeset;
+            v.version   = node.version;
+            if (!node.deleted) {
+                v.location = node.location;
+            }
+            versions.push_back(v);
+        }
+        std::sort(versions.begin(), versions.end(), [](const jsonencoding::NodeLocationVersion& lhs, const jsonencoding::NodeLocationVersion& rhs) {
+            return lhs.timestamp < rhs.timestamp || (lhs.timestamp == rhs.timestamp && lhs.version < rhs.version);
+        });
+        return versions;
+    }
+
+    // The feature's geometry at the snapshot time: a point, or a linestring of the node locations valid then
+    bool set_coordinates(const int osm_type, const osmwayback::ObjectVersion& object, const uint64_t timestamp) {
+        m_coordinates.clear();
+        if (osm_type == 1) {
+            if (object.tags.empty() || !object.location.valid()) {
+                return false;
+            }
+            m_coordinates.push_back(object.location);
+            return true;
+        }
+
+        for (const int64_t ref : object.nodes) {
+            const auto* node = jsonencoding::location_at(node_history(ref), timestamp, object.changeset);
+            if (!node || !node->location.valid()) {
+                stats.missing_nodes++;
+                continue;
+            }
+            if (m_coordinates.empty() || m_coordinates.back() != node->location) {
+                m_coordinates.push_back(node->location);
+            }
+        }
+        if (m_coordinates.size() < 2) {
+            stats.short_ways++;
+            return false;
+        }
+        return true;
+    }
+
+    void write_location(const osmium::Location& location) {
+        m_writer.StartArray();
+        m_writer.Double(location.lon());
+        m_writer.Double(location.lat());
+        m_writer.EndArray();
+    }
+
+    bool add_feature(const size_t s, const int osm_type, const int64_t id, const osmwayback::ObjectVersion& object) {
+        if (!set_coordinates(osm_type, object, m_snapshots[s]->timestamp)) {
+            return false;
+        }
+
+        m_json.Clear();
+        m_writer.Reset(m_json);
+        m_writer.StartObject();
+        m_writer.Key("type");
+        m_writer.String("Feature");
+        m_writer.Key("geometry");
+        m_writer.StartObject();
+        m_writer.Key("type");
+        if (osm_type == 1) {
+            m_writer.String("Point");
+            m_writer.Key("coordinates");
+            write_location(m_coordinates.front());
+        } else {
+            m_writer.String("LineString");
+            m_writer.Key("coordinates");
+            m_writer.StartArray();
+            for (const auto& location : m_coordinates) {
+                write_location(location);
+            }
+            m_writer.EndArray();
+        }
+        m_writer.EndObject();
+        m_writer.Key("properties");
+        m_writer.StartObject();
+        m_writer.Key("@type");
+        m_writer.String(osm_type == 1 ? "node" : "way");
+        m_writer.Key("@id");
+        m_writer.Int64(id);
+        m_writer.Key("@version");
+        m_writer.Uint(object.version);
+        m_writer.Key("@changeset");
+        m_writer.Uint(object.changeset);
+        m_writer.Key("@timestamp");
+        m_writer.Uint64(object.timestamp);
+        m_writer.Key("@uid");
+        m_writer.Uint(object.uid);
+        m_writer.Key("@user");
+        m_writer.String(object.user);
+        for (const auto& tag : object.tags) {
+            m_writer.Key(tag.first);
+            m_writer.String(tag.second);
+        }
+        m_writer.EndObject();
+        m_writer.EndObject();
+
+        m_lines[s].append(m_json.GetString(), m_json.GetSize());
+        m_lines[s] += '\n';
+        return true;
+    }
+
+    void write(const size_t s, const int osm_type, const int64_t id, const osmwayback::ObjectVersion& object) {
+        if (m_geojson) {
+            if (!add_feature(s, osm_type, id, object)) {
+                return;
+            }
+        } else {
+            add_osm_object(m_buffers[s], osm_type, id, object);
+        }
+        m_snapshots[s]->objects[osm_type - 1]++;
+
+        if (m_geojson ? m_lines[s].size() >= OUTPUT_BATCH_SIZE : m_buffers[s].committed() >= OUTPUT_BATCH_SIZE) {
+            flush(s);
+        }
+    }
+
+    void flush(const size_t s) {
+        if (m_geojson) {
+            if (!m_lines[s].empty()) {
+                m_snapshots[s]->write(m_lines[s]);
+                m_lines[s].clear();
+            }
+        } else if (m_buffers[s].committed() > 0) {
+            m_snapshots[s]->write(std::move(m_buffers[s]));
+            m_buffers[s] = osmium::memory::Buffer{OUTPUT_BATCH_SIZE, osmium::memory::Buffer::auto_grow::yes};
+        }
+    }
+
+    // Writes the valid version of one object to every snapshot it exists in
+    void object(const int osm_type, const int64_t id, std::vector<StoredVersion>& versions) {
+        //Oldest first, so way edit scripts are rebuilt from the version before them
+        std::sort(versions.begin(), versions.end(), [](const StoredVersion& lhs, const StoredVersion& rhs) {
+            return lhs.version < rhs.version;
+        });
+
+        std::vector<osmwayback::ObjectVersion> decoded(versions.size());
+        std::vector<char> state(versions.size(), 0); // 0: not decoded yet, 1: decoded, -1: unreadable
+        for (size_t s = 0; s < m_snapshots.size(); s++) {
+            const int valid = valid_version(versions, m_snapshots[s]->timestamp);
+            if (valid < 0) {
+                continue;
+            }
+            const size_t v = static_cast<size_t>(valid);
+            if (state[v] == 0) {
+                if (osm_type == 2 && !m_store->resolve_way(id, versions[v].version, &versions[v].value).ok()) {
+                    stats.unreadable_ways++;
+                    state[v] = -1;
+                    continue;
+                }
+                osmwayback::decode_object(versions[v].value, &decoded[v]);
+                state[v] = 1;
+            }
+            if (state[v] < 0 || decoded[v].deleted || !decoded[v].visible) {
+                continue;
+            }
+            write(s, osm_type, id, decoded[v]);
+        }
+    }
+
+public:
+    SnapshotWorker(ObjectStore* store, std::vector<std::unique_ptr<Snapshot>>& snapshots, const bool geojson) :
+        m_store(store),
+        m_snapshots(snapshots),
+        m_geojson(geojson),
+        m_writer(m_json) {
+        for (size_t s = 0; s < snapshots.size(); s++) {
+            if (geojson) {
+                m_lines.emplace_back();
+                m_lines.back().reserve(OUTPUT_BATCH_SIZE + 64 * 1024);
+            } else {
+                m_buffers.emplace_back(OUTPUT_BATCH_SIZE, osmium::memory::Buffer::auto_grow::yes);
+            }
+        }
+    }
+
+    // Scans the keys in [begin, end) of one object family, "" for an open end
+    void scan(const int osm_type, const std::string& begin, const std::string& end) {
+        std::unique_ptr<rocksdb::Iterator> it{m_store->new_iterator(osm_type)};
+
+        std::string current_id;
+        std::vector<StoredVersion> versions;
+        for (begin.empty() ? it->SeekToFirst() : it->Seek(begin); it->Valid(); it->Next()) {
+            if (!end.empty() && it->key().compare(end) >= 0) {
+                break;
+            }
+            const std::string key = it->key().ToString();
+            const size_t bang = key.find('!');
+            if (bang == std::string::npos) {
+                continue;
+            }
+
+            //All versions of an object are next to each other
+            if (key.compare(0, bang, current_id) != 0) {
+                if (!versions.empty()) {
+                    object(osm_type, std::stoll(current_id), versions);
+                    versions.clear();
+                }
+                current_id = key.substr(0, bang);
+            }
+
+            versions.emplace_back();
+            StoredVersion& stored = versions.back();
+            stored.version = static_cast<uint32_t>(std::stoul(key.substr(bang + 1)));
+            stored.value = it->value().ToString();
+            uint32_t changeset{0};
+            uint32_t version{0};
+            osmwayback::decode_meta(stored.value, &stored.timestamp, &changeset, &version);
+        }
+        if (!versions.empty()) {
+            object(osm_type, std::stoll(current_id), versions);
+        }
+    }
+
+    void flush() {
+        for (size_t s = 0; s < m_snapshots.size(); s++) {
+            flush(s);
+        }
+    }
+};
+
+void snapshot_family(ObjectStore* store, const std::string& family, const int osm_type, const size_t threads,
+                     std::vector<std::unique_ptr<Snapshot>>& snapshots, const bool geojson) {
+    const std::vector<std::string> boundaries = store->range_boundaries(family, threads * 4, true);
+    const size_t ranges = boundaries.size() + 1;
+
+    std::atomic<size_t> next_range{0};
+    auto worker = [&]() {
+        SnapshotWorker scanner{store, snapshots, geojson};
+        for (size_t r = next_range++; r < ranges; r = next_range++) {
+            const std::string begin = r == 0 ? "" : boundaries[r - 1];
+            const std::string end = r + 1 == ranges ? "" : boundaries[r];
+            scanner.scan(osm_type, begin, end);
+        }
+        scanner.flush();
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min(threads, ranges); t++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR OUTPUT --at TIME [--at TIME]... [--threads N]" << std::endl;
+        std::exit(1);
+    }
+
+    const std::string index_dir = argv[1];
+    const std::string output = argv[2];
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint64_t> times;
+
+    for (int i = 3; i < argc; i++) {
+        const std::string option = argv[i];
+        if (i + 1 < argc && option == "--at") {
+            uint64_t time{0};
+            if (!parse_time(argv[++i], &time)) {
+                std::cerr << "Invalid time: " << argv[i] << std::endl;
+                std::exit(1);
+            }
+            times.push_back(time);
+        } else if (i + 1 < argc && option == "--threads") {
+            threads = std::max(1ul, std::stoul(argv[++i]));
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            std::exit(1);
+        }
+    }
+    if (times.empty()) {
+        std::cerr << "At least one --at TIME is needed" << std::endl;
+        std::exit(1);
+    }
+    //In time order, so each object's way versions are rebuilt oldest first
+    std::sort(times.begin(), times.end());
+    times.erase(std::unique(times.begin(), times.end()), times.end());
+
+    ObjectStore store(index_dir, false);
+
+    const bool geojson = is_geojsonseq(output);
+    std::vector<std::unique_ptr<Snapshot>> snapshots;
+    for (const uint64_t time : times) {
+        const std::string filename = times.size() == 1 ? output : snapshot_filename(output, time);
+        const int writer_threads = std::max(1, static_cast<int>(threads / times.size()));
+        snapshots.emplace_back(new Snapshot(time, filename, geojson, writer_threads));
+    }
+
+    const std::vector<std::pair<std::string, int>> families{{"nodes", 1}, {"ways", 2}, {"relations", 3}};
+    for (const auto& family : families) {
+        if (geojson && family.second == 3) {
+            continue;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        snapshot_family(&store, family.first, family.second, threads, snapshots, geojson);
+        const auto diff = std::chrono::steady_clock::now() - start;
+        std::cerr << "Extracted " << family.first << " in " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+    }
+
+    for (auto& snapshot : snapshots) {
+        snapshot->close();
+        std::cerr << snapshot->filename << ": " << snapshot->objects[0] << " nodes, " << snapshot->objects[1] << " ways, "
+                  << snapshot->objects[2] << " relations" << std::endl;
+    }
+    if (geojson) {
+        std::cerr << "\t" << stats.missing_nodes << "\tWay nodes without a location at snapshot time" << std::endl;
+        std::cerr << "\t" << stats.short_ways << "\tWays left out with fewer than two locations" << std::endl;
+    }
+    if (stats.unreadable_ways > 0) {
+        std::cerr << "\t" << stats.unreadable_ways << "\tWay versions whose edit script could not be rebuilt" << std::endl;
+    }
+}
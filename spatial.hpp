@@ -0,0 +1,143 @@
+#pragma once
+
+/*
+    Spatial Keys
+    ============
+
+    Every location a node ever had is stored in the `spatial` column family under
+    a key of <cell><node id>, both as big-endian 8 byte integers, with an empty value.
+
+    The cell is the location's position on a Z-order (quadkey) curve at full
+    coordinate precision: the x and y coordinates (osmium's 1e-7 degree integers,
+    shifted to be unsigned) are bit-interleaved. Because the curve keeps nearby
+    points close together, a bounding box becomes a handful of key ranges:
+    the box is covered with quadtree cells (cover_box) and each cell is one
+    contiguous range of keys.
+*/
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+
+#include "keys.hpp"
+
+namespace osmwayback {
+
+    //Quadtree depth used when covering a box; deeper covers are tighter but need more seeks
+    const int SPATIAL_COVER_DEPTH = 16;
+
+    typedef std::pair<uint64_t, uint64_t> CellRange; // [first, last], inclusive
+
+    inline uint64_t spread_bits(uint32_t v) {
+        uint64_t x = v;
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+        x = (x | (x << 8))  & 0x00FF00FF00FF00FFULL;
+        x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0FULL;
+        x = (x | (x << 2))  & 0x3333333333333333ULL;
+        x = (x | (x << 1))  & 0x5555555555555555ULL;
+        return x;
+    }
+
+    inline uint32_t compact_bits(uint64_t x) {
+        x &= 0x5555555555555555ULL;
+        x = (x | (x >> 1))  & 0x3333333333333333ULL;
+        x = (x | (x >> 2))  & 0x0F0F0F0F0F0F0F0FULL;
+        x = (x | (x >> 4))  & 0x00FF00FF00FF00FFULL;
+        x = (x | (x >> 8))  & 0x0000FFFF0000FFFFULL;
+        x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+        return static_cast<uint32_t>(x);
+    }
+
+    inline uint32_t unsigned_x(const int32_t x) {
+        return static_cast<uint32_t>(static_cast<int64_t>(x) + 1800000000LL);
+    }
+
+    inline uint32_t unsigned_y(const int32_t y) {
+        return static_cast<uint32_t>(static_cast<int64_t>(y) + 900000000LL);
+    }
+
+    inline uint64_t spatial_cell(const osmium::Location& location) {
+        return spread_bits(unsigned_x(location.x())) | (spread_bits(unsigned_y(location.y())) << 1);
+    }
+
+    inline osmium::Location cell_location(const uint64_t cell) {
+        const int32_t x = static_cast<int32_t>(static_cast<int64_t>(compact_bits(cell)) - 1800000000LL);
+        const int32_t y = static_cast<int32_t>(static_cast<int64_t>(compact_bits(cell >> 1)) - 900000000LL);
+        return osmium::Location{x, y};
+    }
+
+    inline std::string make_spatial_key(const osmium::Location& location, const int64_t node_id) {
+        std::string key;
+        key.reserve(16);
+        append_big_endian(key, spatial_cell(location));
+        append_big_endian(key, static_cast<uint64_t>(node_id));
+        return key;
+    }
+
+    inline std::string make_spatial_bound(const uint64_t cell) {
+        std::string key;
+        key.reserve(8);
+        append_big_endian(key, cell);
+        return key;
+    }
+
+    inline void parse_spatial_key(const char* data, osmium::Location* location, int64_t* node_id) {
+        *location = cell_location(read_big_endian(data));
+        *node_id = static_cast<int64_t>(read_big_endian(data + 8));
+    }
+
+    namespace detail {
+
+        // Quadtree cell at `depth` with index `prefix` (the top 2*depth bits of the curve)
+        inline void cover_cell(const uint32_t min_x, const uint32_t min_y, const uint32_t max_x, const uint32_t max_y,
+                        const uint64_t prefix, const int depth, const int max_depth, std::vector<CellRange>* ranges) {
+            const int shift = 32 - depth;
+            const uint64_t x = compact_bits(prefix);
+            const uint64_t y = compact_bits(prefix >> 1);
+            const uint64_t cell_min_x = x << shift;
+            const uint64_t cell_min_y = y << shift;
+            const uint64_t cell_max_x = cell_min_x + ((1ULL << shift) - 1);
+            const uint64_t cell_max_y = cell_min_y + ((1ULL << shift) - 1);
+
+            if (cell_min_x > max_x || cell_max_x < min_x || cell_min_y > max_y || cell_max_y < min_y) {
+                return;
+            }
+
+            const bool inside = cell_min_x >= min_x && cell_max_x <= max_x && cell_min_y >= min_y && cell_max_y <= max_y;
+            if (inside || depth == max_depth) {
+                const int curve_shift = 64 - 2 * depth;
+                const uint64_t first = (curve_shift == 64) ? 0 : (prefix << curve_shift);
+                const uint64_t last = (curve_shift == 64) ? ~0ULL : (first | ((1ULL << curve_shift) - 1));
+
+                //Neighbouring cells on the curve merge into one range
+                if (!ranges->empty() && ranges->back().second + 1 == first) {
+                    ranges->back().second = last;
+                } else {
+                    ranges->push_back(CellRange{first, last});
+                }
+                return;
+            }
+
+            for (uint64_t child = 0; child < 4; child++) {
+                cover_cell(min_x, min_y, max_x, max_y, (prefix << 2) | child, depth + 1, max_depth, ranges);
+            }
+        }
+
+    }
+
+    /*  Covers a box with ranges of cells, in curve order. Cells at the edge of the
+     *  box may extend past it, so callers filter the locations they read back.
+     */
+    inline std::vector<CellRange> cover_box(const osmium::Box& box, const int max_depth = SPATIAL_COVER_DEPTH) {
+        std::vector<CellRange> ranges;
+        detail::cover_cell(unsigned_x(box.bottom_left().x()), unsigned_y(box.bottom_left().y()),
+                           unsigned_x(box.top_right().x()), unsigned_y(box.top_right().y()),
+                           0, 0, max_depth, &ranges);
+        return ranges;
+    }
+
+}
@@ -0,0 +1,358 @@
+#pragma once
+
+/*
+    Stream I/O
+    ==========
+
+    Line-based input and block-based output for the GeoJSON sequence tools,
+    with optional gzip compression.
+
+    LineReader reads a file (or stdin for "-"), detects gzip input by its magic
+    bytes and decompresses it on a separate thread, so inflating overlaps with
+    processing. Concatenated gzip members (as written by BlockWriter or pigz)
+    are read as one stream.
+
+    BlockWriter collects output in large blocks and never flushes per line.
+    With compression, every block is deflated on a thread pool into its own
+    gzip member; members are written in order and together form a valid gzip
+    file that any gunzip can read.
+*/
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <zlib.h>
+
+#include <osmium/thread/pool.hpp>
+
+namespace osmwayback {
+
+    const size_t STREAM_BLOCK_SIZE = 1024 * 1024;
+
+    inline bool has_gzip_suffix(const std::string& filename) {
+        return filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".gz") == 0;
+    }
+
+    class LineReader {
+        std::FILE* m_file;
+        bool m_close;
+
+        //Decompressed chunks handed from the reader thread to getline()
+        std::deque<std::string> m_chunks;
+        bool m_done{false};
+        bool m_stop{false};
+        std::string m_error{};
+        std::mutex m_mutex;
+        std::condition_variable m_not_empty;
+        std::condition_variable m_not_full;
+        const size_t m_max_chunks{16};
+
+        std::string m_current{};
+        size_t m_position{0};
+
+        std::thread m_thread;
+
+        // False once the reader is being destroyed and the thread should stop
+        bool push(std::string&& chunk) {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_not_full.wait(lock, [this] { return m_chunks.size() < m_max_chunks || m_stop; });
+            if (m_stop) {
+                return false;
+            }
+            m_chunks.push_back(std::move(chunk));
+            m_not_empty.notify_one();
+            return true;
+        }
+
+        void finish(const std::string& error) {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_done = true;
+            m_error = error;
+            m_not_empty.notify_one();
+        }
+
+        void read_plain(std::string&& first) {
+            if (!push(std::move(first))) {
+                return;
+            }
+            std::string chunk(STREAM_BLOCK_SIZE, '\0');
+            size_t n;
+            while ((n = std::fread(&chunk[0], 1, chunk.size(), m_file)) > 0) {
+                chunk.resize(n);
+                if (!push(std::move(chunk))) {
+                    return;
+                }
+                chunk.assign(STREAM_BLOCK_SIZE, '\0');
+            }
+        }
+
+        void read_gzip(std::string&& first) {
+            z_stream stream;
+            std::memset(&stream, 0, sizeof(stream));
+            if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+                throw std::runtime_error{"inflateInit2 failed"};
+            }
+
+            std::string input = std::move(first);
+            std::string output(STREAM_BLOCK_SIZE, '\0');
+            bool in_member = false; //Input was given to a gzip member that hasn't ended yet
+
+            while (!input.empty()) {
+                stream.next_in = reinterpret_cast<Bytef*>(&input[0]);
+                stream.avail_in = static_cast<uInt>(input.size());
+
+                //Keep going while inflate() still holds output for a full buffer
+                do {
+                    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                    stream.avail_out = static_cast<uInt>(output.size());
+                    if (stream.avail_in > 0) {
+                        in_member = true;
+                    }
+
+                    const int result = inflate(&stream, Z_NO_FLUSH);
+                    if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+                        inflateEnd(&stream);
+                        throw std::runtime_error{"invalid gzip input"};
+                    }
+
+                    const size_t produced = output.size() - stream.avail_out;
+                    if (produced > 0 && !push(output.substr(0, produced))) {
+                        inflateEnd(&stream);
+                        return;
+                    }
+
+                    //The next gzip member starts right after this one
+                    if (result == Z_STREAM_END) {
+                        inflateReset(&stream);
+                        in_member = false;
+                    } else if (result == Z_BUF_ERROR && produced == 0) {
+                        break;
+                    }
+                } while (stream.avail_in > 0 || stream.avail_out == 0);
+
+                input.assign(STREAM_BLOCK_SIZE, '\0');
+                input.resize(std::fread(&input[0], 1, input.size(), m_file));
+            }
+            inflateEnd(&stream);
+
+            //The lines read so far are incomplete, don't pass them off as the whole input
+            if (in_member) {
+                throw std::runtime_error{"truncated gzip input"};
+            }
+        }
+
+        void run() {
+            try {
+                std::string first(STREAM_BLOCK_SIZE, '\0');
+                first.resize(std::fread(&first[0], 1, first.size(), m_file));
+
+                if (first.size() >= 2 && static_cast<unsigned char>(first[0]) == 0x1f && static_cast<unsigned char>(first[1]) == 0x8b) {
+                    read_gzip(std::move(first));
+                } else {
+                    read_plain(std::move(first));
+                }
+                finish("");
+            } catch (const std::exception& ex) {
+                finish(ex.what());
+            }
+        }
+
+        bool next_chunk() {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_not_empty.wait(lock, [this] { return !m_chunks.empty() || m_done; });
+            if (m_chunks.empty()) {
+                if (!m_error.empty()) {
+                    throw std::runtime_error{m_error};
+                }
+                return false;
+            }
+            m_current = std::move(m_chunks.front());
+            m_chunks.pop_front();
+            m_position = 0;
+            m_not_full.notify_one();
+            return true;
+        }
+
+    public:
+        // "-" reads stdin
+        explicit LineReader(const std::string& filename) :
+            m_file(filename == "-" ? stdin : std::fopen(filename.c_str(), "rb")),
+            m_close(filename != "-") {
+            if (!m_file) {
+                throw std::runtime_error{"could not open " + filename};
+            }
+            m_thread = std::thread{&LineReader::run, this};
+        }
+
+        LineReader(const LineReader&) = delete;
+        LineReader& operator=(const LineReader&) = delete;
+
+        ~LineReader() {
+            {
+                //Unblock the reader thread if we stop early
+                std::lock_guard<std::mutex> lock{m_mutex};
+                m_stop = true;
+                m_not_full.notify_all();
+            }
+            m_thread.join();
+            if (m_close) {
+                std::fclose(m_file);
+            }
+        }
+
+        // Like std::getline: false at the end of the input
+        bool getline(std::string& line) {
+            line.clear();
+            while (true) {
+                if (m_position >= m_current.size() && !next_chunk()) {
+                    return !line.empty();
+                }
+                const size_t end = m_current.find('\n', m_position);
+                if (end == std::string::npos) {
+                    line.append(m_current, m_position, std::string::npos);
+                    m_position = m_current.size();
+                } else {
+                    line.append(m_current, m_position, end - m_position);
+                    m_position = end + 1;
+                    return true;
+                }
+            }
+        }
+    };
+
+    class BlockWriter {
+        std::FILE* m_file;
+        bool m_close;
+        bool m_compress;
+        int m_level;
+
+        std::string m_block{};
+
+        osmium::thread::Pool m_pool;
+        std::deque<std::future<std::string>> m_pending{};
+        size_t m_max_pending;
+
+        static std::string gzip_block(const std::string& block, const int level) {
+            z_stream stream;
+            std::memset(&stream, 0, sizeof(stream));
+            if (deflateInit2(&stream, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error{"deflateInit2 failed"};
+            }
+
+            std::string output(deflateBound(&stream, static_cast<uLong>(block.size())), '\0');
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+            stream.avail_in = static_cast<uInt>(block.size());
+            stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+            stream.avail_out = static_cast<uInt>(output.size());
+
+            const int result = deflate(&stream, Z_FINISH);
+            deflateEnd(&stream);
+            if (result != Z_STREAM_END) {
+                throw std::runtime_error{"deflate failed"};
+            }
+            output.resize(stream.total_out);
+            return output;
+        }
+
+        void write_raw(const std::string& data) {
+            if (std::fwrite(data.data(), 1, data.size(), m_file) != data.size()) {
+                throw std::runtime_error{"write failed"};
+            }
+        }
+
+        void submit_block() {
+            if (m_block.empty()) {
+                return;
+            }
+            if (!m_compress) {
+                write_raw(m_block);
+                m_block.clear();
+                return;
+            }
+
+            std::string block;
+            block.swap(m_block);
+            const int level = m_level;
+            m_pending.push_back(m_pool.submit([block, level] {
+                return gzip_block(block, level);
+            }));
+
+            //Write finished blocks in order
+            while (m_pending.size() > m_max_pending) {
+                write_raw(m_pending.front().get());
+                m_pending.pop_front();
+            }
+        }
+
+    public:
+        /*  "-" writes to stdout. `compress` writes gzip, deflating blocks on
+         *  `threads` threads.
+         */
+        BlockWriter(const std::string& filename, const bool compress, const int threads = 0, const int level = Z_DEFAULT_COMPRESSION) :
+            m_file(filename == "-" ? stdout : std::fopen(filename.c_str(), "wb")),
+            m_close(filename != "-"),
+            m_compress(compress),
+            m_level(level),
+            m_pool(compress ? threads : 1),
+            m_max_pending(static_cast<size_t>(m_pool.num_threads()) * 4) {
+            if (!m_file) {
+                throw std::runtime_error{"could not open " + filename};
+            }
+            m_block.reserve(STREAM_BLOCK_SIZE + 64 * 1024);
+        }
+
+        BlockWriter(const BlockWriter&) = delete;
+        BlockWriter& operator=(const BlockWriter&) = delete;
+
+        ~BlockWriter() {
+            try {
+                close();
+            } catch (...) {
+            }
+        }
+
+        void write(const char* data, const size_t size) {
+            m_block.append(data, size);
+            if (m_block.size() >= STREAM_BLOCK_SIZE) {
+                submit_block();
+            }
+        }
+
+        // Writes a line and its newline
+        void write_line(const char* data, const size_t size) {
+            write(data, size);
+            m_block += '\n';
+            if (m_block.size() >= STREAM_BLOCK_SIZE) {
+                submit_block();
+            }
+        }
+
+        void write_line(const std::string& line) {
+            write_line(line.data(), line.size());
+        }
+
+        void close() {
+            if (!m_file) {
+                return;
+            }
+            submit_block();
+            while (!m_pending.empty()) {
+                write_raw(m_pending.front().get());
+                m_pending.pop_front();
+            }
+            std::fflush(m_file);
+            if (m_close) {
+                std::fclose(m_file);
+            }
+            m_file = nullptr;
+        }
+    };
+
+}
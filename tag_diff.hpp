@@ -0,0 +1,124 @@
+#pragma once
+
+/*
+    Tag Diffs
+    =========
+
+    Records how the tags changed from one version of an object to the next
+    (see HISTORICAL_SCHEMA.md):
+
+    aA = attributes added;     { key: value }
+    aM = attributes modified;  { key: [previous value, new value] }
+    aD = attributes deleted;   { key: previous value }
+
+    Keys and values are copied into the document's allocator, so the tag maps
+    can go out of scope before the document is written.
+*/
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+namespace osmwayback {
+
+    typedef std::map<std::string,std::string> StringStringMap;
+    typedef std::map<std::string,std::string> VersionTags;
+    typedef std::vector < std::map<std::string, std::string> > TagHistoryArray;
+
+    //https://stackoverflow.com/questions/8473009/how-to-efficiently-compare-two-maps-of-strings-in-c
+    template <typename Map>
+    bool map_compare (Map const &lhs, Map const &rhs) {
+        // No predicate needed because there is operator== for pairs already.
+        return lhs.size() == rhs.size()
+            && std::equal(lhs.begin(), lhs.end(),
+                          rhs.begin());
+    }
+
+    //Read the "a" object of a decoded version into a map
+    inline void read_version_tags(const rapidjson::Value& doc, VersionTags* version_tags) {
+        version_tags->clear();
+        if (!doc.HasMember("a")) {
+            return;
+        }
+        for (rapidjson::Value::ConstMemberIterator it= doc["a"].MemberBegin(); it != doc["a"].MemberEnd(); it++){
+            version_tags->insert( std::make_pair( it->name.GetString(), it->value.GetString() ) );
+        }
+    }
+
+    /*  Adds aA, aM and aD to `doc` for the change from `previous` to `current`.
+     *  Nothing is added if the tags are exactly the same.
+     */
+    template <typename TAllocator>
+    void add_tag_diff(const VersionTags& previous, const VersionTags& current, rapidjson::Value& doc, TAllocator& allocator) {
+        //Check if they are exactly the same:
+        if ( map_compare( previous, current ) ){
+            return;
+        }
+
+        //There has been one of 3 changes:
+        //1. New tags
+        //2. Mod tags
+        //3. Del tags
+
+        //Trying to wrap this all into ONE iteration.
+        StringStringMap::const_iterator pos;
+
+        rapidjson::Value mod_tags(rapidjson::kObjectType);
+        rapidjson::Value new_tags(rapidjson::kObjectType);
+
+        for (pos = current.begin(); pos != current.end(); ++pos) {
+
+            //First, check if the current key exists in the previous entry:
+            StringStringMap::const_iterator search = previous.find(pos->first);
+
+            if (search == previous.end()) {
+                //Not found, so it's a new tag
+                rapidjson::Value new_key(pos->first, allocator);
+                rapidjson::Value new_val(pos->second, allocator);
+                new_tags.AddMember(new_key, new_val, allocator);
+
+            }else {
+                //It exists, check if it's the same, if not, it's a modified tag
+                if( pos->second != search->second) {
+                    rapidjson::Value prev_val(search->second, allocator);
+
+                    rapidjson::Value new_val(pos->second, allocator);
+                    rapidjson::Value key(pos->first, allocator);
+
+                    rapidjson::Value modified_tag(rapidjson::kArrayType);
+                    modified_tag.PushBack(prev_val, allocator);
+                    modified_tag.PushBack(new_val, allocator);
+                    mod_tags.AddMember(key, modified_tag, allocator);
+                }
+            }
+        }
+        //If we have modified or new tags, add them
+        if(mod_tags.ObjectEmpty()==false){
+            doc.AddMember("aM", mod_tags, allocator);
+        }
+        if(new_tags.ObjectEmpty()==false){
+            doc.AddMember("aA", new_tags, allocator);
+        }
+
+        //Iterate over previous tags, check if any of them don't exist in this version (DEL)
+        rapidjson::Value del_tags(rapidjson::kObjectType);
+        for (pos = previous.begin(); pos != previous.end(); ++pos) {
+            if (current.count(pos->first) == 0){
+              rapidjson::Value del_key(pos->first, allocator);
+              rapidjson::Value del_val(pos->second, allocator);
+              del_tags.AddMember(del_key, del_val, allocator);
+            }
+        }
+
+        if (del_tags.ObjectEmpty() == false){
+            doc.AddMember("aD", del_tags, allocator);
+        }
+    }
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+/*
+    Tag Filters
+    ===========
+
+    `build_lookup_index --tag-config FILE` keeps only some tags of every
+    version, read from the same kind of JSON config osmium export uses (see
+    example/osmiumconfig); all other settings in it are ignored:
+
+        {
+            "include_tags": [],
+            "exclude_tags": ["created_by", "source", "source:*", "tiger:*"]
+        }
+
+    A pattern is a key (`note`), a key prefix (`tiger:*`) or a tag
+    (`natural=coastline`). If include_tags is not empty, only matching tags are
+    kept; matching exclude_tags are dropped in any case. Filtered tags are
+    never encoded, so they are also left out of tag diffs.
+
+    With `--collapse-versions`, a version whose kept tags, geometry (location,
+    node list or members) and visibility are the same as those of the version
+    stored before it is not stored at all, so versions that only touched
+    filtered tags disappear from the history. Readers already expect gaps in
+    the version numbers.
+
+    The filter is recorded in the index under `wayback:tag_filter`, and
+    update_index applies it (and collapsing) to new versions as well.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "object_version.hpp"
+
+namespace osmwayback {
+
+    class TagFilter {
+        std::vector<std::string> m_include{};
+        std::vector<std::string> m_exclude{};
+
+        static bool matches(const std::string& pattern, const char* key, const char* value) {
+            const size_t equals = pattern.find('=');
+            if (equals != std::string::npos) {
+                return pattern.compare(0, equals, key) == 0 && pattern.compare(equals + 1, std::string::npos, value) == 0;
+            }
+            if (!pattern.empty() && pattern.back() == '*') {
+                return std::strncmp(key, pattern.data(), pattern.size() - 1) == 0;
+            }
+            return pattern == key;
+        }
+
+        static bool matches_any(const std::vector<std::string>& patterns, const char* key, const char* value) {
+            for (const auto& pattern : patterns) {
+                if (matches(pattern, key, value)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        void include(const std::string& pattern) {
+            m_include.push_back(pattern);
+        }
+
+        void exclude(const std::string& pattern) {
+            m_exclude.push_back(pattern);
+        }
+
+        const std::vector<std::string>& includes() const {
+            return m_include;
+        }
+
+        const std::vector<std::string>& excludes() const {
+            return m_exclude;
+        }
+
+        bool empty() const {
+            return m_include.empty() && m_exclude.empty();
+        }
+
+        bool keep(const char* key, const char* value) const {
+            return (m_include.empty() || matches_any(m_include, key, value)) && !matches_any(m_exclude, key, value);
+        }
+    };
+
+    // nullptr keeps every tag
+    inline bool keep_tag(const TagFilter* filter, const osmium::Tag& tag) {
+        return !filter || filter->keep(tag.key(), tag.value());
+    }
+
+    // Adds the include_tags and exclude_tags of a JSON config to the filter, false if they are not lists of strings
+    inline bool parse_tag_filter(const std::string& json, TagFilter* filter) {
+        rapidjson::Document doc;
+        if (doc.Parse(json.c_str()).HasParseError() || !doc.IsObject()) {
+            return false;
+        }
+        const char* lists[2] = {"include_tags", "exclude_tags"};
+        for (int l = 0; l < 2; l++) {
+            const auto list = doc.FindMember(lists[l]);
+            if (list == doc.MemberEnd()) {
+                continue;
+            }
+            if (!list->value.IsArray()) {
+                return false;
+            }
+            for (const auto& pattern : list->value.GetArray()) {
+                if (!pattern.IsString() || pattern.GetStringLength() == 0) {
+                    return false;
+                }
+                if (l == 0) {
+                    filter->include(pattern.GetString());
+                } else {
+                    filter->exclude(pattern.GetString());
+                }
+            }
+        }
+        return true;
+    }
+
+    // The filter as a JSON config, as recorded in the index
+    inline std::string format_tag_filter(const TagFilter& filter) {
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("include_tags");
+        writer.StartArray();
+        for (const auto& pattern : filter.includes()) {
+            writer.String(pattern);
+        }
+        writer.EndArray();
+        writer.Key("exclude_tags");
+        writer.StartArray();
+        for (const auto& pattern : filter.excludes()) {
+            writer.String(pattern);
+        }
+        writer.EndArray();
+        writer.EndObject();
+        return std::string(buffer.GetString(), buffer.GetSize());
+    }
+
+    /*  What --collapse-versions compares: visibility, geometry and the kept
+     *  tags (sorted) of an object, in the struct decode_object fills.
+     */
+    inline void object_content(const osmium::OSMObject& object, const TagFilter* filter, ObjectVersion* content) {
+        *content = ObjectVersion{};
+        content->deleted = object.deleted();
+        if (object.type() == osmium::item_type::node) {
+            if (!object.deleted()) {
+                content->location = static_cast<const osmium::Node&>(object).location();
+            }
+        } else if (object.type() == osmium::item_type::way) {
+            for (const osmium::NodeRef& nr : static_cast<const osmium::Way&>(object).nodes()) {
+                content->nodes.push_back(nr.ref());
+            }
+        } else {
+            for (const osmium::RelationMember& member : static_cast<const osmium::Relation&>(object).members()) {
+                content->members.push_back(Member{member.type(), member.ref(), member.role()});
+            }
+        }
+        for (const osmium::Tag& tag : object.tags()) {
+            if (keep_tag(filter, tag)) {
+                content->tags.emplace_back(tag.key(), tag.value());
+            }
+        }
+        std::sort(content->tags.begin(), content->tags.end());
+    }
+
+    // True if two versions differ in nothing object_content compares; tags must be sorted
+    inline bool same_content(const ObjectVersion& lhs, const ObjectVersion& rhs) {
+        if (lhs.deleted != rhs.deleted || lhs.location != rhs.location || lhs.nodes != rhs.nodes ||
+            lhs.tags != rhs.tags || lhs.members.size() != rhs.members.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < lhs.members.size(); i++) {
+            if (lhs.members[i].type != rhs.members[i].type || lhs.members[i].ref != rhs.members[i].ref ||
+                lhs.members[i].role != rhs.members[i].role) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+}
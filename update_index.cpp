@@ -0,0 +1,224 @@
+/*
+
+  USAGE: update_index <INDEX DIR> <OSM CHANGE FILE> [<OSM CHANGE FILE> ...] [OPTIONS]
+
+  Applies OSM change files (.osc, .osc.gz, or any format osmium reads) to an
+  index built by build_lookup_index, instead of rebuilding it from a new full
+  history file. Every created, modified and deleted object version in the
+  changes is added to the index with the same records a build writes: the
+  object itself, its node locations and any optional column families the index
+  has (spatial, changesets, users, parents, tag diffs). The tag filter and version
+  collapsing of the build (see tag_filter.hpp) apply to the changes too.
+
+  Node versions are merged into their locations entry with the merge operator
+  of location_merge.hpp, so adding one does not read the entry back.
+
+  OPTIONS:
+    --state FILE    the replication state.txt of the last change file; its
+                    sequenceNumber and timestamp are recorded in the index
+    --sequence N    record sequence number N instead
+
+  The recorded sequence number is kept under `wayback:replication_sequence` in
+  the default column family. Change files at or below it have been applied
+  already and are refused, so a daily job can simply be rerun:
+
+    update_index INDEX_DIR 2465.osc.gz --state 2465.state.txt
+
+  Updates are written as new table files; run finalize_index again from time
+  to time to keep lookups at their fastest.
+
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <osmium/handler.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/object_pointer_collection.hpp>
+#include <osmium/osm/object_comparisons.hpp>
+#include <osmium/visitor.hpp>
+
+#include "db.hpp"
+
+class UpdateHandler : public osmium::handler::Handler {
+    ObjectStore* m_store;
+    const osmium::OSMObject* m_last{nullptr};
+
+    //Overlapping change files repeat versions, which arrive next to each other once sorted
+    bool duplicate(const osmium::OSMObject& object) {
+        const bool same = m_last && m_last->type() == object.type() && m_last->id() == object.id() && m_last->version() == object.version();
+        m_last = &object;
+        return same;
+    }
+
+public:
+    explicit UpdateHandler(ObjectStore* store) : m_store(store) {}
+
+    void node(const osmium::Node& node) {
+        if (duplicate(node) || m_store->collapses(node)) {
+            return;
+        }
+        m_store->store_pbf_node(node);
+        if (m_store->has_location_index()) {
+            m_store->upsert_node_location(node);
+        }
+        if (m_store->has_spatial_index()) {
+            m_store->store_spatial_location(node);
+        }
+        object(node);
+    }
+
+    void way(const osmium::Way& way) {
+        if (duplicate(way) || m_store->collapses(way)) {
+            return;
+        }
+        m_store->store_pbf_way(way);
+        if (m_store->has_parent_index()) {
+            m_store->store_parent_entries(way);
+        }
+        object(way);
+    }
+
+    void relation(const osmium::Relation& relation) {
+        if (duplicate(relation) || m_store->collapses(relation)) {
+            return;
+        }
+        m_store->store_pbf_relation(relation);
+        if (m_store->has_parent_index()) {
+            m_store->store_parent_entries(relation);
+        }
+        object(relation);
+    }
+
+private:
+    void object(const osmium::OSMObject& object) {
+        if (m_store->has_changeset_index()) {
+            m_store->store_changeset_entry(object);
+        }
+        if (m_store->has_user_index()) {
+            m_store->store_user_entry(object);
+        }
+    }
+};
+
+// Reads sequenceNumber and timestamp from a replication state.txt
+bool read_state(const std::string& filename, std::string* sequence, std::string* timestamp) {
+    std::ifstream state{filename};
+    if (!state) {
+        return false;
+    }
+    for (std::string line; std::getline(state, line);) {
+        const auto equals = line.find('=');
+        if (equals == std::string::npos) {
+            continue;
+        }
+        const std::string key = line.substr(0, equals);
+        std::string value = line.substr(equals + 1);
+        //Java properties escape the colons of the timestamp
+        value.erase(std::remove(value.begin(), value.end(), '\\'), value.end());
+        if (key == "sequenceNumber") {
+            *sequence = value;
+        } else if (key == "timestamp") {
+            *timestamp = value;
+        }
+    }
+    return !sequence->empty();
+}
+
+// Sequence numbers are non-negative and fit into an int64_t
+bool is_sequence(const std::string& sequence) {
+    return !sequence.empty() && sequence.size() <= 18 &&
+           std::all_of(sequence.begin(), sequence.end(), [](const char c) { return c >= '0' && c <= '9'; });
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR OSM_CHANGE_FILE... [--state STATE_FILE | --sequence N]" << std::endl;
+        std::exit(1);
+    }
+
+    const std::string index_dir = argv[1];
+    std::vector<std::string> change_files;
+    std::string sequence;
+    std::string timestamp;
+
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (i + 1 < argc && option == "--state") {
+            if (!read_state(argv[++i], &sequence, &timestamp)) {
+                std::cerr << "Could not read a sequenceNumber from " << argv[i] << std::endl;
+                std::exit(1);
+            }
+        } else if (i + 1 < argc && option == "--sequence") {
+            sequence = argv[++i];
+        } else if (option.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option: " << option << std::endl;
+            std::exit(1);
+        } else {
+            change_files.push_back(option);
+        }
+    }
+
+    if (change_files.empty()) {
+        std::cerr << "No change files given" << std::endl;
+        std::exit(1);
+    }
+    if (!sequence.empty() && !is_sequence(sequence)) {
+        std::cerr << "Invalid sequence number: " << sequence << std::endl;
+        std::exit(1);
+    }
+
+    ObjectStore store(index_dir, OpenMode::update);
+
+    std::string applied_sequence;
+    if (!sequence.empty() && store.get_metadata(REPLICATION_SEQUENCE_KEY, &applied_sequence) && is_sequence(applied_sequence) &&
+        std::stoll(sequence) <= std::stoll(applied_sequence)) {
+        std::cerr << "Sequence " << sequence << " is already applied (index is at " << applied_sequence << ")" << std::endl;
+        std::exit(4);
+    }
+
+    //Change files are not ordered like a history file: sort all versions by type, id and version
+    std::vector<osmium::memory::Buffer> buffers;
+    osmium::ObjectPointerCollection objects;
+    for (const auto& filename : change_files) {
+        osmium::io::Reader reader{filename, osmium::osm_entity_bits::node | osmium::osm_entity_bits::way | osmium::osm_entity_bits::relation};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            osmium::apply(buffer, objects);
+            buffers.push_back(std::move(buffer));
+        }
+        reader.close();
+    }
+    objects.sort(osmium::object_order_type_id_version());
+
+    const auto start = std::chrono::steady_clock::now();
+
+    UpdateHandler handler(&store);
+    osmium::apply(objects.begin(), objects.end(), handler);
+
+    //Only record the sequence once every change is written
+    if (!sequence.empty()) {
+        store.put_metadata(REPLICATION_SEQUENCE_KEY, sequence);
+    }
+    if (!timestamp.empty()) {
+        store.put_metadata(REPLICATION_TIMESTAMP_KEY, timestamp);
+    }
+    store.flush();
+
+    const auto diff = std::chrono::steady_clock::now() - start;
+    std::cerr << "Applied " << store.stored_nodes_count << " node, " << store.stored_ways_count << " way and "
+              << store.stored_relations_count << " relation versions in "
+              << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+    if (store.collapsed_versions_count > 0) {
+        std::cerr << "Collapsed " << store.collapsed_versions_count << " versions without changes to kept tags or geometry" << std::endl;
+    }
+    if (!sequence.empty()) {
+        std::cerr << "Index is at sequence " << sequence << std::endl;
+    }
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+/*
+    Way Node Deltas
+    ===============
+
+    Most edits to a way touch a few nodes at one place, yet every version
+    stores its whole node list. Built with `--way-deltas`, the ways column
+    family stores the node lists of a way's history as snapshots and edits:
+
+    - A snapshot (field 18) is the full node list, delta coded: each ref is
+      stored as the zigzag varint difference to the ref before it, so runs of
+      nearby node ids take one or two bytes each instead of up to ten.
+    - Between snapshots, a version stores an edit script against the version
+      stored before it (field 19, always the first field of the record):
+      the length of the node prefix and suffix it shares with that version,
+      and the delta coded nodes that replace everything in between.
+
+    Every K-th version of a way (the snapshot interval) is a snapshot again, so
+    rebuilding any version reads at most K records. ObjectStore::resolve_way
+    does the rebuilding; readers never see an edit script.
+
+    Field 19 is an embedded message:
+    1. Base version (the version the script applies to)
+    2. Depth (number of edit scripts back to the last snapshot, 1 to K-1)
+    3. Edit script (packed sint64): prefix length, suffix length, new nodes
+*/
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <protozero/pbf_reader.hpp>
+#include <protozero/pbf_writer.hpp>
+
+namespace osmwayback {
+
+    const uint32_t DEFAULT_WAY_SNAPSHOT_INTERVAL = 16;
+
+    // How encode_way stores the node list of a way built with --way-deltas
+    struct WayNodeEncoding {
+        const std::vector<int64_t>* base_nodes{nullptr}; // Write an edit script against these, nullptr for a snapshot
+        uint32_t base_version{0};
+        uint32_t depth{0};
+    };
+
+    inline void add_delta_coded_nodes(protozero::pbf_writer& encoder, const protozero::pbf_tag_type tag,
+                                      std::vector<int64_t>::const_iterator first, std::vector<int64_t>::const_iterator last) {
+        std::vector<int64_t> deltas;
+        deltas.reserve(static_cast<size_t>(last - first));
+        int64_t previous = 0;
+        for (auto it = first; it != last; ++it) {
+            deltas.push_back(*it - previous);
+            previous = *it;
+        }
+        encoder.add_packed_sint64(tag, deltas.begin(), deltas.end());
+    }
+
+    inline void read_delta_coded_nodes(protozero::pbf_reader& message, std::vector<int64_t>* nodes) {
+        int64_t ref = 0;
+        for (auto delta : message.get_packed_sint64()) {
+            ref += delta;
+            nodes->push_back(ref);
+        }
+    }
+
+    //Shortest single-range edit that turns `base` into `nodes`
+    inline std::vector<int64_t> node_edit_script(const std::vector<int64_t>& base, const std::vector<int64_t>& nodes) {
+        size_t prefix = 0;
+        while (prefix < base.size() && prefix < nodes.size() && base[prefix] == nodes[prefix]) {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < base.size() - prefix && suffix < nodes.size() - prefix &&
+               base[base.size() - 1 - suffix] == nodes[nodes.size() - 1 - suffix]) {
+            suffix++;
+        }
+
+        std::vector<int64_t> script{static_cast<int64_t>(prefix), static_cast<int64_t>(suffix)};
+        int64_t previous = 0;
+        for (size_t i = prefix; i < nodes.size() - suffix; i++) {
+            script.push_back(nodes[i] - previous);
+            previous = nodes[i];
+        }
+        return script;
+    }
+
+    // Applies an edit script to the node list of its base version, false if it does not fit
+    inline bool apply_node_edit_script(const std::vector<int64_t>& script, std::vector<int64_t>* nodes) {
+        if (script.size() < 2 || script[0] < 0 || script[1] < 0) {
+            return false;
+        }
+        const size_t prefix = static_cast<size_t>(script[0]);
+        const size_t suffix = static_cast<size_t>(script[1]);
+        if (prefix + suffix > nodes->size()) {
+            return false;
+        }
+
+        std::vector<int64_t> result(nodes->begin(), nodes->begin() + static_cast<std::ptrdiff_t>(prefix));
+        int64_t ref = 0;
+        for (size_t i = 2; i < script.size(); i++) {
+            ref += script[i];
+            result.push_back(ref);
+        }
+        result.insert(result.end(), nodes->end() - static_cast<std::ptrdiff_t>(suffix), nodes->end());
+        nodes->swap(result);
+        return true;
+    }
+
+    //Key of field 19 (length delimited) as the first bytes of a record
+    inline bool is_way_delta(const std::string& data) {
+        return data.size() >= 2 && static_cast<uint8_t>(data[0]) == 0x9a && static_cast<uint8_t>(data[1]) == 0x01;
+    }
+
+    struct WayDelta {
+        uint32_t base_version{0};
+        uint32_t depth{0};
+        std::vector<int64_t> script{};
+        size_t remainder{0}; // Offset of the fields after field 19
+    };
+
+    inline bool read_way_delta(const std::string& data, WayDelta* delta) {
+        if (!is_way_delta(data)) {
+            return false;
+        }
+        protozero::pbf_reader message(data);
+        if (!message.next()) {
+            return false;
+        }
+        const protozero::data_view view = message.get_view();
+        delta->remainder = static_cast<size_t>(view.data() + view.size() - data.data());
+
+        protozero::pbf_reader fields(view);
+        while (fields.next()) {
+            switch (fields.tag()) {
+                case 1:
+                    delta->base_version = fields.get_uint32();
+                    break;
+                case 2:
+                    delta->depth = fields.get_uint32();
+                    break;
+                case 3:
+                    for (auto value : fields.get_packed_sint64()) {
+                        delta->script.push_back(value);
+                    }
+                    break;
+                default:
+                    fields.skip();
+            }
+        }
+        return true;
+    }
+
+    // The node list of a full way record, stored as a snapshot (18) or plain refs (8)
+    inline void read_way_nodes(const std::string& data, std::vector<int64_t>* nodes) {
+        protozero::pbf_reader message(data);
+        while (message.next()) {
+            switch (message.tag()) {
+                case 8:
+                    for (auto ref : message.get_packed_int64()) {
+                        nodes->push_back(ref);
+                    }
+                    break;
+                case 18:
+                    read_delta_coded_nodes(message, nodes);
+                    break;
+                default:
+                    message.skip();
+            }
+        }
+    }
+
+    //A full record for a resolved edit script: its rebuilt nodes as a snapshot, then all other fields
+    inline std::string rebuild_way_record(const std::string& data, const WayDelta& delta, const std::vector<int64_t>& nodes) {
+        std::string record;
+        {
+            protozero::pbf_writer encoder(record);
+            add_delta_coded_nodes(encoder, 18, nodes.begin(), nodes.end());
+        }
+        record.append(data, delta.remainder, std::string::npos);
+        return record;
+    }
+
+}
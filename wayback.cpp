@@ -0,0 +1,203 @@
+/*
+
+  libwayback: the typed query API of wayback.hpp on top of ObjectStore.
+
+*/
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "rocksdb/db.h"
+
+#include "wayback.hpp"
+#include "db.hpp"
+#include "pbf_encoding.hpp"
+#include "json_encoding.hpp"
+
+namespace osmwayback {
+
+    namespace {
+
+        int osm_type(const osmium::item_type type) {
+            if (type == osmium::item_type::node) return 1;
+            if (type == osmium::item_type::way) return 2;
+            return 3;
+        }
+
+        void sort_by_version(std::vector<ObjectVersion>* versions) {
+            std::sort(versions->begin(), versions->end(), [](const ObjectVersion& lhs, const ObjectVersion& rhs) {
+                return lhs.version < rhs.version;
+            });
+        }
+
+        // Stored records of one object by version, as read from its family
+        using StoredVersions = std::vector<std::pair<uint32_t, std::string>>;
+
+        void add_stored_version(const rocksdb::Iterator* it, StoredVersions* stored) {
+            const std::string key = it->key().ToString();
+            stored->emplace_back(static_cast<uint32_t>(std::stoul(key.substr(key.find('!') + 1))), it->value().ToString());
+        }
+
+        /*  Decodes stored records oldest first, so way edit scripts (see
+         *  way_delta.hpp) are rebuilt from the version just before them
+         */
+        void decode_versions(ObjectStore* store, const int type, const int64_t id, StoredVersions* stored, std::vector<ObjectVersion>* versions) {
+            std::sort(stored->begin(), stored->end(), [](const StoredVersions::value_type& lhs, const StoredVersions::value_type& rhs) {
+                return lhs.first < rhs.first;
+            });
+            for (auto& value : *stored) {
+                if (type == 2 && !store->resolve_way(id, value.first, &value.second).ok()) {
+                    continue;
+                }
+                versions->emplace_back();
+                decode_object(value.second, &versions->back());
+            }
+            sort_by_version(versions);
+        }
+
+        // All versions of one object, using an iterator the caller can reuse
+        void read_versions(ObjectStore* store, const int type, rocksdb::Iterator* it, const int64_t id, std::vector<ObjectVersion>* versions) {
+            const std::string prefix = std::to_string(id) + "!";
+            StoredVersions stored;
+            for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+                add_stored_version(it, &stored);
+            }
+            decode_versions(store, type, id, &stored, versions);
+        }
+
+        void add_location_history(const std::vector<jsonencoding::NodeLocationVersion>& history, std::vector<ObjectVersion>* versions) {
+            for (const auto& entry : history) {
+                versions->emplace_back();
+                ObjectVersion& version = versions->back();
+                version.timestamp = entry.timestamp;
+                version.changeset = entry.changeset;
+                version.version   = entry.version;
+                version.uid       = entry.uid;
+                version.user      = entry.user;
+                version.location  = entry.location;
+                version.deleted   = !entry.location.valid();
+                version.visible   = !version.deleted;
+            }
+        }
+
+    }
+
+    Index::Index(const std::string& index_dir, const std::size_t block_cache_mb) :
+        m_store(new ObjectStore(index_dir, false, block_cache_mb)) {
+    }
+
+    Index::~Index() = default;
+
+    std::vector<ObjectVersion> Index::versions(const osmium::item_type type, const int64_t id) const {
+        std::vector<ObjectVersion> result;
+        std::unique_ptr<rocksdb::Iterator> it{m_store->new_iterator(osm_type(type))};
+        read_versions(m_store.get(), osm_type(type), it.get(), id, &result);
+        return result;
+    }
+
+    bool Index::version(const osmium::item_type type, const int64_t id, const uint32_t version, ObjectVersion* object) const {
+        std::string value;
+        if (!m_store->get_tags(id, osm_type(type), static_cast<int>(version), &value).ok()) {
+            return false;
+        }
+        decode_object(value, object);
+        return true;
+    }
+
+    bool Index::version_at(const osmium::item_type type, const int64_t id, const uint64_t timestamp, ObjectVersion* object) const {
+        std::string value;
+        if (!m_store->get_version_at(id, osm_type(type), timestamp, 0, &value).ok()) {
+            return false;
+        }
+        decode_object(value, object);
+        return true;
+    }
+
+    std::vector<std::vector<ObjectVersion>> Index::versions(const osmium::item_type type, const std::vector<int64_t>& ids) const {
+        std::vector<std::vector<ObjectVersion>> result(ids.size());
+        std::unique_ptr<rocksdb::Iterator> it{m_store->new_iterator(osm_type(type))};
+        for (std::size_t i = 0; i < ids.size(); i++) {
+            read_versions(m_store.get(), osm_type(type), it.get(), ids[i], &result[i]);
+        }
+        return result;
+    }
+
+    void Index::for_each_object(const osmium::item_type type, const int64_t first_id, const int64_t last_id,
+                                const std::function<void(int64_t, const std::vector<ObjectVersion>&)>& func) const {
+        std::vector<ObjectVersion> versions;
+        StoredVersions stored;
+        int64_t current_id = 0;
+        bool has_current = false;
+
+        std::unique_ptr<rocksdb::Iterator> it{m_store->new_iterator(osm_type(type))};
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            const std::string key = it->key().ToString();
+            const int64_t id = std::stoll(key.substr(0, key.find('!')));
+            if (id < first_id || id > last_id) {
+                continue;
+            }
+
+            //All versions of an object are next to each other
+            if (has_current && id != current_id) {
+                decode_versions(m_store.get(), osm_type(type), current_id, &stored, &versions);
+                func(current_id, versions);
+                versions.clear();
+                stored.clear();
+            }
+            current_id = id;
+            has_current = true;
+
+            add_stored_version(it.get(), &stored);
+        }
+
+        if (has_current) {
+            decode_versions(m_store.get(), osm_type(type), current_id, &stored, &versions);
+            func(current_id, versions);
+        }
+    }
+
+    std::vector<ObjectVersion> Index::node_locations(const int64_t node_id) const {
+        std::vector<ObjectVersion> result;
+        std::vector<jsonencoding::NodeLocationVersion> history;
+        if (m_store->get_node_location_history(node_id, &history)) {
+            add_location_history(history, &result);
+        }
+        return result;
+    }
+
+    std::vector<std::vector<ObjectVersion>> Index::node_locations(const std::vector<int64_t>& node_ids) const {
+        //Offset reads, there is nothing to batch
+        if (m_store->has_node_location_store()) {
+            std::vector<std::vector<ObjectVersion>> result(node_ids.size());
+            std::vector<jsonencoding::NodeLocationVersion> history;
+            for (std::size_t i = 0; i < node_ids.size(); i++) {
+                if (m_store->get_node_location_history(node_ids[i], &history)) {
+                    add_location_history(history, &result[i]);
+                }
+            }
+            return result;
+        }
+
+        std::vector<std::string> keys;
+        keys.reserve(node_ids.size());
+        for (const int64_t id : node_ids) {
+            keys.push_back(std::to_string(id));
+        }
+
+        std::vector<std::string> values;
+        const auto statuses = m_store->get_node_locations(keys, &values);
+
+        std::vector<std::vector<ObjectVersion>> result(node_ids.size());
+        std::vector<jsonencoding::NodeLocationVersion> history;
+        for (std::size_t i = 0; i < node_ids.size(); i++) {
+            if (statuses[i].ok() && jsonencoding::decode_location_history(values[i], &history)) {
+                add_location_history(history, &result[i]);
+            }
+        }
+        return result;
+    }
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+    libwayback
+    ==========
+
+    In-process access to an index built by build_lookup_index, for services
+    that want history without spawning the command line tools or parsing JSON.
+
+        osmwayback::Index index{"/data/wayback-index"};
+        for (const auto& version : index.versions(osmium::item_type::way, 123)) {
+            ...
+        }
+
+    An Index is opened read-only and every method is const and safe to call from
+    several threads at once. Versions are returned in version order as the
+    plain structs of object_version.hpp. Node location histories use the same
+    struct, with only the metadata and `location` filled in (an invalid location
+    means the node was deleted), in time order.
+
+    Link against the `wayback` library target.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <osmium/osm/item_type.hpp>
+
+#include "object_version.hpp"
+
+class ObjectStore;
+
+namespace osmwayback {
+
+    class Index {
+        std::unique_ptr<ObjectStore> m_store;
+
+    public:
+        // block_cache_mb: size of the shared LRU block cache, 0 for DEFAULT_BLOCK_CACHE_MB (db.hpp)
+        explicit Index(const std::string& index_dir, std::size_t block_cache_mb = 0);
+        ~Index();
+
+        Index(const Index&) = delete;
+        Index& operator=(const Index&) = delete;
+
+        // Every stored version of an object, empty if it is not in the index
+        std::vector<ObjectVersion> versions(osmium::item_type type, int64_t id) const;
+
+        // One version of an object, false if it is not in the index
+        bool version(osmium::item_type type, int64_t id, uint32_t version, ObjectVersion* object) const;
+
+        // The version that was current at `timestamp` (seconds since the epoch)
+        bool version_at(osmium::item_type type, int64_t id, uint64_t timestamp, ObjectVersion* object) const;
+
+        // Batch variant of versions(), one entry per id in the same order
+        std::vector<std::vector<ObjectVersion>> versions(osmium::item_type type, const std::vector<int64_t>& ids) const;
+
+        /*  Calls func(id, versions) for every object of `type` with first_id <= id <= last_id.
+         *  Objects are visited in the order of the index keys, which sort ids as
+         *  strings, so this is a scan over the whole column family.
+         */
+        void for_each_object(osmium::item_type type, int64_t first_id, int64_t last_id,
+                             const std::function<void(int64_t, const std::vector<ObjectVersion>&)>& func) const;
+
+        // Every location a node ever had, empty if the node is not in the index
+        std::vector<ObjectVersion> node_locations(int64_t node_id) const;
+
+        // Batch variant of node_locations(), one entry per id in the same order
+        std::vector<std::vector<ObjectVersion>> node_locations(const std::vector<int64_t>& node_ids) const;
+    };
+
+}
@@ -0,0 +1,313 @@
+/*
+
+  USAGE: wayback_bench <OSM HISTORY FILE> <INDEX DIR> [SCRATCH DIR]
+
+  Measures the hot paths of the index build and the enrichment tools against an
+  index built from the same history file, e.g. the albany example:
+
+    build_lookup_index albany-index example/history_of_albany.osh.pbf
+    wayback_bench example/history_of_albany.osh.pbf albany-index > bench.json
+
+  upsert_node_location writes to a scratch index (SCRATCH DIR, default
+  <INDEX DIR>.bench), which is deleted afterwards.
+
+  Output is one JSON object that can be compared between commits:
+
+  {
+    "benchmarks": [
+      {
+        "name": "encode_node",
+        "ops": <number of operations>,
+        "ns_per_op": <wall time per operation>,
+        "allocs_per_op": <heap allocations per operation>,
+        "bytes_per_record": <size of the record produced, or null>
+      },
+      ...
+    ]
+  }
+
+  Allocations are counted by replacing malloc on glibc (which also catches
+  rapidjson and rocksdb) and operator new elsewhere.
+
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include <osmium/io/any_input.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+#include "enrich.hpp"
+#include "pbf_encoding.hpp"
+
+std::atomic<unsigned long> allocation_count{0};
+
+#if defined(__GLIBC__)
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void __libc_free(void* ptr);
+
+    void* malloc(size_t size) {
+        allocation_count++;
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size) {
+        allocation_count++;
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* ptr, size_t size) {
+        allocation_count++;
+        return __libc_realloc(ptr, size);
+    }
+
+    void free(void* ptr) {
+        __libc_free(ptr);
+    }
+}
+#else
+void* operator new(std::size_t size) {
+    allocation_count++;
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+#endif
+
+struct BenchResult {
+    std::string name;
+    unsigned long ops;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_record; // < 0 if the benchmark produces no record
+};
+
+std::vector<BenchResult> results;
+
+/*  Runs func(i) for i in [0, ops) and records the time and allocations per call.
+ *  func returns the size of the record it produced.
+ */
+template <typename TFunc>
+void measure(const std::string& name, const unsigned long ops, TFunc&& func, const bool has_records = true) {
+    if (ops == 0) {
+        std::cerr << "Skipping " << name << ", no input" << std::endl;
+        return;
+    }
+
+    unsigned long bytes = 0;
+    const unsigned long allocations_before = allocation_count.load();
+    const auto start = std::chrono::steady_clock::now();
+
+    for (unsigned long i = 0; i < ops; i++) {
+        bytes += func(i);
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    const unsigned long allocations = allocation_count.load() - allocations_before;
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    results.push_back(BenchResult{name, ops, ns / ops, static_cast<double>(allocations) / ops,
+                                  has_records ? static_cast<double>(bytes) / ops : -1.0});
+    std::cerr << name << ": " << ops << " ops, " << (ns / ops) << " ns/op" << std::endl;
+}
+
+void write_results() {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+
+    writer.StartObject();
+    writer.Key("benchmarks");
+    writer.StartArray();
+    for (const auto& result : results) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(result.name);
+        writer.Key("ops");
+        writer.Uint64(result.ops);
+        writer.Key("ns_per_op");
+        writer.Double(result.ns_per_op);
+        writer.Key("allocs_per_op");
+        writer.Double(result.allocs_per_op);
+        writer.Key("bytes_per_record");
+        if (result.bytes_per_record < 0) {
+            writer.Null();
+        } else {
+            writer.Double(result.bytes_per_record);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+
+    std::cout << buffer.GetString() << std::endl;
+}
+
+std::string serialize(const rapidjson::Document& doc) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    doc.Accept(writer);
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+// A feature as add_history expects it, for the latest version of a way
+void make_way_feature(const osmium::Way& way, rapidjson::Document* doc) {
+    doc->SetObject();
+    rapidjson::Document::AllocatorType& a = doc->GetAllocator();
+    rapidjson::Value properties(rapidjson::kObjectType);
+    rapidjson::Value type;
+    type.SetString("way", a);
+    properties.AddMember("@type", type, a);
+    properties.AddMember("@id", static_cast<int64_t>(way.id()), a);
+    properties.AddMember("@version", static_cast<int>(way.version()), a);
+    rapidjson::Value feature;
+    feature.SetString("Feature", a);
+    doc->AddMember("type", feature, a);
+    doc->AddMember("properties", properties, a);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " OSMFILE INDEX_DIR [SCRATCH_DIR]" << std::endl;
+        std::exit(1);
+    }
+
+    const std::string osm_filename = argv[1];
+    const std::string index_dir = argv[2];
+    const std::string scratch_dir = (argc > 3) ? argv[3] : index_dir + ".bench";
+
+    //Load every node and way into memory so that reading the file isn't measured
+    osmium::memory::Buffer objects{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    {
+        osmium::io::Reader reader{osm_filename, osmium::osm_entity_bits::node | osmium::osm_entity_bits::way};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            for (const auto& item : buffer) {
+                objects.add_item(item);
+                objects.commit();
+            }
+        }
+        reader.close();
+    }
+
+    std::vector<const osmium::Node*> nodes;
+    std::vector<const osmium::Way*> ways;
+    std::vector<const osmium::Way*> latest_ways; // History files are sorted by id, then version
+    for (const auto& item : objects) {
+        if (item.type() == osmium::item_type::node) {
+            nodes.push_back(static_cast<const osmium::Node*>(&item));
+        } else if (item.type() == osmium::item_type::way) {
+            const auto way = static_cast<const osmium::Way*>(&item);
+            if (!latest_ways.empty() && latest_ways.back()->id() == way->id()) {
+                latest_ways.back() = way;
+            } else {
+                latest_ways.push_back(way);
+            }
+            ways.push_back(way);
+        }
+    }
+    std::cerr << "Loaded " << nodes.size() << " node and " << ways.size() << " way versions" << std::endl;
+
+    //Encoding
+    std::vector<std::string> encoded_nodes(nodes.size());
+    measure("encode_node", nodes.size(), [&](const unsigned long i) {
+        encoded_nodes[i] = osmwayback::encode_node(*nodes[i]);
+        return encoded_nodes[i].size();
+    });
+
+    std::vector<std::string> encoded_ways(ways.size());
+    measure("encode_way", ways.size(), [&](const unsigned long i) {
+        encoded_ways[i] = osmwayback::encode_way(*ways[i]);
+        return encoded_ways[i].size();
+    });
+
+    //Decoding into the @history JSON form
+    measure("decode_node", nodes.size(), [&](const unsigned long i) {
+        rapidjson::Document doc;
+        osmwayback::decode_node(encoded_nodes[i], &doc);
+        return encoded_nodes[i].size();
+    });
+
+    measure("decode_way", ways.size(), [&](const unsigned long i) {
+        rapidjson::Document doc;
+        osmwayback::decode_way(encoded_ways[i], &doc);
+        return encoded_ways[i].size();
+    });
+
+    //Keys and lookups
+    measure("make_lookup", nodes.size(), [&](const unsigned long i) {
+        return make_lookup(nodes[i]->id(), nodes[i]->version()).size();
+    });
+
+    {
+        ObjectStore store(index_dir, false);
+
+        measure("get_tags_node", nodes.size(), [&](const unsigned long i) {
+            std::string value;
+            store.get_tags(nodes[i]->id(), 1, nodes[i]->version(), &value);
+            return value.size();
+        });
+
+        //The per-feature work of add_history and add_geometry
+        osmwayback::EnrichStats stats;
+        std::vector<rapidjson::Document> features(latest_ways.size());
+        for (size_t i = 0; i < latest_ways.size(); i++) {
+            make_way_feature(*latest_ways[i], &features[i]);
+        }
+
+        //The enrichment and the JSON output are timed separately, the output size is reported with the latter
+        measure("add_history", latest_ways.size(), [&](const unsigned long i) {
+            osmwayback::add_history(&store, features[i], &stats);
+            return 0;
+        }, false);
+
+        measure("serialize_history", latest_ways.size(), [&](const unsigned long i) {
+            return serialize(features[i]).size();
+        });
+
+        measure("add_node_locations", latest_ways.size(), [&](const unsigned long i) {
+            osmwayback::add_node_locations(&store, features[i], &stats);
+            return 0;
+        }, false);
+
+        measure("serialize_node_locations", latest_ways.size(), [&](const unsigned long i) {
+            return serialize(features[i]).size();
+        });
+    }
+
+    //Writing
+    {
+        ObjectStore scratch(scratch_dir, true);
+        measure("upsert_node_location", nodes.size(), [&](const unsigned long i) {
+            scratch.upsert_node_location(*nodes[i]);
+            return 0;
+        }, false);
+    }
+    rocksdb::DestroyDB(scratch_dir, rocksdb::Options{});
+
+    write_results();
+}
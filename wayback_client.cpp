@@ -0,0 +1,106 @@
+/*
+
+  USAGE: wayback_client <SOCKET PATH> [REQUEST]
+
+  Sends requests to a running wayback_server and prints one response per line.
+  Without a REQUEST argument, requests are read from stdin, one per line, e.g.
+
+    echo "history way 123" | wayback_client /tmp/wayback.sock
+
+    cat features.geojson | sed 's/^/feature /' | wayback_client /tmp/wayback.sock
+
+*/
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool send_all(const int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Reads one response line, keeping anything after it in `pending`
+bool read_line(const int fd, std::string& pending, std::string* line) {
+    char buffer[64 * 1024];
+    std::string::size_type end;
+    while ((end = pending.find('\n')) == std::string::npos) {
+        const ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return false;
+        }
+        pending.append(buffer, static_cast<size_t>(n));
+    }
+    line->assign(pending, 0, end);
+    pending.erase(0, end + 1);
+    return true;
+}
+
+bool request(const int fd, std::string& pending, const std::string& line) {
+    std::string response;
+    if (!send_all(fd, line + "\n") || !read_line(fd, pending, &response)) {
+        std::cerr << "Connection to server lost" << std::endl;
+        return false;
+    }
+    std::cout << response << "\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " SOCKET_PATH [REQUEST]" << std::endl;
+        std::exit(1);
+    }
+
+    const char* socket_path = argv[1];
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (std::strlen(socket_path) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long: " << socket_path << std::endl;
+        std::exit(1);
+    }
+    std::strcpy(address.sun_path, socket_path);
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        std::cerr << "Could not connect to " << socket_path << ": " << std::strerror(errno) << std::endl;
+        std::exit(2);
+    }
+
+    std::string pending;
+    bool ok = true;
+    if (argc > 2) {
+        std::string line = argv[2];
+        for (int i = 3; i < argc; i++) {
+            line += " ";
+            line += argv[i];
+        }
+        ok = request(fd, pending, line);
+    } else {
+        for (std::string line; ok && std::getline(std::cin, line);) {
+            if (!line.empty()) {
+                ok = request(fd, pending, line);
+            }
+        }
+    }
+
+    ::close(fd);
+    if (!ok) {
+        std::exit(3);
+    }
+}
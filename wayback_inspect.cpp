@@ -0,0 +1,520 @@
+/*
+
+  USAGE: wayback_inspect <INDEX DIR> [OPTIONS]
+
+  Profiles what an index holds, so storage layout decisions can start from
+  data. Every column family is scanned in parallel, in key ranges split at
+  the boundaries of its table files, and reported with:
+
+  - histograms of key and value sizes (power of two buckets)
+  - nodes, ways, relations: versions per object, tags per version, bytes per
+    object, how the bytes of the stored records split across fields
+    (timestamps, users, tags, refs, coordinates, ...), and the objects with
+    the most bytes over all their versions
+  - locations: changeset entries per node
+
+  OPTIONS:
+    --sample N      only inspect one in N objects, chosen by a hash of the id
+                    so all versions of an object are in or out (default 1)
+    --threads N     number of scan threads (default: all cores)
+    --top N         number of largest objects listed per type (default 10)
+    --family NAME   only inspect this column family; can be repeated
+
+  With --sample, all counts and bytes are those of the sample.
+
+*/
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+
+size_t SAMPLE = 1;
+size_t TOP = 10;
+
+// Counts of values in power of two buckets: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i)
+class Histogram {
+    std::array<uint64_t, 65> m_buckets{};
+    uint64_t m_count{0};
+    uint64_t m_sum{0};
+    uint64_t m_max{0};
+
+    static size_t bucket(uint64_t value) {
+        size_t b = 0;
+        while (value) {
+            value >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    static uint64_t upper_bound(const size_t b) {
+        return b == 0 ? 0 : (b >= 64 ? UINT64_MAX : (uint64_t(1) << b) - 1);
+    }
+
+public:
+    void add(const uint64_t value) {
+        m_buckets[bucket(value)]++;
+        m_count++;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t b = 0; b < m_buckets.size(); b++) {
+            m_buckets[b] += other.m_buckets[b];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile
+    uint64_t percentile(const double p) const {
+        const uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(m_count));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < m_buckets.size(); b++) {
+            seen += m_buckets[b];
+            if (seen > rank) {
+                return std::min(upper_bound(b), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    void print(const std::string& name) const {
+        if (m_count == 0) {
+            return;
+        }
+        std::cout << "  " << name << ": n=" << m_count
+                  << " mean=" << std::fixed << std::setprecision(1) << static_cast<double>(m_sum) / static_cast<double>(m_count)
+                  << " p50<=" << percentile(0.5) << " p90<=" << percentile(0.9) << " p99<=" << percentile(0.99)
+                  << " max=" << m_max << std::endl;
+        for (size_t b = 0; b < m_buckets.size(); b++) {
+            if (m_buckets[b] == 0) {
+                continue;
+            }
+            const double share = 100.0 * static_cast<double>(m_buckets[b]) / static_cast<double>(m_count);
+            std::ostringstream range;
+            range << (b == 0 ? 0 : (uint64_t(1) << (b - 1))) << "-" << upper_bound(b);
+            std::cout << "    " << std::setw(24) << range.str() << std::setw(14) << m_buckets[b]
+                      << std::setw(7) << std::setprecision(1) << share << "% "
+                      << std::string(static_cast<size_t>(share / 2), '#') << std::endl;
+        }
+    }
+};
+
+// Where the bytes of a stored record go, see the field list in pbf_encoding.hpp
+enum FieldCategory {
+    timestamp_field,
+    changeset_field,
+    version_field,
+    uid_field,
+    user_field,
+    flags_field,
+    coordinates_field,
+    refs_field,
+    members_field,
+    tags_field,
+    tag_diffs_field,
+    legacy_json_field,
+    other_field,
+    category_count
+};
+
+const char* const CATEGORY_NAMES[category_count] = {
+    "timestamps", "changesets", "versions", "uids", "users", "flags", "coordinates",
+    "refs", "members", "tags", "tag diffs", "legacy json", "other"
+};
+
+FieldCategory field_category(const int osm_type, const uint32_t tag) {
+    switch (tag) {
+        case 1:  return timestamp_field;
+        case 2:  return changeset_field;
+        case 3:  return version_field;
+        case 4:  return uid_field;
+        case 5:  return user_field;
+        case 6:
+        case 7:
+        case 14: return flags_field;
+        case 8:  return osm_type == 1 ? coordinates_field : refs_field;
+        case 9:  return coordinates_field;
+        case 10: return tags_field;
+        case 11:
+        case 12:
+        case 13: return members_field;
+        case 15:
+        case 16:
+        case 17: return tag_diffs_field;
+        case 18:
+        case 19: return refs_field;
+        default: return other_field;
+    }
+}
+
+bool read_varint(const char** data, const char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *data < end; shift += 7) {
+        const uint8_t byte = static_cast<uint8_t>(*(*data)++);
+        *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*  Calls func(tag, bytes) for every field of a PBF record, where bytes
+ *  includes the field's key. False if the record is not valid PBF.
+ */
+template <typename TFunc>
+bool for_each_field(const std::string& data, TFunc&& func) {
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while (p < end) {
+        const char* start = p;
+        uint64_t key;
+        uint64_t value;
+        if (!read_varint(&p, end, &key)) {
+            return false;
+        }
+        switch (key & 7) {
+            case 0:
+                if (!read_varint(&p, end, &value)) {
+                    return false;
+                }
+                break;
+            case 1:
+                if (end - p < 8) {
+                    return false;
+                }
+                p += 8;
+                break;
+            case 2:
+                if (!read_varint(&p, end, &value) || static_cast<uint64_t>(end - p) < value) {
+                    return false;
+                }
+                p += value;
+                break;
+            case 5:
+                if (end - p < 4) {
+                    return false;
+                }
+                p += 4;
+                break;
+            default:
+                return false;
+        }
+        func(static_cast<uint32_t>(key >> 3), static_cast<uint64_t>(p - start));
+    }
+    return true;
+}
+
+struct LargeObject {
+    std::string id{};
+    uint64_t bytes{0};
+    uint64_t versions{0};
+};
+
+bool larger(const LargeObject& lhs, const LargeObject& rhs) {
+    return lhs.bytes > rhs.bytes;
+}
+
+struct FamilyStats {
+    uint64_t keys{0};
+    uint64_t key_bytes{0};
+    uint64_t value_bytes{0};
+    Histogram key_sizes{};
+    Histogram value_sizes{};
+
+    //Object families
+    Histogram versions_per_object{};
+    Histogram tags_per_version{};
+    Histogram object_bytes{};
+    std::array<uint64_t, category_count> category_bytes{};
+    std::vector<LargeObject> largest{}; // A min-heap of the TOP largest objects
+
+    //Locations
+    Histogram entries_per_node{};
+
+    void add_object(const LargeObject& object) {
+        versions_per_object.add(object.versions);
+        object_bytes.add(object.bytes);
+        largest.push_back(object);
+        std::push_heap(largest.begin(), largest.end(), larger);
+        if (largest.size() > TOP) {
+            std::pop_heap(largest.begin(), largest.end(), larger);
+            largest.pop_back();
+        }
+    }
+
+    void merge(const FamilyStats& other) {
+        keys += other.keys;
+        key_bytes += other.key_bytes;
+        value_bytes += other.value_bytes;
+        key_sizes.merge(other.key_sizes);
+        value_sizes.merge(other.value_sizes);
+        versions_per_object.merge(other.versions_per_object);
+        tags_per_version.merge(other.tags_per_version);
+        object_bytes.merge(other.object_bytes);
+        for (size_t c = 0; c < category_count; c++) {
+            category_bytes[c] += other.category_bytes[c];
+        }
+        for (const auto& object : other.largest) {
+            largest.push_back(object);
+            std::push_heap(largest.begin(), largest.end(), larger);
+            if (largest.size() > TOP) {
+                std::pop_heap(largest.begin(), largest.end(), larger);
+                largest.pop_back();
+            }
+        }
+        entries_per_node.merge(other.entries_per_node);
+    }
+};
+
+int object_type(const std::string& family) {
+    if (family == "nodes") return 1;
+    if (family == "ways") return 2;
+    if (family == "relations") return 3;
+    return 0;
+}
+
+// Families keyed by "id!version" or "id", as opposed to the binary keys of keys.hpp and spatial.hpp
+bool has_text_keys(const std::string& family) {
+    return object_type(family) != 0 || family == "locations";
+}
+
+// The id part of a text key
+std::string key_id(const rocksdb::Slice& key) {
+    const std::string k = key.ToString();
+    return k.substr(0, k.find('!'));
+}
+
+bool sampled(const std::string& id) {
+    return SAMPLE <= 1 || std::hash<std::string>{}(id) % SAMPLE == 0;
+}
+
+void inspect_value(const std::string& family, const int osm_type, const rocksdb::Slice& value, FamilyStats* stats) {
+    if (osm_type != 0) {
+        const std::string data = value.ToString();
+        if (osmwayback::is_legacy_json(data)) {
+            stats->category_bytes[legacy_json_field] += data.size();
+            return;
+        }
+        uint64_t tag_fields = 0;
+        const bool valid = for_each_field(data, [&](const uint32_t tag, const uint64_t bytes) {
+            stats->category_bytes[field_category(osm_type, tag)] += bytes;
+            if (tag == 10) {
+                tag_fields++;
+            }
+        });
+        if (valid) {
+            stats->tags_per_version.add(tag_fields / 2);
+        } else {
+            stats->category_bytes[other_field] += data.size();
+        }
+    } else if (family == "locations") {
+        rapidjson::Document doc;
+        if (!doc.Parse(value.data(), value.size()).HasParseError() && doc.IsObject()) {
+            stats->entries_per_node.add(doc.MemberCount());
+        }
+    }
+}
+
+// Scans the keys in [begin, end) of one family, "" for an open end
+void scan_range(ObjectStore* store, const std::string& family, const std::string& begin, const std::string& end, FamilyStats* stats) {
+    std::unique_ptr<rocksdb::Iterator> it{store->new_iterator(family)};
+    const int osm_type = object_type(family);
+    const bool text_keys = has_text_keys(family);
+
+    LargeObject object;
+    bool in_sample = false;
+    for (begin.empty() ? it->SeekToFirst() : it->Seek(begin); it->Valid(); it->Next()) {
+        const rocksdb::Slice key = it->key();
+        if (!end.empty() && key.compare(end) >= 0) {
+            break;
+        }
+
+        if (text_keys) {
+            //All versions of an object are next to each other
+            if (object.versions == 0 || !key.starts_with(object.id + "!")) {
+                if (object.versions > 0 && in_sample && osm_type != 0) {
+                    stats->add_object(object);
+                }
+                object.id = key_id(key);
+                object.bytes = 0;
+                object.versions = 0;
+                in_sample = sampled(object.id);
+            }
+            object.versions++;
+        } else {
+            in_sample = sampled(key.ToString());
+        }
+        if (!in_sample) {
+            continue;
+        }
+
+        const rocksdb::Slice value = it->value();
+        stats->keys++;
+        stats->key_bytes += key.size();
+        stats->value_bytes += value.size();
+        stats->key_sizes.add(key.size());
+        stats->value_sizes.add(value.size());
+        object.bytes += key.size() + value.size();
+
+        inspect_value(family, osm_type, value, stats);
+    }
+    if (object.versions > 0 && in_sample && osm_type != 0) {
+        stats->add_object(object);
+    }
+}
+
+FamilyStats inspect_family(ObjectStore* store, const std::string& family, const size_t threads) {
+    const std::vector<std::string> boundaries = store->range_boundaries(family, threads * 4, has_text_keys(family));
+    const size_t ranges = boundaries.size() + 1;
+
+    std::vector<FamilyStats> range_stats(ranges);
+    std::atomic<size_t> next_range{0};
+    auto worker = [&]() {
+        for (size_t r = next_range++; r < ranges; r = next_range++) {
+            const std::string begin = r == 0 ? "" : boundaries[r - 1];
+            const std::string end = r + 1 == ranges ? "" : boundaries[r];
+            scan_range(store, family, begin, end, &range_stats[r]);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min(threads, ranges); t++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    FamilyStats stats;
+    for (const auto& s : range_stats) {
+        stats.merge(s);
+    }
+    return stats;
+}
+
+std::string format_bytes(const uint64_t bytes) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (bytes >= (uint64_t(1) << 30)) {
+        out << static_cast<double>(bytes) / (1 << 30) << " GB";
+    } else if (bytes >= (1 << 20)) {
+        out << static_cast<double>(bytes) / (1 << 20) << " MB";
+    } else if (bytes >= (1 << 10)) {
+        out << static_cast<double>(bytes) / (1 << 10) << " KB";
+    } else {
+        out << bytes << " B";
+    }
+    return out.str();
+}
+
+void report(const std::string& family, FamilyStats& stats) {
+    std::cout << family << ": " << stats.keys << " keys, " << format_bytes(stats.key_bytes) << " keys + "
+              << format_bytes(stats.value_bytes) << " values (uncompressed)" << std::endl;
+    stats.key_sizes.print("key bytes");
+    stats.value_sizes.print("value bytes");
+    stats.versions_per_object.print("versions per object");
+    stats.object_bytes.print("bytes per object");
+    stats.tags_per_version.print("tags per version");
+    stats.entries_per_node.print("entries per node");
+
+    if (object_type(family) != 0 && stats.value_bytes > 0) {
+        std::cout << "  value bytes by field:" << std::endl;
+        for (size_t c = 0; c < category_count; c++) {
+            if (stats.category_bytes[c] == 0) {
+                continue;
+            }
+            std::cout << "    " << std::setw(14) << CATEGORY_NAMES[c] << std::setw(12) << format_bytes(stats.category_bytes[c])
+                      << std::setw(7) << std::setprecision(1)
+                      << 100.0 * static_cast<double>(stats.category_bytes[c]) / static_cast<double>(stats.value_bytes) << "%" << std::endl;
+        }
+    }
+
+    if (!stats.largest.empty()) {
+        std::sort(stats.largest.begin(), stats.largest.end(), larger);
+        std::cout << "  largest objects:" << std::endl;
+        for (const auto& object : stats.largest) {
+            std::cout << "    " << std::setw(14) << object.id << std::setw(12) << format_bytes(object.bytes)
+                      << std::setw(8) << object.versions << " versions" << std::endl;
+        }
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR [--sample N] [--threads N] [--top N] [--family NAME]..." << std::endl;
+        std::exit(1);
+    }
+
+    const std::string index_dir = argv[1];
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> families;
+
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (i + 1 < argc && option == "--sample") {
+            SAMPLE = std::max(1ul, std::stoul(argv[++i]));
+        } else if (i + 1 < argc && option == "--threads") {
+            threads = std::max(1ul, std::stoul(argv[++i]));
+        } else if (i + 1 < argc && option == "--top") {
+            TOP = std::stoul(argv[++i]);
+        } else if (i + 1 < argc && option == "--family") {
+            families.push_back(argv[++i]);
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            std::exit(1);
+        }
+    }
+    if (families.empty()) {
+        families = {"nodes", "ways", "relations", "locations", "spatial", "changesets", "users", "parents"};
+    }
+
+    ObjectStore store(index_dir, false);
+
+    std::cout << "Index " << index_dir;
+    if (SAMPLE > 1) {
+        std::cout << ", sampling 1 in " << SAMPLE << " objects";
+    }
+    std::cout << std::endl << std::endl;
+
+    for (const auto& family : families) {
+        std::unique_ptr<rocksdb::Iterator> it{store.new_iterator(family)};
+        if (!it) {
+            std::cout << family << ": not in this index" << std::endl << std::endl;
+            continue;
+        }
+        it.reset();
+
+        const auto start = std::chrono::steady_clock::now();
+        FamilyStats stats = inspect_family(&store, family, threads);
+        const auto diff = std::chrono::steady_clock::now() - start;
+        report(family, stats);
+        std::cerr << "Inspected " << family << " in " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
+    }
+}
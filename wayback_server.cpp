@@ -0,0 +1,404 @@
+/*
+
+  USAGE: wayback_server <INDEX DIR> <SOCKET PATH> [THREADS] [CACHE MB]
+
+  Keeps the rocksdb INDEX open with a large block cache (CACHE MB, default 1024)
+  and answers history requests on a Unix domain socket, so that interactive
+  tools don't pay for opening a cold index on every lookup. One thread reads
+  every connection, and each request is answered by one of THREADS worker
+  threads (default 4), so idle connections don't hold a worker.
+
+  The protocol is line based: one request per line, one JSON response per line.
+  A connection can send any number of requests, and gets the responses in the
+  same order.
+
+    ping                          {"ok":true}
+    history <TYPE> <ID>           {"@type":..,"@id":..,"@history":[...]}
+    locations <NODE ID>           every location of the node, as stored by build_lookup_index
+    feature <GEOJSON FEATURE>     the feature as `add_history | add_geometry` would output it
+    stats                         request and lookup counters
+
+  TYPE is node, way or relation. Errors are returned as {"error":"..."}.
+
+  wayback_client sends requests from stdin and prints the responses.
+
+*/
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include "rapidjson/document.h"
+#pragma GCC diagnostic pop
+
+#include "rocksdb/db.h"
+
+#include "db.hpp"
+#include "enrich.hpp"
+
+osmwayback::EnrichStats stats;
+std::atomic<long> request_count{0};
+std::atomic<long> error_count{0};
+
+const char* socket_path = nullptr;
+
+int osm_type(const std::string& type) {
+    if (type == "node") return 1;
+    if (type == "way") return 2;
+    if (type == "relation") return 3;
+    return 0;
+}
+
+std::string write_json(const rapidjson::Value& value) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    value.Accept(writer);
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+std::string error_response(const std::string& message) {
+    error_count++;
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("error");
+    writer.String(message);
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+std::string history(ObjectStore* store, const std::string& type, const int64_t osm_id) {
+    const int t = osm_type(type);
+    if (t == 0) {
+        return error_response("unknown type: " + type);
+    }
+    const int version = store->latest_version(osm_id, t);
+    if (version == 0) {
+        return error_response("not found");
+    }
+
+    //add_history works on features, so wrap the object in one
+    rapidjson::Document doc;
+    doc.SetObject();
+    rapidjson::Document::AllocatorType& a = doc.GetAllocator();
+    rapidjson::Value properties(rapidjson::kObjectType);
+    rapidjson::Value type_value;
+    type_value.SetString(type, a);
+    properties.AddMember("@type", type_value, a);
+    properties.AddMember("@id", osm_id, a);
+    properties.AddMember("@version", version, a);
+    doc.AddMember("properties", properties, a);
+
+    osmwayback::add_history(store, doc, &stats);
+
+    rapidjson::Value& result = doc["properties"];
+    result.RemoveMember("@version");
+    return write_json(result);
+}
+
+std::string locations(ObjectStore* store, const std::string& node_id) {
+    std::string value;
+    if (!store->get_node_locations(node_id, &value).ok()) {
+        stats.node_lookup_failures++;
+        return error_response("not found");
+    }
+    return value;
+}
+
+std::string feature(ObjectStore* store, const std::string& line) {
+    rapidjson::Document doc;
+    if (doc.Parse<0>(line.c_str()).HasParseError()) {
+        return error_response("invalid feature");
+    }
+    if (!doc.IsObject() || !doc.HasMember("properties")) {
+        return error_response("feature without properties");
+    }
+    const rapidjson::Value& properties = doc["properties"];
+    if (!properties.HasMember("@type") || !properties["@type"].IsString() ||
+        !properties.HasMember("@id") || !properties["@id"].IsInt64() ||
+        !properties.HasMember("@version") || !properties["@version"].IsInt()) {
+        return error_response("feature without @type, @id and @version");
+    }
+
+    osmwayback::add_history(store, doc, &stats);
+    if (std::string{doc["properties"]["@type"].GetString()} != "node") {
+        osmwayback::add_node_locations(store, doc, &stats);
+    }
+    return write_json(doc);
+}
+
+std::string server_stats() {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("requests");
+    writer.Int64(request_count.load());
+    writer.Key("errors");
+    writer.Int64(error_count.load());
+    writer.Key("history_count");
+    writer.Int64(stats.history_count.load());
+    writer.Key("lookup_fail");
+    writer.Int64(stats.lookup_fail.load());
+    writer.Key("node_lookup_failures");
+    writer.Int64(stats.node_lookup_failures.load());
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+std::string handle_request(ObjectStore* store, const std::string& line) {
+    request_count++;
+
+    const auto space = line.find(' ');
+    const std::string command = line.substr(0, space);
+    const std::string args = (space == std::string::npos) ? "" : line.substr(space + 1);
+
+    try {
+        if (command == "ping") {
+            return "{\"ok\":true}";
+        } else if (command == "history") {
+            std::istringstream in{args};
+            std::string type;
+            int64_t osm_id;
+            if (!(in >> type >> osm_id)) {
+                return error_response("usage: history <TYPE> <ID>");
+            }
+            return history(store, type, osm_id);
+        } else if (command == "locations") {
+            if (args.empty()) {
+                return error_response("usage: locations <NODE ID>");
+            }
+            return locations(store, args);
+        } else if (command == "feature") {
+            return feature(store, args);
+        } else if (command == "stats") {
+            return server_stats();
+        }
+    } catch (const std::exception& ex) {
+        return error_response(ex.what());
+    }
+    return error_response("unknown command: " + command);
+}
+
+bool send_all(const int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/*  A client connection. Its requests are answered one at a time and in order,
+ *  by whichever worker takes it from the work queue; the socket is closed
+ *  once it is neither read nor answered any more.
+ */
+struct Connection {
+    const int fd;
+    std::string partial{};               //An incomplete request line, read thread only
+    std::deque<std::string> requests{};  //Guarded by queue_mutex
+    bool queued{false};                  //In work_queue or being answered, guarded by queue_mutex
+    bool failed{false};                  //A response could not be sent, only the answering worker touches it
+
+    explicit Connection(const int connection_fd) :
+        fd(connection_fd) {
+    }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    ~Connection() {
+        ::close(fd);
+    }
+};
+
+std::mutex queue_mutex;
+std::condition_variable queue_ready;
+std::deque<std::shared_ptr<Connection>> work_queue; //Connections with requests to answer
+
+void submit(const std::shared_ptr<Connection>& connection, std::string&& line) {
+    std::lock_guard<std::mutex> lock{queue_mutex};
+    connection->requests.push_back(std::move(line));
+    if (!connection->queued) {
+        connection->queued = true;
+        work_queue.push_back(connection);
+        queue_ready.notify_one();
+    }
+}
+
+void worker(ObjectStore* store) {
+    while (true) {
+        std::shared_ptr<Connection> connection;
+        std::string line;
+        {
+            std::unique_lock<std::mutex> lock{queue_mutex};
+            queue_ready.wait(lock, [] { return !work_queue.empty(); });
+            connection = std::move(work_queue.front());
+            work_queue.pop_front();
+            line = std::move(connection->requests.front());
+            connection->requests.pop_front();
+        }
+
+        if (!connection->failed && !send_all(connection->fd, handle_request(store, line) + "\n")) {
+            //The read thread sees the connection close and stops reading it
+            connection->failed = true;
+            ::shutdown(connection->fd, SHUT_RDWR);
+        }
+
+        std::lock_guard<std::mutex> lock{queue_mutex};
+        if (connection->requests.empty()) {
+            connection->queued = false;
+        } else {
+            //One request at a time, so that a busy connection doesn't starve the others
+            work_queue.push_back(connection);
+            queue_ready.notify_one();
+        }
+    }
+}
+
+// Splits what a connection sent into request lines and queues them
+void read_requests(const std::shared_ptr<Connection>& connection, const char* data, const size_t size) {
+    std::string& pending = connection->partial;
+    pending.append(data, size);
+
+    size_t start = 0;
+    for (size_t end; (end = pending.find('\n', start)) != std::string::npos; start = end + 1) {
+        std::string line = pending.substr(start, end - start);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            submit(connection, std::move(line));
+        }
+    }
+    pending.erase(0, start);
+}
+
+// Accepts connections and reads their requests until poll or accept fails
+void serve(const int listen_fd) {
+    std::vector<pollfd> fds{pollfd{listen_fd, POLLIN, 0}};
+    std::vector<std::shared_ptr<Connection>> connections; //connections[i] is read from fds[i + 1]
+    char buffer[64 * 1024];
+
+    while (true) {
+        if (::poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        //Backwards, so that closed connections can be removed on the way
+        for (size_t i = fds.size() - 1; i > 0; i--) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            const ssize_t n = ::recv(fds[i].fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                //Requests already queued are still answered, the workers keep the connection open
+                fds.erase(fds.begin() + static_cast<std::ptrdiff_t>(i));
+                connections.erase(connections.begin() + static_cast<std::ptrdiff_t>(i - 1));
+                continue;
+            }
+            read_requests(connections[i - 1], buffer, static_cast<size_t>(n));
+        }
+
+        if (fds[0].revents & POLLIN) {
+            const int fd = ::accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) {
+                fds.push_back(pollfd{fd, POLLIN, 0});
+                connections.push_back(std::make_shared<Connection>(fd));
+            } else if (errno != EINTR) {
+                std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+                return;
+            }
+        }
+    }
+}
+
+void shutdown_server(int) {
+    ::unlink(socket_path);
+    std::_Exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " INDEX_DIR SOCKET_PATH [THREADS] [CACHE_MB]" << std::endl;
+        std::exit(1);
+    }
+
+    std::string index_dir = argv[1];
+    socket_path = argv[2];
+    const int threads = (argc > 3) ? std::atoi(argv[3]) : 4;
+    const size_t cache_mb = (argc > 4) ? std::strtoul(argv[4], nullptr, 10) : 1024;
+
+    if (threads < 1) {
+        std::cerr << "THREADS must be at least 1" << std::endl;
+        std::exit(1);
+    }
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (std::strlen(socket_path) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long: " << socket_path << std::endl;
+        std::exit(1);
+    }
+    std::strcpy(address.sun_path, socket_path);
+
+    ObjectStore store(index_dir, false, cache_mb);
+
+    const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Could not create socket: " << std::strerror(errno) << std::endl;
+        std::exit(2);
+    }
+
+    ::unlink(socket_path);
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(listen_fd, 128) < 0) {
+        std::cerr << "Could not listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        std::exit(2);
+    }
+
+    std::signal(SIGINT, shutdown_server);
+    std::signal(SIGTERM, shutdown_server);
+
+    std::cerr << "Serving " << index_dir << " on " << socket_path << " with " << threads
+              << " threads and a " << cache_mb << " MB block cache" << std::endl;
+
+    for (int i = 0; i < threads; i++) {
+        std::thread{worker, &store}.detach();
+    }
+    serve(listen_fd);
+
+    ::close(listen_fd);
+    ::unlink(socket_path);
+    std::_Exit(2);
+}